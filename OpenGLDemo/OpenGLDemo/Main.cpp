@@ -10,6 +10,52 @@
 
 #define GLSL(src) "#version 450 core\n" #src
 
+//A texture whose pixels are being decoded into a mapped pixel unpack buffer
+struct PendingTexture
+{
+	GLuint pbo;
+	int id;
+};
+
+//Map an unpack buffer big enough for the image and queue its decode on the batch
+static void queueTexture(stbi_batch *batch, const char *filename, PendingTexture &t)
+{
+	int width, height, bpp = 0;
+	t.pbo = 0;
+	t.id = -1;
+	if (!batch || !stbi_info(filename, &width, &height, &bpp))
+		return;
+
+	//Rows have to start on 4-byte boundaries, GL's default unpack alignment
+	int pitch = (width * 3 + 3) & ~3;
+	glGenBuffers(1, &t.pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t.pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, pitch * height, NULL, GL_STREAM_DRAW);
+	stbi_uc *pixels = (stbi_uc *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+	if (pixels)
+		t.id = stbi_batch_load_into(batch, filename, pixels, pitch, pitch * height, STBI_rgb, NULL, NULL);
+	if (pixels && t.id < 0)
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); //The buffer stays mapped while the workers write to it
+}
+
+//Wait for the decode to finish and upload the buffer to the bound texture
+static bool finishTexture(stbi_batch *batch, PendingTexture &t)
+{
+	stbi_batch_result result;
+	bool loaded = false;
+	if (t.id >= 0) {
+		loaded = stbi_batch_wait(batch, t.id, &result) != 0;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t.pbo);
+		loaded = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) && loaded;
+		if (loaded)
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, result.x, result.y, 0, GL_RGB, GL_UNSIGNED_BYTE, 0); //Reads from the bound unpack buffer
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	glDeleteBuffers(1, &t.pbo);
+	return loaded;
+}
+
 int main(int argc, char *argv[])
 {
 	auto startingTimer = std::chrono::high_resolution_clock::now();
@@ -196,16 +242,18 @@ int main(int argc, char *argv[])
 	GLuint textures[2];
 	glGenTextures(2, textures);
 
-	int width, height, bpp = 0;
-	unsigned char* image;
+	//Decode both images at once on worker threads
+	stbi_batch *batch = stbi_batch_create(2, 2);
+	PendingTexture pending[2];
+	queueTexture(batch, "sample.png", pending[0]);
+	queueTexture(batch, "sample2.png", pending[1]);
 
 	//Load first image
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, textures[0]);
-	image = stbi_load("sample.png", &width, &height, &bpp, 3);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+	if (!finishTexture(batch, pending[0]))
+		OutputDebugStringA("Failed to load sample.png\n");
 	glUniform1i(glGetUniformLocation(shaderProgram, "texKitten"), 0);
-	stbi_image_free(image);
 
 	//Here we wrap textures and sample them by repeating them
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);	//Set wrap parameter for coordinate s to GL_REPEAT
@@ -218,10 +266,11 @@ int main(int argc, char *argv[])
 	//Load second image
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, textures[1]);
-	image = stbi_load("sample2.png", &width, &height, &bpp, 3);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+	if (!finishTexture(batch, pending[1]))
+		OutputDebugStringA("Failed to load sample2.png\n");
+	if (batch)
+		stbi_batch_free(batch);
 	glUniform1i(glGetUniformLocation(shaderProgram, "texPuppy"), 1);
-	stbi_image_free(image);
 
 	//Here we wrap textures and sample them by repeating them
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);	//Set wrap parameter for coordinate s to GL_REPEAT
@@ -0,0 +1,190 @@
+// times the PNG unfilter and row widening kernels in stb_image.h, the
+// SSE2 and AVX2 ones against the generic C ones, and checks that they all
+// produce the same bytes. not part of the demo; build it on its own with
+// optimizations on, e.g.
+//
+//    cl /O2 png_unfilter_bench.c
+//    cc -O2 png_unfilter_bench.c -lm
+//
+// rates are in MB of output per second, best of 5 runs, for 1920-pixel
+// rows of random data (so every kernel sees the same bytes). the AVX2
+// column runs the SSE2 kernel wherever there is no AVX2 one.
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_WIDTH  1920
+#define BENCH_ROWS   32
+
+typedef struct
+{
+   char const *name;
+   stbi__png_unfilter_func unfilter[5];
+   stbi__png_expand_func expand;
+} bench_level;
+
+static stbi_uc *raw_rows, *out_rows, *ref_rows;
+
+// runs 'fn' over the rows until a run takes at least 50ms, and returns the
+// best seconds per row over 5 such runs
+static double bench_time(void (*fn)(void *), void *arg)
+{
+   double best = 1e30;
+   int reps = 1, run;
+   for (;;) {
+      clock_t t0 = clock();
+      int i;
+      for (i=0; i < reps; ++i) fn(arg);
+      if (clock() - t0 >= CLOCKS_PER_SEC / 20) break;
+      reps *= 2;
+   }
+   for (run=0; run < 5; ++run) {
+      clock_t t0 = clock();
+      double t;
+      int i;
+      for (i=0; i < reps; ++i) fn(arg);
+      t = (double) (clock() - t0) / CLOCKS_PER_SEC / reps / BENCH_ROWS;
+      if (t < best) best = t;
+   }
+   return best;
+}
+
+typedef struct
+{
+   stbi__png_unfilter_func fn;
+   int bpp;
+} unfilter_job;
+
+static void run_unfilter(void *arg)
+{
+   unfilter_job *u = (unfilter_job *) arg;
+   int n = BENCH_WIDTH * u->bpp, j;
+   // the first row gets a prior row of random bytes too
+   u->fn(out_rows, raw_rows + (BENCH_ROWS-1)*n, raw_rows, n, u->bpp);
+   for (j=1; j < BENCH_ROWS; ++j)
+      u->fn(out_rows + j*n, out_rows + (j-1)*n, raw_rows + j*n, n, u->bpp);
+}
+
+typedef struct
+{
+   stbi__png_expand_func fn;
+   int img_n, out_n, depth;
+} expand_job;
+
+static void run_expand(void *arg)
+{
+   expand_job *e = (expand_job *) arg;
+   int in_stride  = BENCH_WIDTH * e->img_n * (e->depth/8);
+   int out_stride = BENCH_WIDTH * e->out_n * (e->depth/8);
+   int j;
+   for (j=0; j < BENCH_ROWS; ++j)
+      e->fn(out_rows + j*out_stride, raw_rows + j*in_stride, BENCH_WIDTH, e->img_n, e->out_n, e->depth);
+}
+
+static size_t rows_size(int row_bytes)
+{
+   return (size_t) row_bytes * BENCH_ROWS;
+}
+
+int main(void)
+{
+   static char const *filter_names[5] = { "none", "sub", "up", "avg", "paeth" };
+   static int const bpps[6] = { 1, 2, 3, 4, 6, 8 };
+   static int const expands[5][3] = { { 1,2,8 }, { 3,4,8 }, { 3,3,16 }, { 3,4,16 }, { 4,4,16 } };
+   size_t size = rows_size(BENCH_WIDTH * 8), i;
+   bench_level levels[3];
+   int num_levels = 0, f, b, l, bad = 0;
+
+   raw_rows = (stbi_uc *) malloc(size);
+   out_rows = (stbi_uc *) malloc(size);
+   ref_rows = (stbi_uc *) malloc(size);
+   if (!raw_rows || !out_rows || !ref_rows) return 1;
+   srand(1);
+   for (i=0; i < size; ++i) raw_rows[i] = (stbi_uc) (rand() >> 4);
+
+   levels[0].name = "C";
+   levels[0].unfilter[STBI__F_none ] = stbi__png_unfilter_none;
+   levels[0].unfilter[STBI__F_sub  ] = stbi__png_unfilter_sub;
+   levels[0].unfilter[STBI__F_up   ] = stbi__png_unfilter_up;
+   levels[0].unfilter[STBI__F_avg  ] = stbi__png_unfilter_avg;
+   levels[0].unfilter[STBI__F_paeth] = stbi__png_unfilter_paeth;
+   levels[0].expand = stbi__png_expand_row;
+   num_levels = 1;
+#ifdef STBI_SSE2
+   if (stbi__sse2_available()) {
+      levels[num_levels] = levels[0];
+      levels[num_levels].name = "SSE2";
+      levels[num_levels].unfilter[STBI__F_sub  ] = stbi__png_unfilter_sub_sse2;
+      levels[num_levels].unfilter[STBI__F_up   ] = stbi__png_unfilter_up_sse2;
+      levels[num_levels].unfilter[STBI__F_avg  ] = stbi__png_unfilter_avg_sse2;
+      levels[num_levels].unfilter[STBI__F_paeth] = stbi__png_unfilter_paeth_sse2;
+      levels[num_levels].expand = stbi__png_expand_row_sse2;
+      ++num_levels;
+   }
+#endif
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      levels[num_levels] = levels[num_levels-1];
+      levels[num_levels].name = "AVX2";
+      levels[num_levels].unfilter[STBI__F_up] = stbi__png_unfilter_up_avx2;
+      levels[num_levels].expand = stbi__png_expand_row_avx2;
+      ++num_levels;
+   }
+#endif
+
+   printf("%-14s", "unfilter");
+   for (l=0; l < num_levels; ++l) printf("%10s", levels[l].name);
+   printf("   speedup\n");
+   for (f=STBI__F_sub; f <= STBI__F_paeth; ++f)
+      for (b=0; b < 6; ++b) {
+         unfilter_job u;
+         double t[3];
+         u.bpp = bpps[b];
+         printf("%-5s bpp %d   ", filter_names[f], u.bpp);
+         for (l=0; l < num_levels; ++l) {
+            u.fn = levels[l].unfilter[f];
+            t[l] = bench_time(run_unfilter, &u);
+            if (l == 0)
+               memcpy(ref_rows, out_rows, rows_size(BENCH_WIDTH * u.bpp));
+            else if (memcmp(ref_rows, out_rows, rows_size(BENCH_WIDTH * u.bpp)) != 0) {
+               printf("(differs) ");
+               ++bad;
+            }
+            printf("%10.0f", BENCH_WIDTH * u.bpp / t[l] / 1e6);
+         }
+         printf("%9.1fx\n", t[0] / t[num_levels-1]);
+      }
+
+   printf("\n%-14s", "expand");
+   for (l=0; l < num_levels; ++l) printf("%10s", levels[l].name);
+   printf("   speedup\n");
+   for (b=0; b < 5; ++b) {
+      expand_job e;
+      double t[3];
+      int out_bytes;
+      e.img_n = expands[b][0];
+      e.out_n = expands[b][1];
+      e.depth = expands[b][2];
+      out_bytes = BENCH_WIDTH * e.out_n * (e.depth/8);
+      printf("%d->%d %2d-bit   ", e.img_n, e.out_n, e.depth);
+      for (l=0; l < num_levels; ++l) {
+         e.fn = levels[l].expand;
+         t[l] = bench_time(run_expand, &e);
+         if (l == 0)
+            memcpy(ref_rows, out_rows, rows_size(out_bytes));
+         else if (memcmp(ref_rows, out_rows, rows_size(out_bytes)) != 0) {
+            printf("(differs) ");
+            ++bad;
+         }
+         printf("%10.0f", out_bytes / t[l] / 1e6);
+      }
+      printf("%9.1fx\n", t[0] / t[num_levels-1]);
+   }
+
+   free(raw_rows);
+   free(out_rows);
+   free(ref_rows);
+   return bad != 0;
+}
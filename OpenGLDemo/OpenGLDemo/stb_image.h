@@ -310,6 +310,17 @@ publish, and distribute this file as you see fit.
 //
 // ===========================================================================
 //
+// Memory-mapped files
+//
+// The functions taking a filename map the file into memory (mmap, or
+// MapViewOfFile on Windows) and decode it exactly as if it had been passed
+// to the _from_memory functions, so there is no copying through stdio. If
+// the file can't be mapped, they fall back to reading it with stdio. Note
+// that another process truncating the file while it is being decoded will
+// crash a mapped read; define STBI_NO_MMAP to always use stdio.
+//
+// ===========================================================================
+//
 // SIMD support
 //
 // The JPEG decoder will try to automatically use SIMD kernels on x86 when
@@ -325,6 +336,14 @@ publish, and distribute this file as you see fit.
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// Where the compiler can build them, AVX2 versions of the JPEG IDCT (two
+// blocks at a time), chroma upsampling and color conversion are also
+// included, and are picked over the SSE2 ones by a run-time CPUID check.
+// They give exactly the same output. Define STBI_NO_AVX2 to leave them out.
+//
+// Converting to a different number of components than the file has (the
+// req_comp argument) also uses SSE2 on x86, for every format.
+//
 // The output of the JPEG decoder is slightly different from versions where
 // SIMD support was introduced (that is, for versions before 1.49). The
 // difference is only +-1 in the 8-bit RGB channels, and only on a small
@@ -338,6 +357,50 @@ publish, and distribute this file as you see fit.
 //
 // ===========================================================================
 //
+// Multithreading
+//
+// Some decoders can split the work of decoding a single image across
+// several threads. This is compiled in only if you #define STBI_THREADS
+// (it uses Win32 threads on Windows and pthreads elsewhere, so you may
+// have to link with -lpthread), and even then it is off until you call
+//
+//     stbi_set_max_threads(n);   // n > 1
+//
+// Images that are too small to benefit are still decoded on the calling
+// thread. Currently used for:
+//
+//     PNG: inflate runs on a second thread, pipelined with unfiltering
+//     PNG: zlib data with full flushes in it (as written by pigz and some
+//          other parallel encoders) is inflated a segment per thread,
+//          when loading from memory
+//     JPEG: baseline images with restart markers have their restart
+//          intervals entropy decoded and IDCTed in parallel, when loading
+//          from memory
+//     JPEG: upsampling and color conversion run in bands of rows
+//
+// Separately, any number of threads can load images at the same time.
+// Threads that need different settings (flipping, JPEG scaling, ...) should
+// each use their own stbi_decoder instead of the global stbi_set_* calls.
+// To load a list of images on a pool of threads, use stbi_batch_create.
+// To decode an image while its data is still arriving, use stbi_stream_create.
+//
+// ===========================================================================
+//
+// Decode statistics
+//
+// If you #define STBI_STATS, every load records how long it spent in each
+// phase of decoding (for JPEG: entropy decoding, dequantization and IDCT,
+// upsampling, color conversion; for PNG: inflate, unfiltering, palette
+// expansion, format conversion), how many bytes went through each, and how
+// much memory it allocated. Fetch them with stbi_get_load_stats (the last
+// load on the calling thread) and stbi_get_total_stats (every load in the
+// process so far). Without STBI_STATS none of this is compiled in. Timing
+// is done around each small piece of work, so a load with statistics on is
+// somewhat slower than one without; trust the proportions more than the
+// absolute times. On non-Windows systems this uses pthreads for a lock.
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image now supports loading HDR images in general, and currently
@@ -392,6 +455,7 @@ publish, and distribute this file as you see fit.
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
 #endif // STBI_NO_STDIO
+#include <stddef.h> // size_t
 
 #define STBI_VERSION 1
 
@@ -402,7 +466,10 @@ enum
    STBI_grey       = 1,
    STBI_grey_alpha = 2,
    STBI_rgb        = 3,
-   STBI_rgb_alpha  = 4
+   STBI_rgb_alpha  = 4,
+
+   STBI_bgr        = 5, // only for the stbi_load_into functions
+   STBI_bgr_alpha  = 6
 };
 
 typedef unsigned char stbi_uc;
@@ -442,6 +509,81 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f,                  int *x, int *y,
 // for stbi_load_from_file, file pointer is left pointing immediately after image
 #endif
 
+// decode into memory you provide (e.g. a mapped texture upload buffer)
+// instead of a newly allocated image. 'layout' is STBI_grey..STBI_rgb_alpha,
+// or STBI_bgr/STBI_bgr_alpha for red and blue swapped; rows start dest_pitch
+// bytes apart, and dest_size is the size of dest in bytes. use stbi_info to
+// size the buffer: if the image doesn't fit, nothing is written and the
+// load fails. returns 1 on success, 0 on failure
+STBIDEF int stbi_load_into_from_memory   (stbi_uc           const *buffer, int len   , stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout);
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk  , void *user, stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into               (char              const *filename,           stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout);
+STBIDEF int stbi_load_into_from_file     (FILE *f,                                     stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout);
+#endif
+
+// decode a row at a time, for images too big to hold in memory: each row
+// (top to bottom, whatever the flip setting) is passed to 'row' as x
+// pixels of req_comp components, and is only valid during the call.
+// *x, *y and *comp are filled in before the first row, and with req_comp 0
+// the rows have *comp components. return 0 from the callback to stop the
+// load, which then fails.
+//
+// baseline JPEGs and non-interlaced PNGs are decoded keeping only a few
+// rows (a couple of MCU rows; a window of the zlib stream) in memory, and
+// aren't subject to the usual limit on the total image size. progressive
+// JPEGs still keep their coefficients, and other images are decoded whole
+// and then handed out row by row. returns 1 on success, 0 on failure
+typedef int (*stbi_row_callback)(void *user, int y, stbi_uc const *row);
+
+STBIDEF int stbi_load_rows_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *comp, int req_comp, stbi_row_callback row, void *row_user);
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *comp, int req_comp, stbi_row_callback row, void *row_user);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows               (char              const *filename,           int *x, int *y, int *comp, int req_comp, stbi_row_callback row, void *row_user);
+STBIDEF int stbi_load_rows_from_file     (FILE *f,                                     int *x, int *y, int *comp, int req_comp, stbi_row_callback row, void *row_user);
+#endif
+
+// decode only the rw*rh rectangle at (rx,ry), clipped to the image; *x and
+// *y get the size of what's returned. this goes through stbi_load_rows, so
+// for baseline JPEGs and non-interlaced PNGs the rows below the rectangle
+// aren't decoded at all, JPEG blocks outside it skip the IDCT, and only
+// its columns are upsampled and converted. the flip setting is ignored
+STBIDEF stbi_uc *stbi_load_region_from_memory   (stbi_uc           const *buffer, int len   , int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp);
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region               (char              const *filename,           int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp);
+STBIDEF stbi_uc *stbi_load_region_from_file     (FILE *f,                                     int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp);
+#endif
+
+// decode a JPEG to its Y, Cb and Cr planes at the resolution they're stored
+// at, leaving out the chroma upsampling and color conversion (for when a
+// shader does those anyway; 4:2:0 comes back as 1.5 bytes a pixel instead
+// of 3). planes->plane[i] is w[i] by h[i] bytes with the rows packed
+// together; greyscale JPEGs have only the Y plane, and *comp is 1. the
+// planes are all one block, returned and in plane[0]: free it with
+// stbi_image_free. chroma samples sit centered on the pixels they cover,
+// so a bilinear lookup at the luma texture coordinate finds the right
+// value. JPEG scaling and flipping apply; scaling keeps the chroma detail
+// the subsampling left, so 4:2:0 planes at 1/2 or less all come back the
+// size of the Y plane. RGB and CMYK JPEGs, and anything that isn't a JPEG,
+// fail
+typedef struct
+{
+   stbi_uc *plane[3]; // Y, Cb, Cr; NULL where there isn't one
+   int w[3], h[3];
+} stbi_ycbcr;
+
+STBIDEF stbi_uc *stbi_load_ycbcr_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *comp, stbi_ycbcr *planes);
+STBIDEF stbi_uc *stbi_load_ycbcr_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *comp, stbi_ycbcr *planes);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_ycbcr               (char              const *filename,           int *x, int *y, int *comp, stbi_ycbcr *planes);
+STBIDEF stbi_uc *stbi_load_ycbcr_from_file     (FILE *f,                                     int *x, int *y, int *comp, stbi_ycbcr *planes);
+#endif
+
 #ifndef STBI_NO_LINEAR
    STBIDEF float *stbi_loadf                 (char const *filename,           int *x, int *y, int *comp, int req_comp);
    STBIDEF float *stbi_loadf_from_memory     (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
@@ -472,7 +614,8 @@ STBIDEF int      stbi_is_hdr_from_file(FILE *f);
 
 
 // get a VERY brief reason for failure
-// NOT THREADSAFE
+// this is per-thread on compilers with thread-local storage (MSVC, GCC,
+// clang); elsewhere it is NOT THREADSAFE
 STBIDEF const char *stbi_failure_reason  (void);
 
 // free the loaded image -- this is just free()
@@ -502,6 +645,223 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// allow a single decode to use up to this many threads (default 1); has no
+// effect unless the implementation was compiled with STBI_THREADS
+STBIDEF void stbi_set_max_threads(int max_threads);
+
+// decode JPEGs at 1/2, 1/4 or 1/8 of their size (denominator 2, 4 or 8;
+// other values round down to one of those, and 1 is the default full size).
+// the scaling is done inside the IDCT, so it is much cheaper than decoding
+// at full size and shrinking afterwards. the returned size, and the size
+// reported by stbi_info, is the full size divided by the denominator,
+// rounded up
+STBIDEF void stbi_set_jpeg_scale_on_load(int denominator);
+
+// a progressive JPEG keeps all its coefficients (two bytes a sample) until
+// the last scan. with this set, each component's coefficients are freed as
+// soon as the scan that completes them has put them through the IDCT, and
+// its pixels aren't allocated until then, which lowers the peak memory of
+// the load. a non-conforming file that goes back to a finished component
+// then fails to load. off by default
+STBIDEF void stbi_set_jpeg_low_memory(int flag_true_if_should_save_memory);
+
+#ifndef STBI_NO_STDIO
+// keep a cache of decoded images in this directory (NULL, the default, for
+// none). images loaded from memory, or from files that can be mapped, are
+// looked up by a hash of their contents and the settings that affect the
+// pixels; a miss decodes as usual and adds the result. cache files are the
+// raw pixels behind a 64-byte header, so a hit is a map and a copy with no
+// decoding. the directory must exist, the string is not copied, and
+// nothing is ever removed from it; clear it out yourself
+STBIDEF void stbi_set_cache_dir(char const *dir);
+#endif
+
+// decoder objects
+//
+// the settings above are shared by every thread, so two threads can't load
+// with different settings at the same time. a decoder carries its own copy
+// of all of them, and its own failure reason, so any number of threads can
+// each load through their own decoder with no locking. a new decoder has
+// the default settings, whatever the globals have been set to. a decoder
+// must only be used by one thread at a time.
+
+typedef struct stbi_decoder stbi_decoder;
+
+STBIDEF stbi_decoder *stbi_decoder_create(void); // NULL if out of memory
+STBIDEF void          stbi_decoder_free  (stbi_decoder *d);
+
+// a decoder also recycles its memory: the scratch buffers a load frees
+// (JPEG and PNG decoder state, component planes, inflate output, ...) are
+// kept and handed out again to later loads through the same decoder,
+// growing only when a bigger one is needed. images loaded through a
+// decoder come from the same pool, so they MUST be freed with
+// stbi_decoder_image_free on that decoder, not stbi_image_free. this
+// needs compiler support for thread-local variables (MSVC, GCC, clang and
+// C11 have it); without that, decoders use STBI_MALLOC/STBI_FREE directly.
+//
+// the memory can come from your own allocator instead of STBI_MALLOC,
+// STBI_REALLOC and STBI_FREE; old_size is the size the block was allocated
+// with, for allocators that can't realloc without it. a decoder's worker
+// threads allocate too, but the decoder calls its allocator under a lock,
+// so it is never called from two threads at once for the same decoder; an
+// allocator shared by several decoders has to be thread-safe itself
+
+typedef struct
+{
+   void *(*alloc)  (void *user, size_t size);
+   void *(*realloc)(void *user, void *p, size_t old_size, size_t new_size);
+   void  (*free)   (void *user, void *p);
+   void *user;
+} stbi_allocator;
+
+STBIDEF stbi_decoder *stbi_decoder_create_with_allocator(stbi_allocator const *a);
+STBIDEF void          stbi_decoder_image_free(stbi_decoder *d, void *retval_from_stbi_decoder_load);
+// give all the kept memory back to the allocator
+STBIDEF void          stbi_decoder_trim(stbi_decoder *d);
+
+STBIDEF void stbi_decoder_set_flip_vertically_on_load(stbi_decoder *d, int flag_true_if_should_flip);
+STBIDEF void stbi_decoder_set_unpremultiply_on_load  (stbi_decoder *d, int flag_true_if_should_unpremultiply);
+STBIDEF void stbi_decoder_convert_iphone_png_to_rgb  (stbi_decoder *d, int flag_true_if_should_convert);
+STBIDEF void stbi_decoder_set_max_threads            (stbi_decoder *d, int max_threads);
+STBIDEF void stbi_decoder_set_jpeg_scale_on_load     (stbi_decoder *d, int denominator);
+STBIDEF void stbi_decoder_set_jpeg_low_memory        (stbi_decoder *d, int flag_true_if_should_save_memory);
+#ifndef STBI_NO_STDIO
+STBIDEF void stbi_decoder_set_cache_dir              (stbi_decoder *d, char const *dir);
+#endif
+#ifndef STBI_NO_HDR
+STBIDEF void stbi_decoder_hdr_to_ldr_gamma(stbi_decoder *d, float gamma);
+STBIDEF void stbi_decoder_hdr_to_ldr_scale(stbi_decoder *d, float scale);
+#endif
+
+// the failure reason of the last call on d that failed
+STBIDEF const char *stbi_decoder_failure_reason(stbi_decoder *d);
+
+STBIDEF stbi_uc *stbi_decoder_load_from_memory     (stbi_decoder *d, stbi_uc           const *buffer, int len   , int *x, int *y, int *comp, int req_comp);
+STBIDEF stbi_uc *stbi_decoder_load_from_callbacks  (stbi_decoder *d, stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *comp, int req_comp);
+STBIDEF int      stbi_decoder_load_into_from_memory(stbi_decoder *d, stbi_uc           const *buffer, int len   , stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout);
+STBIDEF int      stbi_decoder_info_from_memory     (stbi_decoder *d, stbi_uc           const *buffer, int len   , int *x, int *y, int *comp);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_decoder_load                 (stbi_decoder *d, char              const *filename,           int *x, int *y, int *comp, int req_comp);
+STBIDEF int      stbi_decoder_load_into            (stbi_decoder *d, char              const *filename,           stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout);
+STBIDEF int      stbi_decoder_info                 (stbi_decoder *d, char              const *filename,           int *x, int *y, int *comp);
+#endif
+
+// batch loading
+//
+// queue any number of loads and have them decoded on a pool of worker
+// threads, so N images take about N/threads times as long as one. each
+// load gets an id; it is either waited for with stbi_batch_wait (like a
+// future), or, if you pass a callback, reported through that, on whichever
+// worker thread finished it. loads use the settings the stbi_set_* calls
+// had made when the batch was created, and the images they return are
+// freed with stbi_image_free as usual.
+//
+// at most max_in_flight loads are queued or decoding at once (0 for no
+// limit); queueing another blocks until one finishes, which bounds the
+// memory a long list of files can tie up. so don't queue loads from a
+// callback. without STBI_THREADS, or if no thread could be started, each
+// load is decoded right away on the thread that queues it.
+//
+// filenames are copied; memory buffers and dest must stay valid until the
+// load has finished. a batch must only be used by one thread at a time.
+
+typedef struct stbi_batch stbi_batch;
+
+typedef struct
+{
+   stbi_uc *data;               // the image, or dest for the _into loads; NULL if the load failed
+   int x, y, comp;
+   const char *failure_reason;
+} stbi_batch_result;
+
+typedef void (*stbi_batch_callback)(void *user, int id, stbi_batch_result const *result);
+
+STBIDEF stbi_batch *stbi_batch_create(int threads, int max_in_flight); // NULL if out of memory
+// waits for all the loads to finish; images nobody waited for are freed
+STBIDEF void        stbi_batch_free  (stbi_batch *b);
+
+// each returns the load's id, or -1 if out of memory. 'callback' may be NULL
+STBIDEF int stbi_batch_load_from_memory     (stbi_batch *b, stbi_uc const *buffer, int len, int req_comp, stbi_batch_callback callback, void *user);
+STBIDEF int stbi_batch_load_into_from_memory(stbi_batch *b, stbi_uc const *buffer, int len, stbi_uc *dest, int dest_pitch, int dest_size, int layout, stbi_batch_callback callback, void *user);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_batch_load                 (stbi_batch *b, char const *filename,           int req_comp, stbi_batch_callback callback, void *user);
+STBIDEF int stbi_batch_load_into            (stbi_batch *b, char const *filename,           stbi_uc *dest, int dest_pitch, int dest_size, int layout, stbi_batch_callback callback, void *user);
+#endif
+
+// wait for a load queued without a callback and take its result (which
+// then belongs to you). returns 1 if it loaded, 0 if it failed or the id
+// isn't one you can wait for
+STBIDEF int  stbi_batch_wait    (stbi_batch *b, int id, stbi_batch_result *result);
+// wait for every load queued so far to finish
+STBIDEF void stbi_batch_wait_all(stbi_batch *b);
+
+// streaming
+//
+// for data that arrives a piece at a time (say, over a network): feed the
+// bytes in as they come, and look at the image whenever you like. once the
+// header has arrived, stbi_stream_image returns the image buffer (in the
+// given layout, as for stbi_load_into, rows x*comp bytes apart) and how many
+// rows from the top are final. baseline JPEGs and 8-bit non-interlaced,
+// non-palette PNGs without tRNS fill in row by row; progressive JPEGs also
+// fill the whole buffer with a preview after each scan, which the next scan
+// may overwrite while you read it. other images appear all at once.
+//
+// the decoding runs on a thread of its own, so this needs STBI_THREADS;
+// without it nothing is decoded until stbi_stream_end. streams use the
+// settings the stbi_set_* calls had made at create time, except that they
+// never flip.
+
+typedef struct stbi_stream stbi_stream;
+
+STBIDEF stbi_stream *stbi_stream_create(int layout); // NULL if out of memory or a bad layout
+STBIDEF void         stbi_stream_free  (stbi_stream *st);
+
+// returns 0 if out of memory, or if the image has failed to decode already
+STBIDEF int stbi_stream_feed(stbi_stream *st, void const *data, int len);
+// no more data; waits for the decode to finish and returns 1 if it worked
+STBIDEF int stbi_stream_end (stbi_stream *st);
+
+// NULL until the size is known. the buffer belongs to the stream
+STBIDEF stbi_uc const *stbi_stream_image(stbi_stream *st, int *x, int *y, int *comp, int *rows_ready, int *previews);
+STBIDEF const char    *stbi_stream_failure_reason(stbi_stream *st); // NULL unless it failed
+
+#ifdef STBI_STATS
+// decode statistics (see "Decode statistics" above)
+enum
+{
+   STBI_stat_jpeg_entropy,   // bytes: entropy-coded bytes read
+   STBI_stat_jpeg_idct,      // includes dequantization; bytes: pixels written
+   STBI_stat_jpeg_resample,  // bytes: upsampled component bytes written
+   STBI_stat_jpeg_convert,   // bytes: output bytes written
+   STBI_stat_png_inflate,    // bytes: bytes inflated
+   STBI_stat_png_unfilter,   // bytes: filtered bytes read
+   STBI_stat_png_palette,    // bytes: output bytes written
+   STBI_stat_png_convert,    // tRNS, iphone fixups, 16 to 8 bits, req_comp; bytes: output bytes written
+   STBI_stat_count
+};
+
+typedef struct
+{
+   double seconds[STBI_stat_count]; // summed over every thread that worked on it
+   double bytes[STBI_stat_count];
+   double wall_seconds;             // start to finish of the load
+   int    allocs;                   // calls to malloc or realloc
+   double alloc_bytes;              // total asked for
+   double peak_bytes;               // most allocated at once by one load
+   int    loads;
+} stbi_stats;
+
+// the last load on this thread, or all zeros if there wasn't one. loads
+// run by a batch or a stream happen on other threads, so they only show up
+// in the totals
+STBIDEF void stbi_get_load_stats(stbi_stats *stats);
+// every load since the start (or the last reset); peak_bytes is the most
+// any one of them had allocated
+STBIDEF void stbi_get_total_stats(stbi_stats *stats);
+STBIDEF void stbi_reset_total_stats(void);
+#endif
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -573,6 +933,26 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
+#if defined(_WIN32)
+#include <process.h> // _getpid, for the cache's temporary file names
+#elif defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#endif
+
+#if !defined(STBI_NO_STDIO) && !defined(STBI_NO_MMAP)
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define STBI_NO_MMAP
+#endif
+#elif !defined(STBI_NO_MMAP)
+#define STBI_NO_MMAP
 #endif
 
 #ifndef STBI_ASSERT
@@ -597,12 +977,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -614,16 +996,6 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 #endif
 
-#ifdef _MSC_VER
-#define STBI_HAS_LROTL
-#endif
-
-#ifdef STBI_HAS_LROTL
-   #define stbi_lrot(x,y)  _lrotl(x,y)
-#else
-   #define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (32 - (y))))
-#endif
-
 #if defined(STBI_MALLOC) && defined(STBI_FREE) && (defined(STBI_REALLOC) || defined(STBI_REALLOC_SIZED))
 // ok
 #elif !defined(STBI_MALLOC) && !defined(STBI_FREE) && !defined(STBI_REALLOC) && !defined(STBI_REALLOC_SIZED)
@@ -724,6 +1096,45 @@ static int stbi__sse2_available()
 #endif
 #endif
 
+// AVX2 kernels are built next to the SSE2 ones without needing any special
+// compiler flags, and are only selected after a run-time check, so the same
+// binary still runs on SSE2-only machines. define STBI_NO_AVX2 to leave
+// them out entirely.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2)
+#if defined(_MSC_VER) && _MSC_VER >= 1800 // VS2013 or later
+#define STBI_AVX2
+#define STBI__AVX2_TARGET
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ * 100 + __GNUC_MINOR__) >= 409) // GCC 4.9 or later
+#define STBI_AVX2
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef STBI_AVX2
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+static int stbi__avx2_available()
+{
+   int info[4];
+   __cpuid(info,0);
+   if (info[0] < 7) return 0;
+   // the OS also has to save the upper halves of the ymm registers
+   __cpuid(info,1);
+   if ((info[2] & (3 << 27)) != (3 << 27)) return 0; // OSXSAVE and AVX
+   if ((_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info,7,0);
+   return ((info[1] >> 5) & 1) != 0;
+}
+#else
+static int stbi__avx2_available()
+{
+   // this also checks that the OS saves the ymm state
+   return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -739,140 +1150,684 @@ static int stbi__sse2_available()
 #define STBI_SIMD_ALIGN(type, name) type name
 #endif
 
+// per-thread variables: the failure reason, and the decoder (if any) that
+// the current load is going through
+#if defined(_MSC_VER)
+#define STBI__THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define STBI__THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define STBI__THREAD_LOCAL _Thread_local
+#endif
+
+#ifdef STBI__THREAD_LOCAL
+static STBI__THREAD_LOCAL stbi_decoder *stbi__g_decoder;
+#endif
+
 ///////////////////////////////////////////////
 //
-//  stbi__context struct and start_xxx functions
+//  decode statistics (STBI_STATS only)
 
-// stbi__context structure is our basic context used by all images, so it
-// contains all the IO context, plus some basic image information
-typedef struct
+#ifdef STBI_STATS
+#ifdef _WIN32
+#include <windows.h>
+static SRWLOCK stbi__stats_mutex = SRWLOCK_INIT;
+static void stbi__stats_lock(void)   { AcquireSRWLockExclusive(&stbi__stats_mutex); }
+static void stbi__stats_unlock(void) { ReleaseSRWLockExclusive(&stbi__stats_mutex); }
+
+static stbi__uint64 stbi__stats_now(void)
 {
-   stbi__uint32 img_x, img_y;
-   int img_n, img_out_n;
+   LARGE_INTEGER t;
+   QueryPerformanceCounter(&t);
+   return (stbi__uint64) t.QuadPart;
+}
 
-   stbi_io_callbacks io;
-   void *io_user_data;
+static double stbi__stats_seconds(stbi__uint64 ticks)
+{
+   LARGE_INTEGER f;
+   QueryPerformanceFrequency(&f);
+   return (double) ticks / (double) f.QuadPart;
+}
+#else
+#include <pthread.h>
+#include <time.h>
+static pthread_mutex_t stbi__stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void stbi__stats_lock(void)   { pthread_mutex_lock(&stbi__stats_mutex); }
+static void stbi__stats_unlock(void) { pthread_mutex_unlock(&stbi__stats_mutex); }
 
-   int read_from_callbacks;
-   int buflen;
-   stbi_uc buffer_start[128];
+static stbi__uint64 stbi__stats_now(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (stbi__uint64) t.tv_sec * 1000000000 + t.tv_nsec;
+}
 
-   stbi_uc *img_buffer, *img_buffer_end;
-   stbi_uc *img_buffer_original, *img_buffer_original_end;
-} stbi__context;
+static double stbi__stats_seconds(stbi__uint64 ticks)
+{
+   return ticks * 1e-9;
+}
+#endif
 
+// time outside every phase, or waiting on another thread; not reported
+#define STBI__STAT_OTHER  STBI_stat_count
 
-static void stbi__refill_buffer(stbi__context *s);
+// one load, shared by the threads working on it (under the lock)
+typedef struct
+{
+   stbi_stats stats;
+   stbi__uint64 start;
+   void **block;                // the blocks it has allocated and not freed
+   size_t *block_size;
+   int nblock, block_cap;
+   double live;
+} stbi__load_stats;
 
-// initialize a memory-decode context
-static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
+// what the current thread has done for a load since it last reported. time
+// goes to one phase at a time: entering a phase stops the clock on the one
+// it was called from until it's left again
+#define STBI__STATS_DEPTH  8
+
+typedef struct
 {
-   s->io.read = NULL;
-   s->read_from_callbacks = 0;
-   s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
-   s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
-}
+   stbi__load_stats *load;      // NULL when not working on a load
+   int phase, depth, stack[STBI__STATS_DEPTH];
+   stbi__uint64 since;
+   stbi__uint64 ticks[STBI_stat_count+1];
+   double bytes[STBI_stat_count+1];
+} stbi__stats_thread;
 
-// initialize a callback-based context
-static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+#ifdef STBI__THREAD_LOCAL
+static STBI__THREAD_LOCAL stbi__stats_thread stbi__g_stats;
+static STBI__THREAD_LOCAL stbi_stats stbi__g_last_stats;
+#else
+static stbi__stats_thread stbi__g_stats;
+static stbi_stats stbi__g_last_stats;
+#endif
+static stbi_stats stbi__total_stats;
+
+static void stbi__stats_account(stbi__stats_thread *t)
 {
-   s->io = *c;
-   s->io_user_data = user;
-   s->buflen = sizeof(s->buffer_start);
-   s->read_from_callbacks = 1;
-   s->img_buffer_original = s->buffer_start;
-   stbi__refill_buffer(s);
-   s->img_buffer_original_end = s->img_buffer_end;
+   stbi__uint64 now = stbi__stats_now();
+   t->ticks[t->phase] += now - t->since;
+   t->since = now;
 }
 
-#ifndef STBI_NO_STDIO
+static void stbi__stats_enter(int phase)
+{
+   stbi__stats_thread *t = &stbi__g_stats;
+   if (t->load == NULL) return;
+   stbi__stats_account(t);
+   if (t->depth < STBI__STATS_DEPTH) t->stack[t->depth] = t->phase;
+   ++t->depth;
+   t->phase = phase;
+}
 
-static int stbi__stdio_read(void *user, char *data, int size)
+static void stbi__stats_leave(int phase, double bytes)
 {
-   return (int) fread(data,1,size,(FILE*) user);
+   stbi__stats_thread *t = &stbi__g_stats;
+   if (t->load == NULL) return;
+   stbi__stats_account(t);
+   t->bytes[phase] += bytes;
+   if (--t->depth < STBI__STATS_DEPTH) t->phase = t->stack[t->depth];
 }
 
-static void stbi__stdio_skip(void *user, int n)
+static void stbi__stats_thread_begin(stbi__load_stats *load, int phase)
 {
-   fseek((FILE*) user, n, SEEK_CUR);
+   stbi__stats_thread *t = &stbi__g_stats;
+   memset(t, 0, sizeof(*t));
+   t->load = load;
+   t->phase = phase;
+   t->since = stbi__stats_now();
 }
 
-static int stbi__stdio_eof(void *user)
+// add this thread's tallies to its load's, and stop tracking it
+static void stbi__stats_thread_end(void)
 {
-   return feof((FILE*) user);
+   stbi__stats_thread *t = &stbi__g_stats;
+   stbi_stats *st = &t->load->stats;
+   int i;
+   stbi__stats_account(t);
+   stbi__stats_lock();
+   for (i=0; i < STBI_stat_count; ++i) {
+      st->seconds[i] += stbi__stats_seconds(t->ticks[i]);
+      st->bytes[i] += t->bytes[i];
+   }
+   stbi__stats_unlock();
+   t->load = NULL;
 }
 
-static stbi_io_callbacks stbi__stdio_callbacks =
+static void stbi__stats_begin(stbi__load_stats *load)
 {
-   stbi__stdio_read,
-   stbi__stdio_skip,
-   stbi__stdio_eof,
-};
+   memset(load, 0, sizeof(*load));
+   load->start = stbi__stats_now();
+   stbi__stats_thread_begin(load, STBI__STAT_OTHER);
+}
 
-static void stbi__start_file(stbi__context *s, FILE *f)
+static void stbi__stats_end(stbi__load_stats *load)
 {
-   stbi__start_callbacks(s, &stbi__stdio_callbacks, (void *) f);
+   stbi_stats *st = &load->stats, *tot = &stbi__total_stats;
+   int i;
+   stbi__stats_thread_end();
+   st->wall_seconds = stbi__stats_seconds(stbi__stats_now() - load->start);
+   st->loads = 1;
+   stbi__stats_lock();
+   for (i=0; i < STBI_stat_count; ++i) {
+      tot->seconds[i] += st->seconds[i];
+      tot->bytes[i] += st->bytes[i];
+   }
+   tot->wall_seconds += st->wall_seconds;
+   tot->allocs += st->allocs;
+   tot->alloc_bytes += st->alloc_bytes;
+   if (tot->peak_bytes < st->peak_bytes) tot->peak_bytes = st->peak_bytes;
+   tot->loads += 1;
+   stbi__stats_unlock();
+   stbi__g_last_stats = *st;
+   STBI_FREE(load->block);
+   STBI_FREE(load->block_size);
+}
+
+// the current load let go of old and got p (either may be NULL). blocks
+// that outlive the load (like the image it returns) are just forgotten
+static void stbi__stats_track(void *old, void *p, size_t size)
+{
+   stbi__load_stats *load = stbi__g_stats.load;
+   int i;
+   if (load == NULL || (old == NULL && p == NULL)) return;
+   stbi__stats_lock();
+   if (old) {
+      for (i=load->nblock-1; i >= 0; --i) {
+         if (load->block[i] == old) {
+            load->live -= (double) load->block_size[i];
+            load->block[i] = load->block[--load->nblock];
+            load->block_size[i] = load->block_size[load->nblock];
+            break;
+         }
+      }
+   }
+   if (p) {
+      ++load->stats.allocs;
+      load->stats.alloc_bytes += (double) size;
+      load->live += (double) size;
+      if (load->stats.peak_bytes < load->live) load->stats.peak_bytes = load->live;
+      if (load->nblock == load->block_cap) {
+         int cap = load->block_cap ? load->block_cap*2 : 64;
+         void **b = (void **) STBI_MALLOC(cap * sizeof(void *));
+         size_t *bs = (size_t *) STBI_MALLOC(cap * sizeof(size_t));
+         if (b && bs) {
+            if (load->nblock) {
+               memcpy(b, load->block, load->nblock * sizeof(void *));
+               memcpy(bs, load->block_size, load->nblock * sizeof(size_t));
+            }
+            STBI_FREE(load->block);
+            STBI_FREE(load->block_size);
+            load->block = b;
+            load->block_size = bs;
+            load->block_cap = cap;
+         } else {
+            STBI_FREE(b);
+            STBI_FREE(bs);
+         }
+      }
+      // if that failed, the block just never counts as freed
+      if (load->nblock < load->block_cap) {
+         load->block[load->nblock] = p;
+         load->block_size[load->nblock++] = size;
+      }
+   }
+   stbi__stats_unlock();
 }
 
-//static void stop_file(stbi__context *s) { }
+STBIDEF void stbi_get_load_stats(stbi_stats *stats)
+{
+   *stats = stbi__g_last_stats;
+}
 
-#endif // !STBI_NO_STDIO
+STBIDEF void stbi_get_total_stats(stbi_stats *stats)
+{
+   stbi__stats_lock();
+   *stats = stbi__total_stats;
+   stbi__stats_unlock();
+}
 
-static void stbi__rewind(stbi__context *s)
+STBIDEF void stbi_reset_total_stats(void)
 {
-   // conceptually rewind SHOULD rewind to the beginning of the stream,
-   // but we just rewind to the beginning of the initial buffer, because
-   // we only use it after doing 'test', which only ever looks at at most 92 bytes
-   s->img_buffer = s->img_buffer_original;
-   s->img_buffer_end = s->img_buffer_original_end;
+   stbi__stats_lock();
+   memset(&stbi__total_stats, 0, sizeof(stbi__total_stats));
+   stbi__stats_unlock();
 }
 
-#ifndef STBI_NO_JPEG
-static int      stbi__jpeg_test(stbi__context *s);
-static stbi_uc *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
-static int      stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp);
-#endif
+#define STBI__STAT_ENTER(p)             stbi__stats_enter(p)
+#define STBI__STAT_LEAVE(p,bytes)       stbi__stats_leave(p, (double) (bytes))
+#define STBI__STAT_BYTES(p,n)           (stbi__g_stats.bytes[p] += (n))
+#define STBI__STAT_TRACK(old,p,size)    stbi__stats_track(old, p, size)
+#else
+#define STBI__STAT_ENTER(p)             ((void) 0)
+#define STBI__STAT_LEAVE(p,bytes)       ((void) 0)
+#define STBI__STAT_BYTES(p,n)           ((void) 0)
+#define STBI__STAT_TRACK(old,p,size)    ((void) 0)
+#endif // STBI_STATS
 
-#ifndef STBI_NO_PNG
-static int      stbi__png_test(stbi__context *s);
-static stbi_uc *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
-static int      stbi__png_info(stbi__context *s, int *x, int *y, int *comp);
+///////////////////////////////////////////////
+//
+//  threads (STBI_THREADS only)
+
+#ifdef STBI_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+typedef CRITICAL_SECTION   stbi__mutex;
+typedef CONDITION_VARIABLE stbi__cond;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t    stbi__mutex;
+typedef pthread_cond_t     stbi__cond;
 #endif
 
-#ifndef STBI_NO_BMP
-static int      stbi__bmp_test(stbi__context *s);
-static stbi_uc *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
-static int      stbi__bmp_info(stbi__context *s, int *x, int *y, int *comp);
-#endif
+typedef void (*stbi__thread_func)(void *arg);
 
-#ifndef STBI_NO_TGA
-static int      stbi__tga_test(stbi__context *s);
-static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
-static int      stbi__tga_info(stbi__context *s, int *x, int *y, int *comp);
+typedef struct
+{
+#ifdef _WIN32
+   HANDLE handle;
+#else
+   pthread_t handle;
 #endif
-
-#ifndef STBI_NO_PSD
-static int      stbi__psd_test(stbi__context *s);
-static stbi_uc *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
-static int      stbi__psd_info(stbi__context *s, int *x, int *y, int *comp);
+   stbi__thread_func fn;
+   void *arg;
+#ifdef STBI__THREAD_LOCAL
+   stbi_decoder *decoder; // workers allocate from their creator's decoder
 #endif
-
-#ifndef STBI_NO_HDR
-static int      stbi__hdr_test(stbi__context *s);
-static float   *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
-static int      stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp);
+#if defined(STBI_STATS) && defined(STBI__THREAD_LOCAL)
+   stbi__load_stats *stats; // and count towards its load, starting in its phase
+   int stats_phase;
 #endif
+} stbi__thread;
 
-#ifndef STBI_NO_PIC
-static int      stbi__pic_test(stbi__context *s);
-static stbi_uc *stbi__pic_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
-static int      stbi__pic_info(stbi__context *s, int *x, int *y, int *comp);
+static void stbi__thread_run(stbi__thread *t)
+{
+#ifdef STBI__THREAD_LOCAL
+   stbi__g_decoder = t->decoder;
 #endif
-
-#ifndef STBI_NO_GIF
-static int      stbi__gif_test(stbi__context *s);
-static stbi_uc *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
-static int      stbi__gif_info(stbi__context *s, int *x, int *y, int *comp);
+#if defined(STBI_STATS) && defined(STBI__THREAD_LOCAL)
+   if (t->stats) stbi__stats_thread_begin(t->stats, t->stats_phase);
+   t->fn(t->arg);
+   if (t->stats) stbi__stats_thread_end();
+#else
+   t->fn(t->arg);
+#endif
+}
+
+static void stbi__thread_inherit(stbi__thread *t)
+{
+#ifdef STBI__THREAD_LOCAL
+   t->decoder = stbi__g_decoder;
+#endif
+#if defined(STBI_STATS) && defined(STBI__THREAD_LOCAL)
+   t->stats = stbi__g_stats.load;
+   t->stats_phase = stbi__g_stats.phase;
+#endif
+   STBI_NOTUSED(t);
+}
+
+#ifdef _WIN32
+static unsigned __stdcall stbi__thread_main(void *t)
+{
+   stbi__thread_run((stbi__thread *) t);
+   return 0;
+}
+
+static int stbi__thread_create(stbi__thread *t, stbi__thread_func fn, void *arg)
+{
+   t->fn  = fn;
+   t->arg = arg;
+   stbi__thread_inherit(t);
+   t->handle = (HANDLE) _beginthreadex(NULL, 0, stbi__thread_main, t, 0, NULL);
+   return t->handle != 0;
+}
+
+static void stbi__thread_join(stbi__thread *t)
+{
+   WaitForSingleObject(t->handle, INFINITE);
+   CloseHandle(t->handle);
+}
+
+static void stbi__mutex_init(stbi__mutex *m)    { InitializeCriticalSection(m); }
+static void stbi__mutex_destroy(stbi__mutex *m) { DeleteCriticalSection(m); }
+static void stbi__mutex_lock(stbi__mutex *m)    { EnterCriticalSection(m); }
+static void stbi__mutex_unlock(stbi__mutex *m)  { LeaveCriticalSection(m); }
+static void stbi__cond_init(stbi__cond *c)      { InitializeConditionVariable(c); }
+static void stbi__cond_destroy(stbi__cond *c)   { STBI_NOTUSED(c); }
+static void stbi__cond_wait(stbi__cond *c, stbi__mutex *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void stbi__cond_broadcast(stbi__cond *c) { WakeAllConditionVariable(c); }
+#else
+static void *stbi__thread_main(void *t)
+{
+   stbi__thread_run((stbi__thread *) t);
+   return NULL;
+}
+
+static int stbi__thread_create(stbi__thread *t, stbi__thread_func fn, void *arg)
+{
+   t->fn  = fn;
+   t->arg = arg;
+   stbi__thread_inherit(t);
+   return pthread_create(&t->handle, NULL, stbi__thread_main, t) == 0;
+}
+
+static void stbi__thread_join(stbi__thread *t)
+{
+   pthread_join(t->handle, NULL);
+}
+
+static void stbi__mutex_init(stbi__mutex *m)    { pthread_mutex_init(m, NULL); }
+static void stbi__mutex_destroy(stbi__mutex *m) { pthread_mutex_destroy(m); }
+static void stbi__mutex_lock(stbi__mutex *m)    { pthread_mutex_lock(m); }
+static void stbi__mutex_unlock(stbi__mutex *m)  { pthread_mutex_unlock(m); }
+static void stbi__cond_init(stbi__cond *c)      { pthread_cond_init(c, NULL); }
+static void stbi__cond_destroy(stbi__cond *c)   { pthread_cond_destroy(c); }
+static void stbi__cond_wait(stbi__cond *c, stbi__mutex *m) { pthread_cond_wait(c, m); }
+static void stbi__cond_broadcast(stbi__cond *c) { pthread_cond_broadcast(c); }
+#endif
+
+#ifndef STBI_NO_PNG
+// a counter that one pipeline stage raises and the next one waits on (the
+// PNG inflater and the unfiltering behind it)
+typedef struct
+{
+   stbi__mutex lock;
+   stbi__cond  changed;
+   int value, failed;
+} stbi__progress;
+
+static void stbi__progress_init(stbi__progress *p)
+{
+   stbi__mutex_init(&p->lock);
+   stbi__cond_init(&p->changed);
+   p->value = 0;
+   p->failed = 0;
+}
+
+static void stbi__progress_destroy(stbi__progress *p)
+{
+   stbi__cond_destroy(&p->changed);
+   stbi__mutex_destroy(&p->lock);
+}
+
+static void stbi__progress_set(stbi__progress *p, int value)
+{
+   stbi__mutex_lock(&p->lock);
+   p->value = value;
+   stbi__mutex_unlock(&p->lock);
+   stbi__cond_broadcast(&p->changed);
+}
+
+static void stbi__progress_fail(stbi__progress *p)
+{
+   stbi__mutex_lock(&p->lock);
+   p->failed = 1;
+   stbi__mutex_unlock(&p->lock);
+   stbi__cond_broadcast(&p->changed);
+}
+
+// returns 1 once the counter reaches value, 0 if the producer failed
+static int stbi__progress_wait(stbi__progress *p, int value)
+{
+   int ok;
+   STBI__STAT_ENTER(STBI__STAT_OTHER);
+   stbi__mutex_lock(&p->lock);
+   while (p->value < value && !p->failed)
+      stbi__cond_wait(&p->changed, &p->lock);
+   ok = p->value >= value;
+   stbi__mutex_unlock(&p->lock);
+   STBI__STAT_LEAVE(STBI__STAT_OTHER, 0);
+   return ok;
+}
+#endif // STBI_NO_PNG
+
+// a one-shot pool: fn(arg,0..count-1) is run by however many threads we
+// could start, the calling thread included, each pulling the next index
+typedef void (*stbi__task_func)(void *arg, int index);
+
+#define STBI__MAX_THREADS  64
+
+typedef struct
+{
+   stbi__mutex lock;
+   stbi__task_func fn;
+   void *arg;
+   int next, count;
+} stbi__task_queue;
+
+static void stbi__task_worker(void *arg)
+{
+   stbi__task_queue *q = (stbi__task_queue *) arg;
+   for (;;) {
+      int i;
+      stbi__mutex_lock(&q->lock);
+      i = q->next++;
+      stbi__mutex_unlock(&q->lock);
+      if (i >= q->count) break;
+      q->fn(q->arg, i);
+   }
+}
+
+static void stbi__parallel_for(int count, int max_threads, stbi__task_func fn, void *arg)
+{
+   stbi__thread t[STBI__MAX_THREADS];
+   stbi__task_queue q;
+   int i, n = 0;
+   if (max_threads > count) max_threads = count;
+   if (max_threads > STBI__MAX_THREADS) max_threads = STBI__MAX_THREADS;
+   stbi__mutex_init(&q.lock);
+   q.fn = fn;
+   q.arg = arg;
+   q.next = 0;
+   q.count = count;
+   // if a thread won't start, the others just take its share
+   while (n < max_threads-1 && stbi__thread_create(&t[n], stbi__task_worker, &q))
+      ++n;
+   stbi__task_worker(&q);
+   STBI__STAT_ENTER(STBI__STAT_OTHER);
+   for (i=0; i < n; ++i)
+      stbi__thread_join(&t[i]);
+   STBI__STAT_LEAVE(STBI__STAT_OTHER, 0);
+   stbi__mutex_destroy(&q.lock);
+}
+#endif // STBI_THREADS
+
+///////////////////////////////////////////////
+//
+//  stbi__context struct and start_xxx functions
+
+// the load settings. the stbi_set_* functions change the defaults used by
+// the plain API, and every stbi_decoder has its own copy
+typedef struct
+{
+   int flip_vertically;
+   int unpremultiply;
+   int de_iphone;
+   int max_threads;
+   int jpeg_scale;                 // log2 of the denominator
+   int jpeg_low_memory;
+   float l2h_gamma, l2h_scale;
+   float h2l_gamma_i, h2l_scale_i; // inverted when set
+   char const *cache_dir;          // NULL for no cache
+} stbi__options;
+
+#define STBI__INITIAL_OPTIONS  { 0, 0, 0, 1, 0, 0, 2.2f, 1.0f, 1.0f/2.2f, 1.0f, NULL }
+static const stbi__options stbi__initial_options = STBI__INITIAL_OPTIONS;
+static stbi__options stbi__default_options = STBI__INITIAL_OPTIONS;
+
+#define STBI__DECODER_CACHE  32  // freed blocks a decoder keeps
+#define STBI__BLOCK_HEADER   16  // holds the block's capacity, and keeps malloc's alignment
+
+struct stbi_decoder
+{
+   stbi__options opt;
+   const char *failure_reason;
+   stbi_allocator alloc;
+   void *cache[STBI__DECODER_CACHE]; // block headers, least recently freed first
+   int ncache;
+#ifdef STBI_THREADS
+   stbi__mutex lock; // worker threads allocate from it too
+#endif
+};
+
+// a caller-provided output buffer, for stbi_load_into
+typedef struct
+{
+   stbi_uc *data;
+   int pitch, size;  // bytes between rows, and in all of data
+   int comp, bgr;    // components per pixel; red and blue swapped if bgr
+   int flip;
+   // if set, decoders that can tell it when rows 0..rows-1 are final in
+   // data, and when all of data holds a preview of the image (preview = 1)
+   void (*progress)(void *user, int rows, int preview);
+   void *user;
+} stbi__dest;
+
+struct stbi__rows;
+
+// stbi__context structure is our basic context used by all images, so it
+// contains all the IO context, plus some basic image information
+typedef struct
+{
+   stbi__uint32 img_x, img_y;
+   int img_n, img_out_n;
+   stbi__dest *dest; // if set, decoders may write the final image straight into it
+   struct stbi__rows *rows; // if set, decoders may hand it the image a row at a time instead
+   stbi__options const *opt;
+
+   stbi_io_callbacks io;
+   void *io_user_data;
+
+   int read_from_callbacks;
+   int buflen;
+   stbi_uc buffer_start[128];
+
+   stbi_uc *img_buffer, *img_buffer_end;
+   stbi_uc *img_buffer_original, *img_buffer_original_end;
+} stbi__context;
+
+
+static void stbi__refill_buffer(stbi__context *s);
+
+// initialize a memory-decode context
+static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
+{
+   s->io.read = NULL;
+   s->read_from_callbacks = 0;
+   s->dest = NULL;
+   s->rows = NULL;
+   s->opt = &stbi__default_options;
+   s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
+   s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+}
+
+// initialize a callback-based context
+static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+{
+   s->io = *c;
+   s->io_user_data = user;
+   s->dest = NULL;
+   s->rows = NULL;
+   s->opt = &stbi__default_options;
+   s->buflen = sizeof(s->buffer_start);
+   s->read_from_callbacks = 1;
+   s->img_buffer_original = s->buffer_start;
+   stbi__refill_buffer(s);
+   s->img_buffer_original_end = s->img_buffer_end;
+}
+
+#ifndef STBI_NO_STDIO
+
+static int stbi__stdio_read(void *user, char *data, int size)
+{
+   return (int) fread(data,1,size,(FILE*) user);
+}
+
+static void stbi__stdio_skip(void *user, int n)
+{
+   fseek((FILE*) user, n, SEEK_CUR);
+}
+
+static int stbi__stdio_eof(void *user)
+{
+   return feof((FILE*) user);
+}
+
+static stbi_io_callbacks stbi__stdio_callbacks =
+{
+   stbi__stdio_read,
+   stbi__stdio_skip,
+   stbi__stdio_eof,
+};
+
+static void stbi__start_file(stbi__context *s, FILE *f)
+{
+   stbi__start_callbacks(s, &stbi__stdio_callbacks, (void *) f);
+}
+
+//static void stop_file(stbi__context *s) { }
+
+#endif // !STBI_NO_STDIO
+
+static void stbi__rewind(stbi__context *s)
+{
+   // conceptually rewind SHOULD rewind to the beginning of the stream,
+   // but we just rewind to the beginning of the initial buffer, because
+   // we only use it after doing 'test', which only ever looks at at most 92 bytes
+   s->img_buffer = s->img_buffer_original;
+   s->img_buffer_end = s->img_buffer_original_end;
+}
+
+#ifndef STBI_NO_JPEG
+static int      stbi__jpeg_test(stbi__context *s);
+static stbi_uc *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+static int      stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp);
+static stbi_uc *stbi__jpeg_load_ycbcr(stbi__context *s, int *x, int *y, int *comp, stbi_ycbcr *planes);
+#endif
+
+#ifndef STBI_NO_PNG
+static int      stbi__png_test(stbi__context *s);
+static stbi_uc *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+static int      stbi__png_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
+#ifndef STBI_NO_BMP
+static int      stbi__bmp_test(stbi__context *s);
+static stbi_uc *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+static int      stbi__bmp_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
+#ifndef STBI_NO_TGA
+static int      stbi__tga_test(stbi__context *s);
+static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+static int      stbi__tga_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
+#ifndef STBI_NO_PSD
+static int      stbi__psd_test(stbi__context *s);
+static stbi_uc *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+static int      stbi__psd_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
+#ifndef STBI_NO_HDR
+static int      stbi__hdr_test(stbi__context *s);
+static float   *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+static int      stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
+#ifndef STBI_NO_PIC
+static int      stbi__pic_test(stbi__context *s);
+static stbi_uc *stbi__pic_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+static int      stbi__pic_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
+#ifndef STBI_NO_GIF
+static int      stbi__gif_test(stbi__context *s);
+static stbi_uc *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+static int      stbi__gif_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
 #ifndef STBI_NO_PNM
@@ -881,8 +1836,14 @@ static stbi_uc *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
+// per-thread where the compiler supports it, so concurrent loads don't see
+// each other's failures (worker threads hand their reason back to the
+// decoding thread when they fail)
+#ifdef STBI__THREAD_LOCAL
+static STBI__THREAD_LOCAL const char *stbi__g_failure_reason;
+#else
 static const char *stbi__g_failure_reason;
+#endif
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -895,9 +1856,117 @@ static int stbi__err(const char *str)
    return 0;
 }
 
+#ifdef STBI__THREAD_LOCAL
+static void stbi__decoder_lock(stbi_decoder *d)
+{
+#ifdef STBI_THREADS
+   stbi__mutex_lock(&d->lock);
+#else
+   STBI_NOTUSED(d);
+#endif
+}
+
+static void stbi__decoder_unlock(stbi_decoder *d)
+{
+#ifdef STBI_THREADS
+   stbi__mutex_unlock(&d->lock);
+#else
+   STBI_NOTUSED(d);
+#endif
+}
+
+static void *stbi__decoder_malloc(stbi_decoder *d, size_t size)
+{
+   size_t *b = NULL;
+   int i, best = -1;
+   stbi__decoder_lock(d);
+   // the smallest kept block that's big enough, unless it's much too big
+   for (i=0; i < d->ncache; ++i) {
+      size_t cap = *(size_t *) d->cache[i];
+      if (cap >= size && cap <= size*2 + 4096 && (best < 0 || cap < *(size_t *) d->cache[best]))
+         best = i;
+   }
+   if (best >= 0) {
+      b = (size_t *) d->cache[best];
+      memmove(d->cache+best, d->cache+best+1, (d->ncache - best - 1) * sizeof(void *));
+      --d->ncache;
+   } else {
+      // worker threads share the decoder, so its allocator is called under the lock too
+      b = (size_t *) d->alloc.alloc(d->alloc.user, size + STBI__BLOCK_HEADER);
+      if (b) *b = size;
+   }
+   stbi__decoder_unlock(d);
+   return b ? (char *) b + STBI__BLOCK_HEADER : NULL;
+}
+
+static void stbi__decoder_release(stbi_decoder *d, void *p)
+{
+   void *old = NULL;
+   if (p == NULL) return;
+   stbi__decoder_lock(d);
+   // when full, drop the block that has gone unused the longest
+   if (d->ncache == STBI__DECODER_CACHE) {
+      old = d->cache[0];
+      memmove(d->cache, d->cache+1, (STBI__DECODER_CACHE-1) * sizeof(void *));
+      --d->ncache;
+   }
+   d->cache[d->ncache++] = (char *) p - STBI__BLOCK_HEADER;
+   if (old) d->alloc.free(d->alloc.user, old);
+   stbi__decoder_unlock(d);
+}
+
+static void *stbi__decoder_realloc(stbi_decoder *d, void *p, size_t newsz)
+{
+   size_t *b, cap;
+   if (p == NULL) return stbi__decoder_malloc(d, newsz);
+   b = (size_t *) ((char *) p - STBI__BLOCK_HEADER);
+   cap = *b;
+   if (newsz <= cap) return p;
+   stbi__decoder_lock(d);
+   b = (size_t *) d->alloc.realloc(d->alloc.user, b, cap + STBI__BLOCK_HEADER, newsz + STBI__BLOCK_HEADER);
+   stbi__decoder_unlock(d);
+   if (b == NULL) return NULL;
+   *b = newsz;
+   return (char *) b + STBI__BLOCK_HEADER;
+}
+#endif // STBI__THREAD_LOCAL
+
+// all of the decoders' memory goes through these, so that loads through a
+// decoder use its allocator and recycled blocks
 static void *stbi__malloc(size_t size)
 {
-    return STBI_MALLOC(size);
+   void *p;
+#ifdef STBI__THREAD_LOCAL
+   if (stbi__g_decoder)
+      p = stbi__decoder_malloc(stbi__g_decoder, size);
+   else
+#endif
+   p = STBI_MALLOC(size);
+   STBI__STAT_TRACK(NULL, p, size);
+   return p;
+}
+
+static void *stbi__realloc_sized(void *p, size_t oldsz, size_t newsz)
+{
+   void *q;
+#ifdef STBI__THREAD_LOCAL
+   if (stbi__g_decoder)
+      q = stbi__decoder_realloc(stbi__g_decoder, p, newsz);
+   else
+#endif
+   q = STBI_REALLOC_SIZED(p, oldsz, newsz);
+   STBI_NOTUSED(oldsz);
+   STBI__STAT_TRACK(q ? p : NULL, q, newsz);
+   return q;
+}
+
+static void stbi__free(void *p)
+{
+   STBI__STAT_TRACK(p, NULL, 0);
+#ifdef STBI__THREAD_LOCAL
+   if (stbi__g_decoder) { stbi__decoder_release(stbi__g_decoder, p); return; }
+#endif
+   STBI_FREE(p);
 }
 
 // stbi__err - error
@@ -921,21 +1990,52 @@ STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 }
 
 #ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
+static float   *stbi__ldr_to_hdr(stbi__options const *opt, stbi_uc *data, int x, int y, int comp);
 #endif
 
+static unsigned char *stbi__into_dest(stbi__context *s, unsigned char *data, int img_n, int x, int y);
+static int stbi__load_rows(stbi__context *s, int *x, int *y, int *comp, int req_comp, int const *window, stbi_row_callback row, void *row_user);
+static stbi_uc *stbi__load_region(stbi__context *s, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp);
+static stbi_uc *stbi__load_ycbcr(stbi__context *s, int *x, int *y, int *comp, stbi_ycbcr *planes);
+static unsigned char *stbi__load_cached(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+
 #ifndef STBI_NO_HDR
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
+static stbi_uc *stbi__hdr_to_ldr(stbi__options const *opt, float   *data, int x, int y, int comp);
 #endif
 
-static int stbi__vertically_flip_on_load = 0;
-
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
-    stbi__vertically_flip_on_load = flag_true_if_should_flip;
+    stbi__default_options.flip_vertically = flag_true_if_should_flip;
 }
 
-static unsigned char *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+STBIDEF void stbi_set_max_threads(int max_threads)
+{
+    stbi__default_options.max_threads = max_threads < 1 ? 1 : max_threads;
+}
+
+static int stbi__jpeg_scale_log2(int denominator)
+{
+    return denominator >= 8 ? 3 : denominator >= 4 ? 2 : denominator >= 2 ? 1 : 0;
+}
+
+STBIDEF void stbi_set_jpeg_scale_on_load(int denominator)
+{
+    stbi__default_options.jpeg_scale = stbi__jpeg_scale_log2(denominator);
+}
+
+STBIDEF void stbi_set_jpeg_low_memory(int flag_true_if_should_save_memory)
+{
+    stbi__default_options.jpeg_low_memory = flag_true_if_should_save_memory;
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF void stbi_set_cache_dir(char const *dir)
+{
+    stbi__default_options.cache_dir = dir;
+}
+#endif
+
+static unsigned char *stbi__load_format(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    #ifndef STBI_NO_JPEG
    if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp);
@@ -962,7 +2062,7 @@ static unsigned char *stbi__load_main(stbi__context *s, int *x, int *y, int *com
    #ifndef STBI_NO_HDR
    if (stbi__hdr_test(s)) {
       float *hdr = stbi__hdr_load(s, x,y,comp,req_comp);
-      return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+      return stbi__hdr_to_ldr(s->opt, hdr, *x, *y, req_comp ? req_comp : *comp);
    }
    #endif
 
@@ -975,11 +2075,26 @@ static unsigned char *stbi__load_main(stbi__context *s, int *x, int *y, int *com
    return stbi__errpuc("unknown image type", "Image not of any known type, or corrupt");
 }
 
+static unsigned char *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+#ifdef STBI_STATS
+   stbi__load_stats load;
+   unsigned char *result;
+   if (stbi__g_stats.load) return stbi__load_format(s, x, y, comp, req_comp);
+   stbi__stats_begin(&load);
+   result = stbi__load_format(s, x, y, comp, req_comp);
+   stbi__stats_end(&load);
+   return result;
+#else
+   return stbi__load_format(s, x, y, comp, req_comp);
+#endif
+}
+
 static unsigned char *stbi__load_flip(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
-   unsigned char *result = stbi__load_main(s, x, y, comp, req_comp);
+   unsigned char *result = stbi__load_cached(s, x, y, comp, req_comp);
 
-   if (stbi__vertically_flip_on_load && result != NULL) {
+   if (s->opt->flip_vertically && result != NULL) {
       int w = *x, h = *y;
       int depth = req_comp ? req_comp : *comp;
       int row,col,z;
@@ -1001,9 +2116,9 @@ static unsigned char *stbi__load_flip(stbi__context *s, int *x, int *y, int *com
 }
 
 #ifndef STBI_NO_HDR
-static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
+static void stbi__float_postprocess(stbi__context *s, float *result, int *x, int *y, int *comp, int req_comp)
 {
-   if (stbi__vertically_flip_on_load && result != NULL) {
+   if (s->opt->flip_vertically && result != NULL) {
       int w = *x, h = *y;
       int depth = req_comp ? req_comp : *comp;
       int row,col,z;
@@ -1037,11 +2152,80 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
    return f;
 }
 
+#ifndef STBI_NO_MMAP
+typedef struct
+{
+   stbi_uc *data;
+   int size;
+} stbi__mapped_file;
+
+// map a whole file read-only. fails, so the caller can fall back to stdio,
+// on anything that can't be mapped: missing or empty files, pipes and
+// devices, and files too big for the int lengths used everywhere else
+static int stbi__map_file(stbi__mapped_file *m, char const *filename)
+{
+#ifdef _WIN32
+   HANDLE file, mapping;
+   LARGE_INTEGER size;
+   file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   if (file == INVALID_HANDLE_VALUE) return 0;
+   if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &size) || size.QuadPart <= 0 || size.QuadPart > 0x7fffffff) {
+      CloseHandle(file);
+      return 0;
+   }
+   mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+   CloseHandle(file);
+   if (mapping == NULL) return 0;
+   // the view keeps the mapping alive
+   m->data = (stbi_uc *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+   CloseHandle(mapping);
+   m->size = (int) size.QuadPart;
+   return m->data != NULL;
+#else
+   struct stat st;
+   void *p;
+   int fd = open(filename, O_RDONLY);
+   if (fd < 0) return 0;
+   if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > 0x7fffffff) {
+      close(fd);
+      return 0;
+   }
+   p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) return 0;
+   #ifdef MADV_SEQUENTIAL
+   madvise(p, (size_t) st.st_size, MADV_SEQUENTIAL);
+   #endif
+   m->data = (stbi_uc *) p;
+   m->size = (int) st.st_size;
+   return 1;
+#endif
+}
+
+static void stbi__unmap_file(stbi__mapped_file *m)
+{
+#ifdef _WIN32
+   UnmapViewOfFile(m->data);
+#else
+   munmap(m->data, (size_t) m->size);
+#endif
+}
+#endif // !STBI_NO_MMAP
+
 
 STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    unsigned char *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_from_memory(m.data, m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -1076,6 +2260,232 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_flip(&s,x,y,comp,req_comp);
 }
 
+static int stbi__dest_init(stbi__dest *d, stbi__context *s, stbi_uc *dest, int dest_pitch, int dest_size, int layout)
+{
+   if (layout < STBI_grey || layout > STBI_bgr_alpha || dest == NULL) return stbi__err("bad layout", "Internal error");
+   d->data  = dest;
+   d->pitch = dest_pitch;
+   d->size  = dest_size;
+   d->comp  = layout > STBI_rgb_alpha ? layout-2 : layout;
+   d->bgr   = layout > STBI_rgb_alpha;
+   d->flip  = s->opt->flip_vertically;
+   d->progress = NULL;
+   d->user  = NULL;
+   return 1;
+}
+
+// decoders that know about s->dest write into it and return its data;
+// anything else comes back as a normal image and is copied in here
+static int stbi__load_into_dest(stbi__context *s, stbi__dest *d, int *x, int *y, int *comp)
+{
+   unsigned char *result;
+   s->dest = d;
+   result = stbi__load_cached(s, x, y, comp, d->comp);
+   if (result && result != d->data)
+      result = stbi__into_dest(s, result, d->comp, *x, *y);
+   s->dest = NULL;
+   return result != NULL;
+}
+
+static int stbi__load_into(stbi__context *s, stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout)
+{
+   stbi__dest d;
+   if (!stbi__dest_init(&d, s, dest, dest_pitch, dest_size, layout)) return 0;
+   return stbi__load_into_dest(s, &d, x, y, comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into(char const *filename, stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout)
+{
+   FILE *f;
+   int result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_into_from_memory(m.data, m.size, dest, dest_pitch, dest_size, x, y, comp, layout);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_into_from_file(f,dest,dest_pitch,dest_size,x,y,comp,layout);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_into_from_file(FILE *f, stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout)
+{
+   int result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_into(&s,dest,dest_pitch,dest_size,x,y,comp,layout);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into(&s,dest,dest_pitch,dest_size,x,y,comp,layout);
+}
+
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into(&s,dest,dest_pitch,dest_size,x,y,comp,layout);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_row_callback row, void *row_user)
+{
+   FILE *f;
+   int result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_rows_from_memory(m.data, m.size, x, y, comp, req_comp, row, row_user);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_rows_from_file(f, x, y, comp, req_comp, row, row_user);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_rows_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_row_callback row, void *row_user)
+{
+   int result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_rows(&s, x, y, comp, req_comp, NULL, row, row_user);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_row_callback row, void *row_user)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_rows(&s, x, y, comp, req_comp, NULL, row, row_user);
+}
+
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_row_callback row, void *row_user)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_rows(&s, x, y, comp, req_comp, NULL, row, row_user);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region(char const *filename, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   stbi_uc *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_region_from_memory(m.data, m.size, rx, ry, rw, rh, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_region_from_file(f, rx, ry, rw, rh, x, y, comp, req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_file(FILE *f, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_uc *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_region(&s, rx, ry, rw, rh, x, y, comp, req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF stbi_uc *stbi_load_region_from_memory(stbi_uc const *buffer, int len, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_region(&s, rx, ry, rw, rh, x, y, comp, req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk, void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_region(&s, rx, ry, rw, rh, x, y, comp, req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_ycbcr(char const *filename, int *x, int *y, int *comp, stbi_ycbcr *planes)
+{
+   FILE *f;
+   stbi_uc *result;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_ycbcr_from_memory(m.data, m.size, x, y, comp, planes);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_ycbcr_from_file(f, x, y, comp, planes);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_ycbcr_from_file(FILE *f, int *x, int *y, int *comp, stbi_ycbcr *planes)
+{
+   stbi_uc *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_ycbcr(&s, x, y, comp, planes);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF stbi_uc *stbi_load_ycbcr_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_ycbcr *planes)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_ycbcr(&s, x, y, comp, planes);
+}
+
+STBIDEF stbi_uc *stbi_load_ycbcr_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, stbi_ycbcr *planes)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_ycbcr(&s, x, y, comp, planes);
+}
+
 #ifndef STBI_NO_LINEAR
 static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
@@ -1084,13 +2494,13 @@ static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int
    if (stbi__hdr_test(s)) {
       float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp);
       if (hdr_data)
-         stbi__float_postprocess(hdr_data,x,y,comp,req_comp);
+         stbi__float_postprocess(s,hdr_data,x,y,comp,req_comp);
       return hdr_data;
    }
    #endif
    data = stbi__load_flip(s, x, y, comp, req_comp);
    if (data)
-      return stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
+      return stbi__ldr_to_hdr(s->opt, data, *x, *y, req_comp ? req_comp : *comp);
    return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
 }
 
@@ -1112,7 +2522,16 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
    float *result;
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_loadf_from_memory(m.data, m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpf("can't fopen", "Unable to open file");
    result = stbi_loadf_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -1149,8 +2568,17 @@ STBIDEF int stbi_is_hdr_from_memory(stbi_uc const *buffer, int len)
 #ifndef STBI_NO_STDIO
 STBIDEF int      stbi_is_hdr          (char const *filename)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    int result=0;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_is_hdr_from_memory(m.data, m.size);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (f) {
       result = stbi_is_hdr_from_file(f);
       fclose(f);
@@ -1185,16 +2613,12 @@ STBIDEF int      stbi_is_hdr_from_callbacks(stbi_io_callbacks const *clbk, void
 }
 
 #ifndef STBI_NO_LINEAR
-static float stbi__l2h_gamma=2.2f, stbi__l2h_scale=1.0f;
-
-STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__l2h_gamma = gamma; }
-STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__l2h_scale = scale; }
+STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__default_options.l2h_gamma = gamma; }
+STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__default_options.l2h_scale = scale; }
 #endif
 
-static float stbi__h2l_gamma_i=1.0f/2.2f, stbi__h2l_scale_i=1.0f;
-
-STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__h2l_gamma_i = 1/gamma; }
-STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__h2l_scale_i = 1/scale; }
+STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__default_options.h2l_gamma_i = 1/gamma; }
+STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__default_options.h2l_scale_i = 1/scale; }
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1330,89 +2754,752 @@ static stbi__uint32 stbi__get32le(stbi__context *s)
 //    and it never has alpha, so very few cases ). png can automatically
 //    interleave an alpha=255 channel, but falls back to this for other cases
 //
-//  assume data buffer is malloced, so malloc a new one and free that one
-//  only failure mode is malloc failing
+//  assume data buffer is malloced; converting to fewer components is done
+//  in place, otherwise malloc a new one and free that one. only failure
+//  mode is malloc failing
 
 static stbi_uc stbi__compute_y(int r, int g, int b)
 {
    return (stbi_uc) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+// convert one row of x pixels from img_n components to req_comp components;
+// dest may be src if req_comp < img_n
+static void stbi__convert_row_generic(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   #define COMBO(a,b)  ((a)*8+(b))
+   #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (COMBO(img_n, req_comp)) {
+      CASE(1,2) dest[0]=src[0], dest[1]=255; break;
+      CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
+      CASE(2,1) dest[0]=src[0]; break;
+      CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
+      CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
+      CASE(3,1) dest[0]=stbi__compute_y(src[0],src[1],src[2]); break;
+      CASE(3,2) dest[0]=stbi__compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
+      CASE(4,1) dest[0]=stbi__compute_y(src[0],src[1],src[2]); break;
+      CASE(4,2) dest[0]=stbi__compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
+      CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
+      default: STBI_ASSERT(0);
+   }
+   #undef CASE
+   #undef COMBO
+}
+
+#ifdef STBI_SSE2
+// sse2 conversion works on 16 pixels at a time, held as 4 registers of
+// 32-bit RGBA (grey sources become g,g,g,a). this loses nothing, since the
+// luma weights add up to 256 and so stbi__compute_y(g,g,g) == g.
+
+// spread 4 packed RGB pixels in the low 12 bytes of a into 32-bit lanes,
+// leaving the top byte of each lane 0
+static __m128i stbi__sse2_rgb_to_rgbx(__m128i a)
+{
+   __m128i lo = _mm_setr_epi32(0xffffff, 0, 0xffffff, 0);
+   __m128i hi = _mm_setr_epi32(0, 0xffffff, 0, 0xffffff);
+   __m128i u = _mm_unpacklo_epi64(a, _mm_srli_si128(a, 6)); // pixels 0,1 | 2,3
+   return _mm_or_si128(_mm_and_si128(u, lo), _mm_and_si128(_mm_slli_epi64(u, 8), hi));
+}
+
+// the reverse: pack 4 pixels in 32-bit lanes into the low 12 bytes, zeroing the rest
+static __m128i stbi__sse2_rgbx_to_rgb(__m128i v)
+{
+   __m128i lo = _mm_setr_epi32(0xffffff, 0, 0xffffff, 0);
+   __m128i hi = _mm_setr_epi32((int) 0xff000000, 0xffff, (int) 0xff000000, 0xffff);
+   __m128i t = _mm_or_si128(_mm_and_si128(v, lo), _mm_and_si128(_mm_srli_epi64(v, 8), hi));
+   return _mm_or_si128(_mm_move_epi64(t), _mm_slli_si128(_mm_srli_si128(t, 8), 6));
+}
+
+// stbi__compute_y of 4 RGBA pixels, one per 32-bit lane
+static __m128i stbi__sse2_compute_y(__m128i v)
+{
+   __m128i rb = _mm_and_si128(v, _mm_set1_epi16(0xff));
+   __m128i ga = _mm_srli_epi16(v, 8);
+   __m128i y  = _mm_add_epi32(_mm_madd_epi16(rb, _mm_setr_epi16(77,29,77,29,77,29,77,29)),
+                              _mm_madd_epi16(ga, _mm_setr_epi16(150,0,150,0,150,0,150,0)));
+   return _mm_srli_epi32(y, 8);
+}
+
+static void stbi__sse2_load_pixels(__m128i p[4], unsigned char const *src, int img_n)
+{
+   __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+   __m128i v0, v1, v2;
+   int k;
+   switch (img_n) {
+      case 1:
+         v0 = _mm_loadu_si128((__m128i const *) src);
+         v1 = _mm_unpacklo_epi8(v0, v0);                  // g,g
+         v2 = _mm_unpacklo_epi8(v0, _mm_set1_epi8(-1));   // g,255
+         p[0] = _mm_unpacklo_epi16(v1, v2);
+         p[1] = _mm_unpackhi_epi16(v1, v2);
+         v1 = _mm_unpackhi_epi8(v0, v0);
+         v2 = _mm_unpackhi_epi8(v0, _mm_set1_epi8(-1));
+         p[2] = _mm_unpacklo_epi16(v1, v2);
+         p[3] = _mm_unpackhi_epi16(v1, v2);
+         break;
+      case 2:
+         for (k=0; k < 2; ++k) {
+            v0 = _mm_loadu_si128((__m128i const *) (src + k*16));
+            v1 = _mm_and_si128(v0, _mm_set1_epi16(0xff));
+            v1 = _mm_or_si128(v1, _mm_slli_epi16(v1, 8));  // g,g
+            p[k*2  ] = _mm_unpacklo_epi16(v1, v0);
+            p[k*2+1] = _mm_unpackhi_epi16(v1, v0);
+         }
+         break;
+      case 3:
+         // 48 bytes; realign so each register starts with 4 whole pixels
+         v0 = _mm_loadu_si128((__m128i const *) (src     ));
+         v1 = _mm_loadu_si128((__m128i const *) (src + 16));
+         v2 = _mm_loadu_si128((__m128i const *) (src + 32));
+         p[0] = stbi__sse2_rgb_to_rgbx(v0);
+         p[1] = stbi__sse2_rgb_to_rgbx(_mm_or_si128(_mm_srli_si128(v0, 12), _mm_slli_si128(v1, 4)));
+         p[2] = stbi__sse2_rgb_to_rgbx(_mm_or_si128(_mm_srli_si128(v1,  8), _mm_slli_si128(v2, 8)));
+         p[3] = stbi__sse2_rgb_to_rgbx(_mm_srli_si128(v2, 4));
+         for (k=0; k < 4; ++k)
+            p[k] = _mm_or_si128(p[k], alpha);
+         break;
+      default:
+         for (k=0; k < 4; ++k)
+            p[k] = _mm_loadu_si128((__m128i const *) (src + k*16));
+         break;
+   }
+}
+
+static void stbi__sse2_store_pixels(unsigned char *dest, __m128i const p[4], int req_comp)
+{
+   __m128i y0, y1, a0, a1, c0, c1, c2, c3;
+   int k;
+   switch (req_comp) {
+      case 1:
+         y0 = _mm_packs_epi32(stbi__sse2_compute_y(p[0]), stbi__sse2_compute_y(p[1]));
+         y1 = _mm_packs_epi32(stbi__sse2_compute_y(p[2]), stbi__sse2_compute_y(p[3]));
+         _mm_storeu_si128((__m128i *) dest, _mm_packus_epi16(y0, y1));
+         break;
+      case 2:
+         y0 = _mm_packs_epi32(stbi__sse2_compute_y(p[0]), stbi__sse2_compute_y(p[1]));
+         y1 = _mm_packs_epi32(stbi__sse2_compute_y(p[2]), stbi__sse2_compute_y(p[3]));
+         a0 = _mm_packs_epi32(_mm_srli_epi32(p[0], 24), _mm_srli_epi32(p[1], 24));
+         a1 = _mm_packs_epi32(_mm_srli_epi32(p[2], 24), _mm_srli_epi32(p[3], 24));
+         _mm_storeu_si128((__m128i *) (dest     ), _mm_or_si128(y0, _mm_slli_epi16(a0, 8)));
+         _mm_storeu_si128((__m128i *) (dest + 16), _mm_or_si128(y1, _mm_slli_epi16(a1, 8)));
+         break;
+      case 3:
+         // 4 runs of 12 bytes, stitched into 3 registers
+         c0 = stbi__sse2_rgbx_to_rgb(p[0]);
+         c1 = stbi__sse2_rgbx_to_rgb(p[1]);
+         c2 = stbi__sse2_rgbx_to_rgb(p[2]);
+         c3 = stbi__sse2_rgbx_to_rgb(p[3]);
+         _mm_storeu_si128((__m128i *) (dest     ), _mm_or_si128(c0, _mm_slli_si128(c1, 12)));
+         _mm_storeu_si128((__m128i *) (dest + 16), _mm_or_si128(_mm_srli_si128(c1, 4), _mm_slli_si128(c2, 8)));
+         _mm_storeu_si128((__m128i *) (dest + 32), _mm_or_si128(_mm_srli_si128(c2, 8), _mm_slli_si128(c3, 4)));
+         break;
+      default:
+         for (k=0; k < 4; ++k)
+            _mm_storeu_si128((__m128i *) (dest + k*16), p[k]);
+         break;
+   }
+}
+
+// every 16 pixels are read in full before any of their output is written,
+// and the output never gets ahead of the input, so this is safe in place
+// when req_comp < img_n
+static void stbi__convert_row_sse2(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x)
+{
+   unsigned int i = 0;
+   if (img_n == 1 && req_comp == 2) {
+      __m128i alpha = _mm_set1_epi8(-1);
+      for (; i+16 <= x; i += 16) {
+         __m128i v = _mm_loadu_si128((__m128i const *) (src + i));
+         _mm_storeu_si128((__m128i *) (dest + i*2     ), _mm_unpacklo_epi8(v, alpha));
+         _mm_storeu_si128((__m128i *) (dest + i*2 + 16), _mm_unpackhi_epi8(v, alpha));
+      }
+   } else if (img_n == 2 && req_comp == 1) {
+      __m128i mask = _mm_set1_epi16(0xff);
+      for (; i+16 <= x; i += 16) {
+         __m128i v0 = _mm_and_si128(_mm_loadu_si128((__m128i const *) (src + i*2     )), mask);
+         __m128i v1 = _mm_and_si128(_mm_loadu_si128((__m128i const *) (src + i*2 + 16)), mask);
+         _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(v0, v1));
+      }
+   } else {
+      for (; i+16 <= x; i += 16) {
+         __m128i p[4];
+         stbi__sse2_load_pixels(p, src + i*img_n, img_n);
+         stbi__sse2_store_pixels(dest + i*req_comp, p, req_comp);
+      }
+   }
+   if (i < x)
+      stbi__convert_row_generic(dest + i*req_comp, src + i*img_n, img_n, req_comp, x-i);
+}
+#endif // STBI_SSE2
+
+typedef void (*stbi__convert_row_kernel)(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x);
+
+// pick the row converter once per image, rather than per row
+static stbi__convert_row_kernel stbi__get_convert_row(void)
+{
+#ifdef STBI_SSE2
+   if (stbi__sse2_available())
+      return stbi__convert_row_sse2;
+#endif
+   return stbi__convert_row_generic;
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
+   // the rows are contiguous, so convert the whole image as one long row
+   if (req_comp < img_n) {
+      stbi__get_convert_row()(data, data, img_n, req_comp, x * y);
+      // give back the unused tail; if that fails, the bigger block is still fine
+      good = (unsigned char *) stbi__realloc_sized(data, img_n * x * y, req_comp * x * y);
+      return good ? good : data;
+   }
+
    good = (unsigned char *) stbi__malloc(req_comp * x * y);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
-   for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define COMBO(a,b)  ((a)*8+(b))
-      #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (COMBO(img_n, req_comp)) {
-         CASE(1,2) dest[0]=src[0], dest[1]=255; break;
-         CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
-         CASE(2,1) dest[0]=src[0]; break;
-         CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
-         CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
-         CASE(3,1) dest[0]=stbi__compute_y(src[0],src[1],src[2]); break;
-         CASE(3,2) dest[0]=stbi__compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
-         CASE(4,1) dest[0]=stbi__compute_y(src[0],src[1],src[2]); break;
-         CASE(4,2) dest[0]=stbi__compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
-         CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
-         default: STBI_ASSERT(0);
-      }
-      #undef CASE
-   }
-
-   STBI_FREE(data);
+   stbi__get_convert_row()(good, data, img_n, req_comp, x * y);
+
+   stbi__free(data);
    return good;
 }
 
-#ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+// swap red and blue in a row of x pixels of n >= 3 components
+static void stbi__swap_rb(stbi_uc *p, int n, int x)
 {
-   int i,k,n;
-   float *output = (float *) stbi__malloc(x * y * comp * sizeof(float));
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
-   // compute number of non-alpha components
-   if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+   int i;
+   for (i=0; i < x; ++i, p += n) {
+      stbi_uc t = p[0];
+      p[0] = p[2];
+      p[2] = t;
+   }
+}
+
+// where row 0 of an x*y image goes in d, and the step to the next row;
+// the rows run backwards if the image is to be flipped. returns NULL,
+// having set the failure reason, if the image doesn't fit
+static stbi_uc *stbi__dest_start(stbi__dest *d, int x, int y, int *stride)
+{
+   stbi__uint64 row = (stbi__uint64) x * d->comp;
+   if (d->pitch < 0 || (stbi__uint64) d->pitch < row || (stbi__uint64) d->pitch * (y-1) + row > (stbi__uint64) d->size)
+      return stbi__errpuc("buffer too small", "Image does not fit in destination buffer");
+   if (d->flip) {
+      *stride = -d->pitch;
+      return d->data + (size_t) d->pitch * (y-1);
+   }
+   *stride = d->pitch;
+   return d->data;
+}
+
+// write a row of x pixels with img_n components into d, converting it to
+// the layout wanted there
+static void stbi__dest_row(stbi__dest *d, stbi__convert_row_kernel convert, stbi_uc *out, stbi_uc *src, int img_n, int x)
+{
+   if (img_n == d->comp)
+      memcpy(out, src, (size_t) x * img_n);
+   else
+      convert(out, src, img_n, d->comp, x);
+   if (d->bgr) stbi__swap_rb(out, d->comp, x);
+}
+
+// write an image with img_n components into s->dest, converting it to the
+// layout wanted there; frees data
+static unsigned char *stbi__into_dest(stbi__context *s, unsigned char *data, int img_n, int x, int y)
+{
+   stbi__dest *d = s->dest;
+   stbi__convert_row_kernel convert = stbi__get_convert_row();
+   int j, stride;
+   stbi_uc *out = stbi__dest_start(d, x, y, &stride);
+   if (out)
+      for (j=0; j < y; ++j, out += stride)
+         stbi__dest_row(d, convert, out, data + (size_t) j * x * img_n, img_n, x);
+   stbi__free(data);
+   return out ? d->data : NULL;
+}
+
+// a row callback, for stbi_load_rows
+typedef struct stbi__rows
+{
+   stbi_row_callback callback;
+   void *user;
+   int req_comp, comp;           // components asked for, and handed out
+   int *x, *y, *img_n;           // the caller's, filled in by stbi__rows_begin
+   int next;                     // the image row the callback gets next
+   int x0, y0, w, h;             // the window handed out, clipped to the image
+   int img_h;                    // the image's height
+   int complete;                 // the window's last row is out; stop decoding
+   stbi_uc *buf;                 // a converted row, if the components differ
+   stbi__convert_row_kernel convert;
+} stbi__rows;
+
+// what decoders return once every row has gone to s->rows
+static stbi_uc stbi__rows_sent[1];
+
+// the image is x*y with img_n components; clip the window to it and tell
+// the caller its size, before any rows
+static void stbi__rows_begin(stbi__rows *r, int x, int y, int img_n)
+{
+   if (r->x0 >= x || r->y0 >= y) r->x0 = r->y0 = r->w = r->h = 0;
+   if (r->w > x - r->x0) r->w = x - r->x0;
+   if (r->h > y - r->y0) r->h = y - r->y0;
+   r->img_h = y;
+   *r->x = r->w;
+   *r->y = r->h;
+   if (r->img_n) *r->img_n = img_n;
+   r->comp = r->req_comp ? r->req_comp : img_n;
+}
+
+// is image row y in the window
+static int stbi__rows_wanted(stbi__rows *r, int y)
+{
+   return y >= r->y0 && y < r->y0 + r->h;
+}
+
+// hand the next image row to the callback if it's in the window; span is
+// its r->w pixels there, of img_n components (and is ignored otherwise).
+// 0 if the callback said to stop, or, with r->complete set, if no more
+// rows are wanted
+static int stbi__rows_put_span(stbi__rows *r, stbi_uc *span, int img_n)
+{
+   int y = r->next++;
+   if (stbi__rows_wanted(r, y)) {
+      if (img_n != r->comp) {
+         if (r->buf == NULL && (r->buf = (stbi_uc *) stbi__malloc((size_t) r->w * r->comp)) == NULL)
+            return stbi__err("outofmem", "Out of memory");
+         r->convert(r->buf, span, img_n, r->comp, r->w);
+         span = r->buf;
       }
-      if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
+      if (!r->callback(r->user, y - r->y0, span)) return stbi__err("stopped", "Row callback stopped the load");
    }
-   STBI_FREE(data);
-   return output;
+   if (y+1 >= r->y0 + r->h && y+1 < r->img_h) {
+      r->complete = 1;
+      return 0;
+   }
+   return 1;
 }
-#endif
 
-#ifndef STBI_NO_HDR
-#define stbi__float2int(x)   ((int) (x))
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
+// as stbi__rows_put_span, for a whole row of the image
+static int stbi__rows_put(stbi__rows *r, stbi_uc *row, int img_n)
+{
+   return stbi__rows_put_span(r, row + (size_t) r->x0 * img_n, img_n);
+}
+
+// decoders that know about s->rows hand the rows to it as they finish them;
+// anything else comes back as a whole image and is handed out here. window
+// is x,y,w,h of the part of the image wanted, or NULL for all of it
+static int stbi__load_rows(stbi__context *s, int *x, int *y, int *comp, int req_comp, int const *window, stbi_row_callback row, void *row_user)
+{
+   stbi__rows r;
+   unsigned char *result;
+   int j, ok = 1, img_n, img_x, img_y;
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   if (comp == NULL) comp = &img_n;
+   r.callback = row;
+   r.user = row_user;
+   r.req_comp = req_comp;
+   r.x = x;
+   r.y = y;
+   r.img_n = comp;
+   r.next = 0;
+   r.x0 = window ? window[0] : 0;
+   r.y0 = window ? window[1] : 0;
+   r.w  = window ? window[2] : 0x7fffffff;
+   r.h  = window ? window[3] : 0x7fffffff;
+   r.complete = 0;
+   r.buf = NULL;
+   r.convert = stbi__get_convert_row();
+   s->rows = &r;
+   result = stbi__load_main(s, &img_x, &img_y, comp, req_comp);
+   s->rows = NULL;
+   if (result && result != stbi__rows_sent) {
+      int n = req_comp ? req_comp : *comp;
+      stbi__rows_begin(&r, img_x, img_y, *comp);
+      for (j=0; j < img_y && ok; ++j)
+         ok = stbi__rows_put(&r, result + (size_t) j * img_x * n, n);
+      stbi__free(result);
+   }
+   stbi__free(r.buf);
+   return (result != NULL && ok) || r.complete;
+}
+
+// collects the rows of a window into an image, for stbi_load_region
+typedef struct
+{
+   stbi_uc *out;
+   int *x, *y, *comp, req_comp;
+   int outofmem;
+} stbi__region;
+
+static int stbi__region_row(void *user, int y, stbi_uc const *row)
+{
+   stbi__region *g = (stbi__region *) user;
+   size_t stride = (size_t) *g->x * (g->req_comp ? g->req_comp : *g->comp);
+   if (g->out == NULL) {
+      if ((size_t) *g->y > ((size_t) -1) / stride || (g->out = (stbi_uc *) stbi__malloc(stride * *g->y)) == NULL) {
+         g->outofmem = 1;
+         return 0;
+      }
+   }
+   memcpy(g->out + stride * y, row, stride);
+   return 1;
+}
+
+static stbi_uc *stbi__load_region(stbi__context *s, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__region g;
+   int window[4], img_n;
+   if (rw <= 0 || rh <= 0) return stbi__errpuc("bad region", "Empty or negative region");
+   // clip off the part above or left of the image
+   if (rx < 0) { rw += rx; rx = 0; }
+   if (ry < 0) { rh += ry; ry = 0; }
+   if (rw <= 0 || rh <= 0) return stbi__errpuc("bad region", "Region is outside the image");
+   window[0] = rx; window[1] = ry; window[2] = rw; window[3] = rh;
+   g.out = NULL;
+   g.x = x;
+   g.y = y;
+   g.comp = comp ? comp : &img_n;
+   g.req_comp = req_comp;
+   g.outofmem = 0;
+   if (!stbi__load_rows(s, x, y, g.comp, req_comp, window, stbi__region_row, &g)) {
+      stbi__free(g.out);
+      return g.outofmem ? stbi__errpuc("outofmem", "Out of memory") : NULL;
+   }
+   if (g.out == NULL) return stbi__errpuc("bad region", "Region is outside the image");
+   return g.out;
+}
+
+static stbi_uc *stbi__load_ycbcr(stbi__context *s, int *x, int *y, int *comp, stbi_ycbcr *planes)
+{
+   #ifndef STBI_NO_JPEG
+   if (stbi__jpeg_test(s)) {
+#ifdef STBI_STATS
+      stbi__load_stats load;
+      stbi_uc *result;
+      stbi__stats_begin(&load);
+      result = stbi__jpeg_load_ycbcr(s, x, y, comp, planes);
+      stbi__stats_end(&load);
+      return result;
+#else
+      return stbi__jpeg_load_ycbcr(s, x, y, comp, planes);
+#endif
+   }
+   #else
+   STBI_NOTUSED(s);
+   STBI_NOTUSED(x);
+   STBI_NOTUSED(y);
+   STBI_NOTUSED(comp);
+   STBI_NOTUSED(planes);
+   #endif
+   return stbi__errpuc("not JPEG", "Only JPEGs can be loaded as YCbCr planes");
+}
+
+#ifndef STBI_NO_STDIO
+// decoded image cache
+//
+// a cache file is a fixed header followed by the pixels exactly as
+// stbi__load_main returns them (top row first, RGB order), so a hit is one
+// map and a copy
+
+typedef struct
+{
+   char magic[8];
+   stbi__uint64 key, source_len;
+   stbi__uint32 x, y, comp, out_comp;
+   stbi_uc pad[24];               // keeps the pixels 64-byte aligned
+} stbi__cache_header;
+
+typedef unsigned char validate_cache_header[sizeof(stbi__cache_header)==64 ? 1 : -1];
+
+static const char stbi__cache_magic[8] = { 's','t','b','i','c','c','0','1' };
+
+#define STBI__U64(hi,lo)  (((stbi__uint64) (hi) << 32) | (lo))
+
+static stbi__uint64 stbi__hash_round(stbi__uint64 h, stbi__uint64 v)
+{
+   h += v * STBI__U64(0xc2b2ae3d,0x27d4eb4f);
+   h = (h << 31) | (h >> 33);
+   return h * STBI__U64(0x9e3779b1,0x85ebca87);
+}
+
+// four independent lanes over 32-byte blocks, so it runs at memory speed
+static stbi__uint64 stbi__hash(stbi_uc const *p, size_t n)
+{
+   stbi__uint64 h[4], v;
+   stbi_uc tail[32];
+   size_t i;
+   int k;
+   for (k=0; k < 4; ++k) h[k] = STBI__U64(0x165667b1,0x9e3779f9) * (k+1);
+   for (i=0; i+32 <= n; i += 32)
+      for (k=0; k < 4; ++k) {
+         memcpy(&v, p+i+k*8, 8);
+         h[k] = stbi__hash_round(h[k], v);
+      }
+   memset(tail, 0, sizeof(tail));
+   memcpy(tail, p+i, n-i);
+   for (k=0; k < 4; ++k) {
+      memcpy(&v, tail+k*8, 8);
+      h[k] = stbi__hash_round(h[k], v);
+   }
+   v = n;
+   for (k=0; k < 4; ++k) v = stbi__hash_round(v, h[k]);
+   return v ^ (v >> 29);
+}
+
+static stbi__uint64 stbi__float_bits(float f)
+{
+   stbi__uint32 u;
+   memcpy(&u, &f, 4);
+   return u;
+}
+
+// the settings that change the pixels, plus which components were asked
+// for; flipping and red/blue order are applied after the cache
+static stbi__uint64 stbi__cache_key(stbi__context *s, int req_comp)
+{
+   stbi__options const *o = s->opt;
+   stbi__uint64 h = stbi__hash(s->img_buffer_original, (size_t) (s->img_buffer_original_end - s->img_buffer_original));
+   h = stbi__hash_round(h, (stbi__uint64) req_comp | (stbi__uint64) o->jpeg_scale << 8 | (stbi__uint64) o->unpremultiply << 16 | (stbi__uint64) o->de_iphone << 17);
+   h = stbi__hash_round(h, stbi__float_bits(o->h2l_gamma_i) << 32 | stbi__float_bits(o->h2l_scale_i));
+   return h;
+}
+
+static void stbi__put_hex(char *out, stbi__uint64 v, int digits)
+{
+   while (digits--) {
+      out[digits] = "0123456789abcdef"[v & 15];
+      v >>= 4;
+   }
+}
+
+// dir/0123456789abcdef.stbi
+static char *stbi__cache_path(char const *dir, stbi__uint64 key)
+{
+   size_t n = strlen(dir);
+   char *path = (char *) stbi__malloc(n + 24);
+   if (path == NULL) return NULL;
+   memcpy(path, dir, n);
+   if (n && dir[n-1] != '/' && dir[n-1] != '\\') path[n++] = '/';
+   stbi__put_hex(path+n, key, 16);
+   memcpy(path+n+16, ".stbi", 6);
+   return path;
+}
+
+static int stbi__cache_read_header(stbi__cache_header *h, stbi_uc const *data, size_t size, stbi__uint64 key, stbi__uint64 source_len)
+{
+   if (size < sizeof(*h)) return 0;
+   memcpy(h, data, sizeof(*h));
+   return memcmp(h->magic, stbi__cache_magic, 8) == 0 && h->key == key && h->source_len == source_len
+       && h->out_comp >= 1 && h->out_comp <= 4
+       && size - sizeof(*h) == (stbi__uint64) h->x * h->y * h->out_comp;
+}
+
+// writes the image, given as rows 'stride' bytes apart, under a temporary
+// name and renames it into place, so readers never see half a file. the
+// cache is only an optimization, so any failure just leaves it out
+static void stbi__cache_write(char const *path, stbi__cache_header *h, stbi_uc const *row, int stride, int bgr)
+{
+   size_t n = strlen(path), len = (size_t) h->x * h->out_comp;
+   char *tmp = (char *) stbi__malloc(n + 31);
+   stbi__uint64 pid = 0;
+   stbi_uc *swapped = NULL;
+   FILE *f;
+   int ok = 1;
+   stbi__uint32 j;
+   if (tmp == NULL) return;
+   // path.pppppppp-aaaaaaaaaaaaaaaa.tmp: other processes writing the same
+   // image have another process id, and other threads of this one another
+   // 'tmp' buffer, so no two writers ever share a temporary file
+#if defined(_WIN32)
+   pid = (stbi__uint32) _getpid();
+#elif defined(__unix__) || defined(__APPLE__)
+   pid = (stbi__uint32) getpid();
+#endif
+   memcpy(tmp, path, n);
+   tmp[n] = '.';
+   stbi__put_hex(tmp+n+1, pid, 8);
+   tmp[n+9] = '-';
+   stbi__put_hex(tmp+n+10, (stbi__uint64) (size_t) tmp, 16);
+   memcpy(tmp+n+26, ".tmp", 5);
+   if (bgr) swapped = (stbi_uc *) stbi__malloc(len);
+   f = (bgr && !swapped) ? NULL : stbi__fopen(tmp, "wb");
+   if (f) {
+      ok = fwrite(h, sizeof(*h), 1, f) == 1;
+      for (j=0; ok && j < h->y; ++j, row += stride) {
+         stbi_uc const *p = row;
+         if (swapped) {
+            memcpy(swapped, row, len);
+            stbi__swap_rb(swapped, h->out_comp, h->x);
+            p = swapped;
+         }
+         ok = fwrite(p, 1, len, f) == len;
+      }
+      ok = (fclose(f) == 0) && ok;
+      // rename won't replace an existing file everywhere; if another load
+      // got there first, its copy is as good as ours
+      if (!ok || rename(tmp, path) != 0)
+         remove(tmp);
+   }
+   stbi__free(swapped);
+   stbi__free(tmp);
+}
+
+#ifdef STBI_NO_MMAP
+static stbi_uc *stbi__cache_read_file(char const *path, size_t *size)
+{
+   stbi_uc *data = NULL;
+   long n;
+   FILE *f = stbi__fopen(path, "rb");
+   if (f == NULL) return NULL;
+   if (fseek(f, 0, SEEK_END) == 0 && (n = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+      data = (stbi_uc *) stbi__malloc((size_t) n);
+      if (data && fread(data, 1, (size_t) n, f) != (size_t) n) {
+         stbi__free(data);
+         data = NULL;
+      }
+      *size = (size_t) n;
+   }
+   fclose(f);
+   return data;
+}
+#endif
+
+static unsigned char *stbi__cache_load(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__uint64 source_len = (stbi__uint64) (s->img_buffer_original_end - s->img_buffer_original);
+   stbi__uint64 key = stbi__cache_key(s, req_comp);
+   char *path = stbi__cache_path(s->opt->cache_dir, key);
+   stbi__cache_header h;
+   unsigned char *result = NULL;
+   stbi_uc *data = NULL;
+   size_t size = 0;
+   int hit = 0;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+#endif
+
+   if (path == NULL) return stbi__load_main(s, x, y, comp, req_comp);
+
+#ifndef STBI_NO_MMAP
+   if (stbi__map_file(&m, path)) {
+      data = m.data;
+      size = m.size;
+   }
+#else
+   data = stbi__cache_read_file(path, &size);
+#endif
+   if (data) {
+      if (stbi__cache_read_header(&h, data, size, key, source_len)) {
+         stbi_uc const *pixels = data + sizeof(h);
+         size_t row = (size_t) h.x * h.out_comp;
+         hit = 1;
+         if (s->dest) {
+            int j, stride;
+            stbi_uc *out = stbi__dest_start(s->dest, h.x, h.y, &stride);
+            for (j=0; out && j < (int) h.y; ++j, out += stride) {
+               memcpy(out, pixels + row * j, row);
+               if (s->dest->bgr) stbi__swap_rb(out, h.out_comp, h.x);
+            }
+            result = out ? s->dest->data : NULL;
+         } else {
+            result = (unsigned char *) stbi__malloc(row * h.y);
+            if (result) memcpy(result, pixels, row * h.y);
+            else result = stbi__errpuc("outofmem", "Out of memory");
+         }
+      }
+#ifndef STBI_NO_MMAP
+      stbi__unmap_file(&m);
+#else
+      stbi__free(data);
+#endif
+   }
+
+   if (hit) {
+      if (result) {
+         *x = h.x;
+         *y = h.y;
+         if (comp) *comp = h.comp;
+      }
+   } else {
+      int c = 0;
+      result = stbi__load_main(s, x, y, &c, req_comp);
+      if (comp) *comp = c;
+      if (result) {
+         memcpy(h.magic, stbi__cache_magic, 8);
+         memset(h.pad, 0, sizeof(h.pad));
+         h.key = key;
+         h.source_len = source_len;
+         h.x = *x;
+         h.y = *y;
+         h.comp = c;
+         h.out_comp = req_comp ? req_comp : c;
+         if (s->dest && result == s->dest->data) {
+            // the decoder wrote straight into dest; read it back from there
+            int stride;
+            stbi_uc *first = stbi__dest_start(s->dest, *x, *y, &stride);
+            stbi__cache_write(path, &h, first, stride, s->dest->bgr);
+         } else
+            stbi__cache_write(path, &h, result, *x * h.out_comp, 0);
+      }
+   }
+   stbi__free(path);
+   return result;
+}
+#endif // !STBI_NO_STDIO
+
+// stbi__load_main, through the cache if there is one
+static unsigned char *stbi__load_cached(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+#ifndef STBI_NO_STDIO
+   // only memory sources (including mapped files) can be hashed up front
+   if (s->opt->cache_dir && !s->read_from_callbacks)
+      return stbi__cache_load(s, x, y, comp, req_comp);
+#endif
+   return stbi__load_main(s, x, y, comp, req_comp);
+}
+
+#ifndef STBI_NO_LINEAR
+static float   *stbi__ldr_to_hdr(stbi__options const *opt, stbi_uc *data, int x, int y, int comp)
+{
+   int i,k,n;
+   float *output = (float *) stbi__malloc(x * y * comp * sizeof(float));
+   if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
+   // compute number of non-alpha components
+   if (comp & 1) n = comp; else n = comp-1;
+   for (i=0; i < x*y; ++i) {
+      for (k=0; k < n; ++k) {
+         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, opt->l2h_gamma) * opt->l2h_scale);
+      }
+      if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
+   }
+   stbi__free(data);
+   return output;
+}
+#endif
+
+#ifndef STBI_NO_HDR
+#define stbi__float2int(x)   ((int) (x))
+static stbi_uc *stbi__hdr_to_ldr(stbi__options const *opt, float   *data, int x, int y, int comp)
 {
    int i,k,n;
    stbi_uc *output = (stbi_uc *) stbi__malloc(x * y * comp);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
+         float z = (float) pow(data[i*comp+k]*opt->h2l_scale_i, opt->h2l_gamma_i) * 255 + 0.5f;
          if (z < 0) z = 0;
          if (z > 255) z = 255;
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
@@ -1424,7 +3511,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
       }
    }
-   STBI_FREE(data);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1453,7 +3540,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 #ifndef STBI_NO_JPEG
 
 // huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+#define FAST_BITS   11 // larger handles more cases; smaller stomps less cache
 
 typedef struct
 {
@@ -1466,13 +3553,15 @@ typedef struct
    int    delta[17];   // old 'firstsymbol' - old 'firstcode'
 } stbi__huffman;
 
+struct stbi__jpeg_emit;
+
 typedef struct
 {
    stbi__context *s;
    stbi__huffman huff_dc[4];
    stbi__huffman huff_ac[4];
    stbi_uc dequant[4][64];
-   stbi__int16 fast_ac[4][1 << FAST_BITS];
+   stbi__int32 fast_ac[4][1 << FAST_BITS];
 
 // sizes for components, interleaved MCUs
    int img_h_max, img_v_max;
@@ -1494,9 +3583,14 @@ typedef struct
       stbi_uc *linebuf;
       short   *coeff;   // progressive only
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+      stbi__uint64 coeff_done;   // the coefficients whose last bit has been read
+      int      live;             // the current scan completes them, so rows go through the IDCT as it goes
+      int      final_rows;       // block rows already through the IDCT for good
+      int      bx0, bx1, by0, by1; // the blocks the output needs; the rest skip the IDCT
+      int      scale;            // log2 of this plane's downscale; less than z->scale if subsampled
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   stbi__uint64   code_buffer; // jpeg entropy-coded buffer, next bit at the top
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
@@ -1511,11 +3605,17 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
-
-// kernels
-   void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   int scale;                  // log2 of the downscale factor; blocks decode to (8>>scale) pixels square
+   int ring;                   // the component planes only hold the last two MCU rows, for s->rows
+   int out_x0, out_w;          // the columns stbi__jpeg_convert_rows makes
+   struct stbi__jpeg_emit *emit; // converts rows into s->dest as they are decoded, for dest->progress
+
+// kernels; the idct ones by log2 of the downscale
+   void (*idct_block_kernel[4])(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_pair_kernel[4])(stbi_uc *out, int out_stride, short data[128]);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+   void (*YCbCr_upsample_kernel)(stbi_uc *out, stbi_uc const *y, stbi_uc const **c, int w, int x, int count, int step, int hs, int vs); // NULL if none
 } stbi__jpeg;
 
 static int stbi__build_huffman(stbi__huffman *h, int *count)
@@ -1559,9 +3659,11 @@ static int stbi__build_huffman(stbi__huffman *h, int *count)
    return 1;
 }
 
-// build a table that decodes both magnitude and value of small ACs in
-// one go.
-static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
+// build a table that decodes both magnitude and value of ACs in one go,
+// whenever the code and its extra bits fit in FAST_BITS. an entry is the
+// value times 65536, plus the run times 256, plus the bits used; 0 means
+// take the slow path
+static void stbi__build_fast_ac(stbi__int32 *fast_ac, stbi__huffman *h)
 {
    int i;
    for (i=0; i < (1 << FAST_BITS); ++i) {
@@ -1577,35 +3679,55 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
             // magnitude code followed by receive_extend code
             int k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
             int m = 1 << (magbits - 1);
-            if (k < m) k += (-1 << magbits) + 1;
-            // if the result is small enough, we can fit it in fast_ac table
-            if (k >= -128 && k <= 127)
-               fast_ac[i] = (stbi__int16) ((k << 8) + (run << 4) + (len + magbits));
+            if (k < m) k += 1 - (1 << magbits);
+            fast_ac[i] = k * 65536 + (run << 8) + (len + magbits);
          }
       }
    }
 }
 
+stbi_inline static stbi__uint64 stbi__jpeg_load64(stbi_uc const *p)
+{
+   return ((stbi__uint64) p[0] << 56) | ((stbi__uint64) p[1] << 48) |
+          ((stbi__uint64) p[2] << 40) | ((stbi__uint64) p[3] << 32) |
+          ((stbi__uint64) p[4] << 24) | ((stbi__uint64) p[5] << 16) |
+          ((stbi__uint64) p[6] <<  8) |  (stbi__uint64) p[7];
+}
+
+// tops the bit buffer up to more than 56 bits, or to the next marker
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   stbi__context *s = j->s;
+   if (!j->nomore && s->img_buffer_end - s->img_buffer >= 8) {
+      // if none of the next 8 bytes is 0xff there's no stuffing or marker
+      // to deal with, so take as many whole bytes as fit in one go
+      stbi__uint64 v = stbi__jpeg_load64(s->img_buffer), inv = ~v;
+      stbi__uint64 ones = ~(stbi__uint64) 0 / 255;
+      if (((inv - ones) & ~inv & (ones << 7)) == 0) {
+         int n = (63 - j->code_bits) >> 3;
+         j->code_buffer |= (v >> (64 - 8*n)) << (64 - 8*n - j->code_bits);
+         j->code_bits += 8*n;
+         s->img_buffer += n;
+         STBI__STAT_BYTES(STBI_stat_jpeg_entropy, n);
+         return;
+      }
+   }
    do {
-      int b = j->nomore ? 0 : stbi__get8(j->s);
+      int b = j->nomore ? 0 : stbi__get8(s);
+      STBI__STAT_BYTES(STBI_stat_jpeg_entropy, !j->nomore);
       if (b == 0xff) {
-         int c = stbi__get8(j->s);
+         int c = stbi__get8(s);
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static stbi__uint32 stbi__bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -1616,7 +3738,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -1633,7 +3755,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -1647,8 +3769,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
+   STBI_ASSERT((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -1663,15 +3785,13 @@ static int const stbi__jbias[16] = {0,-1,-3,-7,-15,-31,-63,-127,-255,-511,-1023,
 // always extends everything it receives.
 stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 {
-   unsigned int k;
-   int sgn;
+   int k, sgn;
+   STBI_ASSERT(n > 0 && n < 16);
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
 
-   sgn = (stbi__int32)j->code_buffer >> 31; // sign bit is always in MSB
-   k = stbi_lrot(j->code_buffer, n);
-   STBI_ASSERT(n >= 0 && n < (int) (sizeof(stbi__bmask)/sizeof(*stbi__bmask)));
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = -(int) (j->code_buffer >> 63); // sign bit is always in MSB
+   k = (int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k + (stbi__jbias[n] & ~sgn);
 }
@@ -1679,23 +3799,23 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 // get some unsigned bits
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
-   unsigned int k;
+   int k;
+   STBI_ASSERT(n > 0 && n < 16);
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = (int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   int k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-   k = j->code_buffer;
+   k = (int) (j->code_buffer >> 63);
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -1716,14 +3836,14 @@ static stbi_uc stbi__jpeg_dezigzag[64+15] =
 };
 
 // decode one 64-entry block--
-static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi_uc *dequant)
+static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int32 *fac, int b, stbi_uc *dequant)
 {
    int diff,dc,k;
    int t;
 
    if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
    t = stbi__jpeg_huff_decode(j, hdc);
-   if (t < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+   if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
 
    // 0 all the ac values now so we can do it 32-bits at a time
    memset(data,0,64*sizeof(data[0]));
@@ -1739,16 +3859,16 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
       r = fac[c];
       if (r) { // fast-AC path
-         k += (r >> 4) & 15; // run
-         s = r & 15; // combined length
+         k += (r >> 8) & 15; // run
+         s = r & 31; // combined length
          j->code_buffer <<= s;
          j->code_bits -= s;
          // decode into unzigzag'd location
          zig = stbi__jpeg_dezigzag[k++];
-         data[zig] = (short) ((r >> 8) * dequant[zig]);
+         data[zig] = (short) ((r >> 16) * dequant[zig]);
       } else {
          int rs = stbi__jpeg_huff_decode(j, hac);
          if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
@@ -1780,6 +3900,7 @@ static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__
       // first scan for DC coefficient, must be first
       memset(data,0,64*sizeof(data[0])); // 0 all the ac values now
       t = stbi__jpeg_huff_decode(j, hdc);
+      if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
       diff = t ? stbi__extend_receive(j, t) : 0;
 
       dc = j->img_comp[b].dc_pred + diff;
@@ -1795,7 +3916,7 @@ static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__
 
 // @OPTIMIZE: store non-zigzagged during the decode passes,
 // and only de-zigzag when dequantizing
-static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__huffman *hac, stbi__int16 *fac)
+static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__huffman *hac, stbi__int32 *fac)
 {
    int k;
    if (j->spec_start == 0) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
@@ -1813,15 +3934,15 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (64 - FAST_BITS));
          r = fac[c];
          if (r) { // fast-AC path
-            k += (r >> 4) & 15; // run
-            s = r & 15; // combined length
+            k += (r >> 8) & 15; // run
+            s = r & 31; // combined length
             j->code_buffer <<= s;
             j->code_bits -= s;
             zig = stbi__jpeg_dezigzag[k++];
-            data[zig] = (short) ((r >> 8) << shift);
+            data[zig] = (short) ((r >> 16) * (1 << shift));
          } else {
             int rs = stbi__jpeg_huff_decode(j, hac);
             if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
@@ -2025,6 +4146,87 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// two horizontally adjacent blocks, data[0..63] being the left one
+static void stbi__idct_block_pair(stbi_uc *out, int out_stride, short data[128])
+{
+   stbi__idct_block(out, out_stride, data);
+   stbi__idct_block(out+8, out_stride, data+64);
+}
+
+// reduced IDCTs for decoding at 1/2, 1/4 and 1/8 scale. each output pixel is
+// the average of the block of pixels the full IDCT would have made for it,
+// taken from the low-frequency corner of the coefficients (the rest only
+// adds detail finer than the output can show)
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i, val[16], *v=val;
+   short *d = data;
+
+   // columns
+   for (i=0; i < 4; ++i,++d,++v) {
+      int t0 = d[ 0] * stbi__f2f(0.707106781f) + d[16] * stbi__f2f(0.653281482f);
+      int t1 = d[ 0] * stbi__f2f(0.707106781f) - d[16] * stbi__f2f(0.653281482f);
+      int o0 = d[ 8] * stbi__f2f(0.906127446f) + d[24] * stbi__f2f(0.318189645f);
+      int o1 = d[ 8] * stbi__f2f(0.375330278f) - d[24] * stbi__f2f(0.768177757f);
+      // keep 2 extra bits of precision, like the full IDCT
+      v[ 0] = (t0 + o0 + 512) >> 10;
+      v[ 4] = (t1 + o1 + 512) >> 10;
+      v[ 8] = (t1 - o1 + 512) >> 10;
+      v[12] = (t0 - o0 + 512) >> 10;
+   }
+
+   // rows; the two passes leave the result scaled by 4*4096*4, and the
+   // 1/4 normalization of the 2D transform makes that a shift by 16
+   for (i=0, v=val; i < 4; ++i, v+=4, out+=out_stride) {
+      int t0 = v[0] * stbi__f2f(0.707106781f) + v[2] * stbi__f2f(0.653281482f) + 32768 + (128<<16);
+      int t1 = v[0] * stbi__f2f(0.707106781f) - v[2] * stbi__f2f(0.653281482f) + 32768 + (128<<16);
+      int o0 = v[1] * stbi__f2f(0.906127446f) + v[3] * stbi__f2f(0.318189645f);
+      int o1 = v[1] * stbi__f2f(0.375330278f) - v[3] * stbi__f2f(0.768177757f);
+      out[0] = stbi__clamp((t0 + o0) >> 16);
+      out[1] = stbi__clamp((t1 + o1) >> 16);
+      out[2] = stbi__clamp((t1 - o1) >> 16);
+      out[3] = stbi__clamp((t0 - o0) >> 16);
+   }
+}
+
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   // small enough to do both dimensions at once
+   int p = data[0] * stbi__f2f(0.5f) + 8192 + (128<<14);
+   int q = data[1] * stbi__f2f(0.453063723f);
+   int r = data[8] * stbi__f2f(0.453063723f);
+   int s = data[9] * stbi__f2f(0.410533475f);
+   out[0] = stbi__clamp((p + q + r + s) >> 14);
+   out[1] = stbi__clamp((p - q + r - s) >> 14);
+   out += out_stride;
+   out[0] = stbi__clamp((p + q - r - s) >> 14);
+   out[1] = stbi__clamp((p - q - r + s) >> 14);
+}
+
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
+static void stbi__idct_4x4_pair(stbi_uc *out, int out_stride, short data[128])
+{
+   stbi__idct_4x4(out, out_stride, data);
+   stbi__idct_4x4(out+4, out_stride, data+64);
+}
+
+static void stbi__idct_2x2_pair(stbi_uc *out, int out_stride, short data[128])
+{
+   stbi__idct_2x2(out, out_stride, data);
+   stbi__idct_2x2(out+2, out_stride, data+64);
+}
+
+static void stbi__idct_1x1_pair(stbi_uc *out, int out_stride, short data[128])
+{
+   stbi__idct_1x1(out, out_stride, data);
+   stbi__idct_1x1(out+1, out_stride, data+64);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2206,96 +4408,280 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
-#ifdef STBI_NEON
-
-// NEON integer IDCT. should produce bit-identical
-// results to the generic C version.
-static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+#ifdef STBI_AVX2
+// the sse2 IDCT above run on two blocks at once, one per 128-bit lane.
+// every step stays within its lane, so the output is bit-identical
+STBI__AVX2_TARGET
+static void stbi__idct_avx2_pair(stbi_uc *out, int out_stride, short data[128])
 {
-   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
 
-   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
-   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
-   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
-   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
-   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
-   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
-   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
-   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
-   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
-   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
-   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
-   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
 
-#define dct_long_mul(out, inq, coeff) \
-   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
-   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
 
-#define dct_long_mac(out, acc, inq, coeff) \
-   int32x4_t out##_l = vmlal_s16(acc##_l, vget_low_s16(inq), coeff); \
-   int32x4_t out##_h = vmlal_s16(acc##_h, vget_high_s16(inq), coeff)
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
 
-#define dct_widen(out, inq) \
-   int32x4_t out##_l = vshll_n_s16(vget_low_s16(inq), 12); \
-   int32x4_t out##_h = vshll_n_s16(vget_high_s16(inq), 12)
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
 
-// wide add
-#define dct_wadd(out, a, b) \
-   int32x4_t out##_l = vaddq_s32(a##_l, b##_l); \
-   int32x4_t out##_h = vaddq_s32(a##_h, b##_h)
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
 
-// wide sub
-#define dct_wsub(out, a, b) \
-   int32x4_t out##_l = vsubq_s32(a##_l, b##_l); \
-   int32x4_t out##_h = vsubq_s32(a##_h, b##_h)
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
 
-// butterfly a/b, then shift using "shiftop" by "s" and pack
-#define dct_bfly32o(out0,out1, a,b,shiftop,s) \
-   { \
-      dct_wadd(sum, a, b); \
-      dct_wsub(dif, a, b); \
-      out0 = vcombine_s16(shiftop(sum_l, s), shiftop(sum_h, s)); \
-      out1 = vcombine_s16(shiftop(dif_l, s), shiftop(dif_h, s)); \
-   }
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
 
-#define dct_pass(shiftop, shift) \
-   { \
-      /* even part */ \
-      int16x8_t sum26 = vaddq_s16(row2, row6); \
-      dct_long_mul(p1e, sum26, rot0_0); \
-      dct_long_mac(t2e, p1e, row6, rot0_1); \
-      dct_long_mac(t3e, p1e, row2, rot0_2); \
-      int16x8_t sum04 = vaddq_s16(row0, row4); \
-      int16x8_t dif04 = vsubq_s16(row0, row4); \
-      dct_widen(t0e, sum04); \
-      dct_widen(t1e, dif04); \
-      dct_wadd(x0, t0e, t3e); \
-      dct_wsub(x3, t0e, t3e); \
-      dct_wadd(x1, t1e, t2e); \
-      dct_wsub(x2, t1e, t2e); \
-      /* odd part */ \
-      int16x8_t sum15 = vaddq_s16(row1, row5); \
-      int16x8_t sum17 = vaddq_s16(row1, row7); \
-      int16x8_t sum35 = vaddq_s16(row3, row5); \
-      int16x8_t sum37 = vaddq_s16(row3, row7); \
-      int16x8_t sumodd = vaddq_s16(sum17, sum35); \
-      dct_long_mul(p5o, sumodd, rot1_0); \
-      dct_long_mac(p1o, p5o, sum17, rot1_1); \
-      dct_long_mac(p2o, p5o, sum35, rot1_2); \
-      dct_long_mul(p3o, sum37, rot2_0); \
-      dct_long_mul(p4o, sum15, rot2_1); \
-      dct_wadd(sump13o, p1o, p3o); \
-      dct_wadd(sump24o, p2o, p4o); \
-      dct_wadd(sump23o, p2o, p3o); \
-      dct_wadd(sump14o, p1o, p4o); \
-      dct_long_mac(x4, sump13o, row7, rot3_0); \
-      dct_long_mac(x5, sump24o, row5, rot3_1); \
-      dct_long_mac(x6, sump23o, row3, rot3_2); \
-      dct_long_mac(x7, sump14o, row1, rot3_3); \
-      dct_bfly32o(row0,row7, x0,x7,shiftop,shift); \
-      dct_bfly32o(row1,row6, x1,x6,shiftop,shift); \
-      dct_bfly32o(row2,row5, x2,x5,shiftop,shift); \
-      dct_bfly32o(row3,row4, x3,x4,shiftop,shift); \
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   // row k of the left block in the low lane, of the right block in the high lane
+   #define dct_load(k) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data + (k)*8))), \
+                              _mm_load_si128((const __m128i *) (data + 64 + (k)*8)), 1)
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m256i p0 = _mm256_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // each lane holds two rows of its block; gather both halves of each
+      // 16-pixel output row into one 128-bit half before storing
+      p0 = _mm256_permute4x64_epi64(p0, 0xd8);
+      p1 = _mm256_permute4x64_epi64(p1, 0xd8);
+      p2 = _mm256_permute4x64_epi64(p2, 0xd8);
+      p3 = _mm256_permute4x64_epi64(p3, 0xd8);
+
+      // store
+      _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(p0)); out += out_stride;
+      _mm_storeu_si128((__m128i *) out, _mm256_extracti128_si256(p0, 1)); out += out_stride;
+      _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(p2)); out += out_stride;
+      _mm_storeu_si128((__m128i *) out, _mm256_extracti128_si256(p2, 1)); out += out_stride;
+      _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(p1)); out += out_stride;
+      _mm_storeu_si128((__m128i *) out, _mm256_extracti128_si256(p1, 1)); out += out_stride;
+      _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(p3)); out += out_stride;
+      _mm_storeu_si128((__m128i *) out, _mm256_extracti128_si256(p3, 1));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+}
+
+#endif // STBI_AVX2
+
+#ifdef STBI_NEON
+
+// NEON integer IDCT. should produce bit-identical
+// results to the generic C version.
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
+
+   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
+   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
+   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
+   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
+   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
+   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
+   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
+   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
+   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
+   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
+   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
+   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
+
+#define dct_long_mul(out, inq, coeff) \
+   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
+   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
+
+#define dct_long_mac(out, acc, inq, coeff) \
+   int32x4_t out##_l = vmlal_s16(acc##_l, vget_low_s16(inq), coeff); \
+   int32x4_t out##_h = vmlal_s16(acc##_h, vget_high_s16(inq), coeff)
+
+#define dct_widen(out, inq) \
+   int32x4_t out##_l = vshll_n_s16(vget_low_s16(inq), 12); \
+   int32x4_t out##_h = vshll_n_s16(vget_high_s16(inq), 12)
+
+// wide add
+#define dct_wadd(out, a, b) \
+   int32x4_t out##_l = vaddq_s32(a##_l, b##_l); \
+   int32x4_t out##_h = vaddq_s32(a##_h, b##_h)
+
+// wide sub
+#define dct_wsub(out, a, b) \
+   int32x4_t out##_l = vsubq_s32(a##_l, b##_l); \
+   int32x4_t out##_h = vsubq_s32(a##_h, b##_h)
+
+// butterfly a/b, then shift using "shiftop" by "s" and pack
+#define dct_bfly32o(out0,out1, a,b,shiftop,s) \
+   { \
+      dct_wadd(sum, a, b); \
+      dct_wsub(dif, a, b); \
+      out0 = vcombine_s16(shiftop(sum_l, s), shiftop(sum_h, s)); \
+      out1 = vcombine_s16(shiftop(dif_l, s), shiftop(dif_h, s)); \
+   }
+
+#define dct_pass(shiftop, shift) \
+   { \
+      /* even part */ \
+      int16x8_t sum26 = vaddq_s16(row2, row6); \
+      dct_long_mul(p1e, sum26, rot0_0); \
+      dct_long_mac(t2e, p1e, row6, rot0_1); \
+      dct_long_mac(t3e, p1e, row2, rot0_2); \
+      int16x8_t sum04 = vaddq_s16(row0, row4); \
+      int16x8_t dif04 = vsubq_s16(row0, row4); \
+      dct_widen(t0e, sum04); \
+      dct_widen(t1e, dif04); \
+      dct_wadd(x0, t0e, t3e); \
+      dct_wsub(x3, t0e, t3e); \
+      dct_wadd(x1, t1e, t2e); \
+      dct_wsub(x2, t1e, t2e); \
+      /* odd part */ \
+      int16x8_t sum15 = vaddq_s16(row1, row5); \
+      int16x8_t sum17 = vaddq_s16(row1, row7); \
+      int16x8_t sum35 = vaddq_s16(row3, row5); \
+      int16x8_t sum37 = vaddq_s16(row3, row7); \
+      int16x8_t sumodd = vaddq_s16(sum17, sum35); \
+      dct_long_mul(p5o, sumodd, rot1_0); \
+      dct_long_mac(p1o, p5o, sum17, rot1_1); \
+      dct_long_mac(p2o, p5o, sum35, rot1_2); \
+      dct_long_mul(p3o, sum37, rot2_0); \
+      dct_long_mul(p4o, sum15, rot2_1); \
+      dct_wadd(sump13o, p1o, p3o); \
+      dct_wadd(sump24o, p2o, p4o); \
+      dct_wadd(sump23o, p2o, p3o); \
+      dct_wadd(sump14o, p1o, p4o); \
+      dct_long_mac(x4, sump13o, row7, rot3_0); \
+      dct_long_mac(x5, sump24o, row5, rot3_1); \
+      dct_long_mac(x6, sump23o, row3, rot3_2); \
+      dct_long_mac(x7, sump14o, row1, rot3_3); \
+      dct_bfly32o(row0,row7, x0,x7,shiftop,shift); \
+      dct_bfly32o(row1,row6, x1,x6,shiftop,shift); \
+      dct_bfly32o(row2,row5, x2,x5,shiftop,shift); \
+      dct_bfly32o(row3,row4, x3,x4,shiftop,shift); \
    }
 
    // load
@@ -2448,14 +4834,225 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// the first pixel row of block row 'by' in component n's plane
+static stbi_uc *stbi__jpeg_block_row(stbi__jpeg *z, int n, int by)
+{
+   if (z->ring) by %= 2 * z->img_comp[n].v;
+   return z->img_comp[n].data + z->img_comp[n].w2 * by * (8 >> z->img_comp[n].scale);
+}
+
+// does the output need any of blocks bx..bx+nbx-1 of block row by
+static int stbi__jpeg_block_wanted(stbi__jpeg *z, int n, int bx, int nbx, int by)
+{
+   return by >= z->img_comp[n].by0 && by < z->img_comp[n].by1 && bx + nbx > z->img_comp[n].bx0 && bx < z->img_comp[n].bx1;
+}
+
+// the IDCT of one block of component n, or of two side by side (pair)
+stbi_inline static void stbi__jpeg_idct(stbi__jpeg *z, int n, stbi_uc *out, int out_stride, short *data, int pair)
+{
+   int scale = z->img_comp[n].scale;
+   STBI__STAT_ENTER(STBI_stat_jpeg_idct);
+   if (pair)
+      z->idct_pair_kernel[scale](out, out_stride, data);
+   else
+      z->idct_block_kernel[scale](out, out_stride, data);
+   STBI__STAT_LEAVE(STBI_stat_jpeg_idct, (64 >> 2*scale) << pair);
+}
+
+#ifdef STBI_THREADS
+// smallest baseline image (in pixels) worth decoding restart intervals in parallel
+#define STBI__JPEG_PARALLEL_MIN  (1 << 18)
+
+static int stbi__jpeg_scan_mcus(stbi__jpeg *z)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      return ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   }
+   return z->img_mcu_x * z->img_mcu_y;
+}
+
+// decode restart interval k of a baseline scan, starting from the current
+// input position, exactly as stbi__parse_entropy_coded_data would: returns
+// 0 on error, 1 if it ended on a restart marker, 2 if not (where the serial
+// loop stops)
+static int stbi__jpeg_decode_interval(stbi__jpeg *z, int k)
+{
+   STBI_SIMD_ALIGN(short, data[128]);
+   int m, c, x, y, total = stbi__jpeg_scan_mcus(z);
+   int end = (k+1) * z->restart_interval;
+   stbi__jpeg_reset(z);
+   for (m = k * z->restart_interval; m < end && m < total; ++m) {
+      if (z->scan_n == 1) {
+         int n = z->order[0], ha = z->img_comp[n].ha, bs = 8 >> z->img_comp[n].scale;
+         int w = (z->img_comp[n].x+7) >> 3, i = m % w, j = m / w;
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         if (stbi__jpeg_block_wanted(z, n, i, 1, j))
+            stbi__jpeg_idct(z, n, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data, 0);
+      } else {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+         for (c=0; c < z->scan_n; ++c) {
+            int n = z->order[c], ha = z->img_comp[n].ha, bs = 8 >> z->img_comp[n].scale;
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int bx = i*z->img_comp[n].h + x, by = j*z->img_comp[n].v + y;
+                  stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*by*bs+bx*bs;
+                  short *d = data + 64*(x&1);
+                  if (!stbi__jpeg_decode_block(z, d, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  if (x & 1) {
+                     if (stbi__jpeg_block_wanted(z, n, bx-1, 2, by))
+                        stbi__jpeg_idct(z, n, out-bs, z->img_comp[n].w2, data, 1);
+                  } else if (x+1 == z->img_comp[n].h && stbi__jpeg_block_wanted(z, n, bx, 1, by))
+                     stbi__jpeg_idct(z, n, out, z->img_comp[n].w2, d, 0);
+               }
+            }
+         }
+      }
+   }
+   if (end > total) return 2;
+   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+   return STBI__RESTART(z->marker) ? 1 : 2;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc *data;          // start of the scan's entropy-coded data
+   int data_len;
+   int *start;             // where each interval starts in it
+   int ntask, nint;        // the last interval isn't part of any task
+   int failed[STBI__MAX_THREADS*4];
+} stbi__jpeg_interval_job;
+
+static void stbi__jpeg_interval_task(void *arg, int t)
+{
+   stbi__jpeg_interval_job *job = (stbi__jpeg_interval_job *) arg;
+   int k = (int) ((stbi__uint64) (job->nint-1) *  t    / job->ntask);
+   int e = (int) ((stbi__uint64) (job->nint-1) * (t+1) / job->ntask);
+   stbi__context s;
+   // a private copy of the decoder for its bit reader and dc predictions
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   job->failed[t] = 1;
+   if (z == NULL) return;
+   memcpy(z, job->z, sizeof(stbi__jpeg));
+   z->s = &s;
+   for (; k < e; ++k) {
+      stbi__start_mem(&s, job->data + job->start[k], job->data_len - job->start[k]);
+      if (stbi__jpeg_decode_interval(z, k) != 1) break;
+   }
+   job->failed[t] = k < e;
+   stbi__free(z);
+}
+
+// decode a baseline scan from memory with its restart intervals spread
+// over several threads. returns 1 or 0 like stbi__parse_entropy_coded_data,
+// or -1 with the input rewound if the scan has to be decoded serially
+static int stbi__jpeg_parallel_intervals(stbi__jpeg *z)
+{
+   stbi__context *s = z->s;
+   stbi__jpeg_interval_job job;
+   stbi_uc *p, *end = s->img_buffer_end;
+   int nint, k = 0, r, threads;
+
+   if (s->opt->max_threads < 2 || s->io.read || !z->restart_interval || z->ring) return -1;
+   if ((stbi__uint64) s->img_x * s->img_y < STBI__JPEG_PARALLEL_MIN) return -1;
+   nint = (stbi__jpeg_scan_mcus(z) + z->restart_interval-1) / z->restart_interval;
+   if (nint < 2 || end - s->img_buffer > 0x7fffffff) return -1;
+   job.start = (int *) stbi__malloc(nint * sizeof(int));
+   if (job.start == NULL) return -1;
+
+   // find the restart markers; the scan has to have exactly one per interval
+   job.data = s->img_buffer;
+   job.start[0] = 0;
+   for (p = s->img_buffer; (p = (stbi_uc *) memchr(p, 0xff, end - p)) != NULL && p+1 < end; p += 2) {
+      if (p[1] == 0) continue;
+      if (!STBI__RESTART(p[1]) || ++k == nint) break;
+      job.start[k] = (int) (p+2 - job.data);
+   }
+   // fill bytes before the next marker throw the serial decoder, so leave those to it
+   if (k != nint-1 || p == NULL || p+1 >= end || p[1] == 0xff) {
+      stbi__free(job.start);
+      return -1;
+   }
+
+   job.z = z;
+   job.data_len = (int) (end - job.data);
+   job.nint = nint;
+   threads = s->opt->max_threads < STBI__MAX_THREADS ? s->opt->max_threads : STBI__MAX_THREADS;
+   job.ntask = nint-1 < threads*4 ? nint-1 : threads*4;
+   stbi__parallel_for(job.ntask, threads, stbi__jpeg_interval_task, &job);
+   for (k=0; k < job.ntask; ++k) {
+      if (job.failed[k]) {
+         stbi__free(job.start);
+         return -1;
+      }
+   }
+
+   // the last interval runs here, leaving the input where the serial loop would
+   s->img_buffer = job.data + job.start[nint-1];
+   r = stbi__jpeg_decode_interval(z, nint-1);
+   if (r == 1) stbi__jpeg_reset(z);
+   stbi__free(job.start);
+   return r != 0;
+}
+#endif
+
+static int stbi__jpeg_emit_rows(stbi__jpeg *z, int decoded);
+static int stbi__jpeg_alloc_plane(stbi__jpeg *z, int n);
+
+static void stbi__jpeg_dequantize(short *out, short const *data, stbi_uc const *dequant)
+{
+   int i;
+   for (i=0; i < 64; ++i)
+      out[i] = (short) (data[i] * dequant[i]);
+}
+
+// dequantize and idct block rows j..h-1 of progressive component n into its
+// plane. the coefficients are left as they are, for scans still to come
+static void stbi__jpeg_idct_block_rows(stbi__jpeg *z, int n, int j, int h)
+{
+   STBI_SIMD_ALIGN(short, data[128]);
+   int i, bs = 8 >> z->img_comp[n].scale;
+   int w = (z->img_comp[n].x+7) >> 3;
+   int i0 = z->img_comp[n].bx0;
+   stbi_uc const *dq = z->dequant[z->img_comp[n].tq];
+   if (j < z->img_comp[n].by0) j = z->img_comp[n].by0;
+   if (w > z->img_comp[n].bx1) w = z->img_comp[n].bx1;
+   if (h > (z->img_comp[n].y+7) >> 3) h = (z->img_comp[n].y+7) >> 3;
+   if (h > z->img_comp[n].by1) h = z->img_comp[n].by1;
+   STBI__STAT_ENTER(STBI_stat_jpeg_idct);
+   for (; j < h; ++j) {
+      for (i=i0; i < w; ++i) {
+         short *c = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+         // blocks along a row are contiguous, so take them two at a time
+         stbi__jpeg_dequantize(data, c, dq);
+         if (i+1 < w) {
+            stbi__jpeg_dequantize(data+64, c+64, dq);
+            stbi__jpeg_idct(z, n, stbi__jpeg_block_row(z, n, j)+i*bs, z->img_comp[n].w2, data, 1);
+            ++i;
+         } else
+            stbi__jpeg_idct(z, n, stbi__jpeg_block_row(z, n, j)+i*bs, z->img_comp[n].w2, data, 0);
+      }
+   }
+   STBI__STAT_LEAVE(STBI_stat_jpeg_idct, 0);
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
    if (!z->progressive) {
+#ifdef STBI_THREADS
+      stbi_uc *scan_start = z->s->img_buffer;
+      int r = stbi__jpeg_parallel_intervals(z);
+      if (r >= 0) return r;
+      z->s->img_buffer = scan_start;
+      stbi__jpeg_reset(z);
+#endif
       if (z->scan_n == 1) {
          int i,j;
          STBI_SIMD_ALIGN(short, data[64]);
          int n = z->order[0];
+         int bs = 8 >> z->img_comp[n].scale; // size of a decoded block
          // non-interleaved data, we just need to process one block at a time,
          // in trivial scanline order
          // number of blocks to do just depends on how many actual "pixels" this
@@ -2466,7 +5063,8 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (stbi__jpeg_block_wanted(z, n, i, 1, j))
+                  stbi__jpeg_idct(z, n, stbi__jpeg_block_row(z, n, j)+i*bs, z->img_comp[n].w2, data, 0);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2476,25 +5074,33 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->emit && z->s->img_n == 1 && !stbi__jpeg_emit_rows(z, (j+1) * bs)) return 0;
          }
          return 1;
       } else { // interleaved
          int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
+         STBI_SIMD_ALIGN(short, data[128]);
          for (j=0; j < z->img_mcu_y; ++j) {
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
                   int n = z->order[k];
+                  int bs = 8 >> z->img_comp[n].scale; // size of a decoded block
                   // scan out an mcu's worth of this component; that's just determined
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int bx = i*z->img_comp[n].h + x, by = j*z->img_comp[n].v + y;
                         int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        stbi_uc *out = stbi__jpeg_block_row(z, n, by) + bx*bs;
+                        // horizontally adjacent blocks go through the IDCT in pairs
+                        short *d = data + 64*(x&1);
+                        if (!stbi__jpeg_decode_block(z, d, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        if (x & 1) {
+                           if (stbi__jpeg_block_wanted(z, n, bx-1, 2, by))
+                              stbi__jpeg_idct(z, n, out-bs, z->img_comp[n].w2, data, 1);
+                        } else if (x+1 == z->img_comp[n].h && stbi__jpeg_block_wanted(z, n, bx, 1, by))
+                           stbi__jpeg_idct(z, n, out, z->img_comp[n].w2, d, 0);
                      }
                   }
                }
@@ -2506,6 +5112,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->emit && z->scan_n == z->s->img_n && !stbi__jpeg_emit_rows(z, (j+1) * z->img_mcu_h)) return 0;
          }
          return 1;
       }
@@ -2537,6 +5144,11 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            // the row is final, and still in the cache
+            if (z->img_comp[n].live) {
+               stbi__jpeg_idct_block_rows(z, n, j, j+1);
+               z->img_comp[n].final_rows = j+1;
+            }
          }
          return 1;
       } else { // interleaved
@@ -2566,41 +5178,111 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            for (k=0; k < z->scan_n; ++k) {
+               int n = z->order[k], v = z->img_comp[n].v;
+               if (z->img_comp[n].live) {
+                  stbi__jpeg_idct_block_rows(z, n, j*v, (j+1)*v);
+                  z->img_comp[n].final_rows = (j+1)*v;
+               }
+            }
          }
          return 1;
       }
    }
 }
 
-static void stbi__jpeg_dequantize(short *data, stbi_uc *dequant)
+// dequantize and idct the coefficients of MCU rows j0..j1-1 of a progressive
+// jpeg, skipping the block rows that went through the IDCT for good during
+// the scan that completed them
+static void stbi__jpeg_idct_coeffs(stbi__jpeg *z, int j0, int j1)
 {
-   int i;
-   for (i=0; i < 64; ++i)
-      data[i] *= dequant[i];
+   int n;
+   for (n=0; n < z->s->img_n; ++n) {
+      int j = j0 * z->img_comp[n].v;
+      if (j < z->img_comp[n].final_rows) j = z->img_comp[n].final_rows;
+      stbi__jpeg_idct_block_rows(z, n, j, j1 * z->img_comp[n].v);
+   }
 }
 
-static void stbi__jpeg_finish(stbi__jpeg *z)
+// a low-memory progressive decode only allocates a component's plane once
+// the scan that completes its coefficients starts, and frees them once they
+// have all been through the IDCT. previews need everything throughout
+static int stbi__jpeg_low_memory(stbi__jpeg *z)
 {
-   if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
-      for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
-         }
-      }
-   }
+   return z->progressive && !z->ring && z->s->opt->jpeg_low_memory && !(z->s->dest && z->s->dest->progress);
 }
 
-static int stbi__process_marker(stbi__jpeg *z, int m)
+// a big progressive image with threads to spare goes through the IDCT all
+// at once at the end, spread over the threads, rather than a row at a time
+// on the decoding thread as its last scans complete the rows
+static int stbi__jpeg_parallel_idct(stbi__jpeg *z)
 {
-   int L;
+#ifdef STBI_THREADS
+   return z->s->opt->max_threads > 1 && !z->ring && !stbi__jpeg_low_memory(z) &&
+          (stbi__uint64) z->s->img_x * z->s->img_y >= STBI__JPEG_PARALLEL_MIN;
+#else
+   STBI_NOTUSED(z);
+   return 0;
+#endif
+}
+
+#ifdef STBI_THREADS
+typedef struct
+{
+   stbi__jpeg *z;
+   int band;        // block rows per task
+   int first[5];    // each component's first task, then the total
+} stbi__jpeg_idct_job;
+
+static void stbi__jpeg_idct_task(void *arg, int t)
+{
+   stbi__jpeg_idct_job *job = (stbi__jpeg_idct_job *) arg;
+   int n = 0, j;
+   while (t >= job->first[n+1]) ++n;
+   j = job->z->img_comp[n].final_rows + (t - job->first[n]) * job->band;
+   stbi__jpeg_idct_block_rows(job->z, n, j, j + job->band);
+}
+#endif
+
+// stbi__jpeg_idct_coeffs for the whole image, in bands of block rows over
+// several threads if it's worth it; every block is independent
+static void stbi__jpeg_idct_all(stbi__jpeg *z)
+{
+#ifdef STBI_THREADS
+   if (stbi__jpeg_parallel_idct(z)) {
+      stbi__jpeg_idct_job job;
+      int n, rows = 0, threads = z->s->opt->max_threads < STBI__MAX_THREADS ? z->s->opt->max_threads : STBI__MAX_THREADS;
+      for (n=0; n < z->s->img_n; ++n)
+         rows += ((z->img_comp[n].y+7) >> 3) - z->img_comp[n].final_rows;
+      job.z = z;
+      job.band = (rows + threads*4-1) / (threads*4);
+      if (job.band < 1) job.band = 1;
+      job.first[0] = 0;
+      for (n=0; n < z->s->img_n; ++n) {
+         int h = ((z->img_comp[n].y+7) >> 3) - z->img_comp[n].final_rows;
+         job.first[n+1] = job.first[n] + (h > 0 ? (h + job.band-1) / job.band : 0);
+      }
+      stbi__parallel_for(job.first[z->s->img_n], threads, stbi__jpeg_idct_task, &job);
+      return;
+   }
+#endif
+   stbi__jpeg_idct_coeffs(z, 0, z->img_mcu_y);
+}
+
+static int stbi__jpeg_finish(stbi__jpeg *z)
+{
+   int n;
+   if (z->progressive) {
+      for (n=0; n < z->s->img_n; ++n)
+         if (!z->img_comp[n].data && !stbi__jpeg_alloc_plane(z, n)) return 0;
+      stbi__jpeg_idct_all(z);
+   }
+   return 1;
+}
+
+static int stbi__process_marker(stbi__jpeg *z, int m)
+{
+   int L;
    switch (m) {
       case STBI__MARKER_none: // no marker found
          return stbi__err("expected marker","Corrupt JPEG");
@@ -2661,6 +5343,25 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
    return 0;
 }
 
+// note which coefficients a progressive scan finishes. once a component has
+// them all, its rows can go through the IDCT as the scan passes them; a
+// scan that comes back to it (which a conforming file never does) puts
+// every row through again at the end
+static int stbi__jpeg_track_scan(stbi__jpeg *z)
+{
+   stbi__uint64 band = (~(stbi__uint64) 0 >> (63 - z->spec_end)) & (~(stbi__uint64) 0 << z->spec_start);
+   int i;
+   for (i=0; i < z->scan_n; ++i) {
+      int n = z->order[i];
+      if (!z->img_comp[n].coeff) return stbi__err("bad SOS", "Corrupt JPEG"); // freed already
+      if (z->succ_low == 0) z->img_comp[n].coeff_done |= band;
+      z->img_comp[n].final_rows = 0;
+      z->img_comp[n].live = !z->ring && !stbi__jpeg_parallel_idct(z) && z->img_comp[n].coeff_done == ~(stbi__uint64) 0;
+      if (z->img_comp[n].live && !z->img_comp[n].data && !stbi__jpeg_alloc_plane(z, n)) return 0;
+   }
+   return 1;
+}
+
 // after we see SOS
 static int stbi__process_scan_header(stbi__jpeg *z)
 {
@@ -2691,6 +5392,7 @@ static int stbi__process_scan_header(stbi__jpeg *z)
       if (z->progressive) {
          if (z->spec_start > 63 || z->spec_end > 63  || z->spec_start > z->spec_end || z->succ_high > 13 || z->succ_low > 13)
             return stbi__err("bad SOS", "Corrupt JPEG");
+         if (!stbi__jpeg_track_scan(z)) return 0;
       } else {
          if (z->spec_start != 0) return stbi__err("bad SOS","Corrupt JPEG");
          if (z->succ_high != 0 || z->succ_low != 0) return stbi__err("bad SOS","Corrupt JPEG");
@@ -2701,6 +5403,70 @@ static int stbi__process_scan_header(stbi__jpeg *z)
    return 1;
 }
 
+// log2 of the subsampling of component n that a scaled decode can take out
+// of its IDCT instead, or 0; only power-of-two ratios qualify
+static int stbi__jpeg_comp_shift(stbi__jpeg *z, int n, int *lh, int *lv)
+{
+   int hs = z->img_h_max / z->img_comp[n].h, vs = z->img_v_max / z->img_comp[n].v;
+   *lh = *lv = 0;
+   if (z->img_h_max % z->img_comp[n].h || z->img_v_max % z->img_comp[n].v || hs == 3 || vs == 3) return 0;
+   *lh = hs >> 1;
+   *lv = vs >> 1;
+   return *lh > *lv ? *lh : *lv;
+}
+
+// subsampled planes are already smaller, so need less of the downscale:
+// 4:2:0 chroma at 1/8 decodes at 1/4, which is the output resolution,
+// rather than at 1/8 and then being upsampled
+static int stbi__jpeg_comp_scale(stbi__jpeg *z, int n)
+{
+   int lh, lv, d = stbi__jpeg_comp_shift(z, n, &lh, &lv);
+   return z->scale > d ? z->scale - d : 0;
+}
+
+// allocate component n's plane
+static int stbi__jpeg_alloc_plane(stbi__jpeg *z, int n)
+{
+   int h = z->ring ? 2 * z->img_comp[n].v * (8 >> z->img_comp[n].scale) : z->img_comp[n].h2;
+   z->img_comp[n].raw_data = stbi__malloc((size_t) z->img_comp[n].w2 * h + 15);
+   if (z->img_comp[n].raw_data == NULL) return stbi__err("outofmem", "Out of memory");
+   // align blocks for idct using mmx/sse
+   z->img_comp[n].data = (stbi_uc*) (((size_t) z->img_comp[n].raw_data + 15) & ~15);
+   return 1;
+}
+
+// allocate each component's plane (and coefficients, if progressive)
+static int stbi__jpeg_alloc_planes(stbi__jpeg *z)
+{
+   int i;
+   for (i=0; i < z->s->img_n; ++i) {
+      z->img_comp[i].data = NULL;
+      if (!stbi__jpeg_low_memory(z) && !stbi__jpeg_alloc_plane(z, i)) {
+         for(--i; i >= 0; --i) {
+            stbi__free(z->img_comp[i].raw_data);
+            z->img_comp[i].raw_data = NULL;
+         }
+         return 0;
+      }
+      z->img_comp[i].linebuf = NULL;
+      if (z->progressive) {
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc(z->img_comp[i].coeff_w * z->img_comp[i].coeff_h * 64 * sizeof(short) + 15);
+         if (z->img_comp[i].raw_coeff == NULL) return stbi__err("outofmem", "Out of memory");
+         z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
+         z->img_comp[i].coeff_done = 0;
+         z->img_comp[i].live = 0;
+         z->img_comp[i].final_rows = 0;
+      } else {
+         z->img_comp[i].coeff = 0;
+         z->img_comp[i].raw_coeff = 0;
+      }
+   }
+
+   return 1;
+}
+
 static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
@@ -2738,7 +5504,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 
    if (scan != STBI__SCAN_load) return 1;
 
-   if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
+   // the planes of a ring are small, but progressive coefficients aren't
+   z->ring = s->rows && !z->scale;
+   if ((!z->ring || z->progressive) && (1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
 
    for (i=0; i < s->img_n; ++i) {
       if (z->img_comp[i].h > h_max) h_max = z->img_comp[i].h;
@@ -2761,32 +5529,15 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // the bogus oversized data from using interleaved MCUs and their
       // big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
       // discard the extra data until colorspace conversion
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-      z->img_comp[i].raw_data = stbi__malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
-
-      if (z->img_comp[i].raw_data == NULL) {
-         for(--i; i >= 0; --i) {
-            STBI_FREE(z->img_comp[i].raw_data);
-            z->img_comp[i].raw_data = NULL;
-         }
-         return stbi__err("outofmem", "Out of memory");
-      }
-      // align blocks for idct using mmx/sse
-      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      z->img_comp[i].linebuf = NULL;
-      if (z->progressive) {
-         z->img_comp[i].coeff_w = (z->img_comp[i].w2 + 7) >> 3;
-         z->img_comp[i].coeff_h = (z->img_comp[i].h2 + 7) >> 3;
-         z->img_comp[i].raw_coeff = STBI_MALLOC(z->img_comp[i].coeff_w * z->img_comp[i].coeff_h * 64 * sizeof(short) + 15);
-         z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
-      } else {
-         z->img_comp[i].coeff = 0;
-         z->img_comp[i].raw_coeff = 0;
-      }
+      z->img_comp[i].scale = stbi__jpeg_comp_scale(z, i);
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->img_comp[i].scale);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->img_comp[i].scale);
+      z->img_comp[i].bx0 = z->img_comp[i].by0 = 0;
+      z->img_comp[i].bx1 = z->img_mcu_x * z->img_comp[i].h;
+      z->img_comp[i].by1 = z->img_mcu_y * z->img_comp[i].v;
    }
 
-   return 1;
+   return stbi__jpeg_alloc_planes(z);
 }
 
 // use comparisons since in some cases we handle more than one case (e.g. SOF)
@@ -2820,21 +5571,48 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
    return 1;
 }
 
+// free the coefficients of the components whose every row went through the
+// IDCT during the last scan
+static void stbi__jpeg_free_final(stbi__jpeg *z)
+{
+   int i;
+   for (i=0; i < z->scan_n; ++i) {
+      int n = z->order[i];
+      if (z->img_comp[n].live && z->img_comp[n].final_rows >= (z->img_comp[n].y+7) >> 3) {
+         stbi__free(z->img_comp[n].raw_coeff);
+         z->img_comp[n].raw_coeff = NULL;
+         z->img_comp[n].coeff = NULL;
+      }
+   }
+}
+
 // decode image to YCbCr format
+static int  stbi__jpeg_emit_begin(stbi__jpeg *z);
+static void stbi__jpeg_emit_preview(stbi__jpeg *z);
+static int  stbi__jpeg_unring(stbi__jpeg *z);
+
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
-   int m;
+   int m, ok;
    for (m = 0; m < 4; m++) {
       j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
    }
    j->restart_interval = 0;
+   j->emit = NULL;
    if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+   if ((j->ring || (j->s->dest && j->s->dest->progress && !j->scale)) && !stbi__jpeg_emit_begin(j)) return 0;
    m = stbi__get_marker(j);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
-         if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (j->ring && !j->progressive && j->scan_n != j->s->img_n && !stbi__jpeg_unring(j)) return 0;
+         STBI__STAT_ENTER(STBI_stat_jpeg_entropy);
+         ok = stbi__parse_entropy_coded_data(j);
+         STBI__STAT_LEAVE(STBI_stat_jpeg_entropy, 0);
+         if (!ok) return 0;
+         if (stbi__jpeg_low_memory(j)) stbi__jpeg_free_final(j);
+         if (j->emit && j->progressive && j->s->dest) stbi__jpeg_emit_preview(j);
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
             while (!stbi__at_eof(j->s)) {
@@ -2853,8 +5631,10 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
       }
       m = stbi__get_marker(j);
    }
-   if (j->progressive)
-      stbi__jpeg_finish(j);
+   // a ring is too small for the whole image; load_jpeg_image does it
+   // an MCU row at a time
+   if (j->progressive && !j->ring)
+      return stbi__jpeg_finish(j);
    return 1;
 }
 
@@ -3055,6 +5835,83 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI_AVX2
+STBI__AVX2_TARGET
+static stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // need to generate 2x2 samples for every one in input
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   // process groups of 16 pixels for as long as we can.
+   // note we can't handle the last pixel in a row in this loop
+   // because we need to handle the filter boundary conditions.
+   for (; i < ((w-1) & ~15); i += 16) {
+      // load and perform the vertical filtering pass
+      // this uses 3*x + y = 4*x + (y - x)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff); // current row
+
+      // horizontal filter works the same as the sse2 path, but the
+      // shifted prev/next rows have to carry a pixel across the lanes
+      __m256i prv0 = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+      __m256i nxt0 = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+      __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+      __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+      // horizontal filter, polyphase implementation since it's convenient:
+      // even pixels = 3*cur + prev = cur*4 + (prev - cur)
+      // odd  pixels = 3*cur + next = cur*4 + (next - cur)
+      // note the shared term.
+      __m256i bias  = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // interleave even and odd pixels, then undo scaling; working
+      // within the lanes leaves the 32 output pixels in order
+      __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+      __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+      __m256i de0  = _mm256_srli_epi16(int0, 4);
+      __m256i de1  = _mm256_srli_epi16(int1, 4);
+
+      // pack and write output
+      __m256i outv = _mm256_packus_epi16(de0, de1);
+      _mm256_storeu_si256((__m256i *) (out + i*2), outv);
+
+      // "previous" value for next iter
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
    // resample with nearest-neighbor
@@ -3124,6 +5981,49 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
 }
 #endif
 
+#ifdef STBI_SSE2
+// color transform 8 pixels into 32 bytes of RGBA. the y values come in as
+// (y << 8) + 128, and cr, cb as (c - 128) << 8
+stbi_inline static void stbi__YCbCr_to_RGB_sse2(stbi_uc *out, __m128i yw, __m128i crw, __m128i cbw)
+{
+   __m128i cr_const0 = _mm_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+   __m128i cr_const1 = _mm_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+   __m128i cb_const0 = _mm_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+   __m128i cb_const1 = _mm_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+   __m128i xw = _mm_set1_epi16(255); // alpha channel
+
+   // color transform
+   __m128i yws = _mm_srli_epi16(yw, 4);
+   __m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
+   __m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
+   __m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
+   __m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
+   __m128i rws = _mm_add_epi16(cr0, yws);
+   __m128i gwt = _mm_add_epi16(cb0, yws);
+   __m128i bws = _mm_add_epi16(yws, cb1);
+   __m128i gws = _mm_add_epi16(gwt, cr1);
+
+   // descale
+   __m128i rw = _mm_srai_epi16(rws, 4);
+   __m128i bw = _mm_srai_epi16(bws, 4);
+   __m128i gw = _mm_srai_epi16(gws, 4);
+
+   // back to byte, set up for transpose
+   __m128i brb = _mm_packus_epi16(rw, bw);
+   __m128i gxb = _mm_packus_epi16(gw, xw);
+
+   // transpose to interleave channels
+   __m128i t0 = _mm_unpacklo_epi8(brb, gxb);
+   __m128i t1 = _mm_unpackhi_epi8(brb, gxb);
+   __m128i o0 = _mm_unpacklo_epi16(t0, t1);
+   __m128i o1 = _mm_unpackhi_epi16(t0, t1);
+
+   // store
+   _mm_storeu_si128((__m128i *) (out + 0), o0);
+   _mm_storeu_si128((__m128i *) (out + 16), o1);
+}
+#endif
+
 #if defined(STBI_SSE2) || defined(STBI_NEON)
 static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
 {
@@ -3136,12 +6036,7 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
    if (step == 4) {
       // this is a fairly straightforward implementation and not super-optimized.
       __m128i signflip  = _mm_set1_epi8(-0x80);
-      __m128i cr_const0 = _mm_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
-      __m128i cr_const1 = _mm_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
-      __m128i cb_const0 = _mm_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
-      __m128i cb_const1 = _mm_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
       __m128i y_bias = _mm_set1_epi8((char) (unsigned char) 128);
-      __m128i xw = _mm_set1_epi16(255); // alpha channel
 
       for (; i+7 < count; i += 8) {
          // load
@@ -3156,35 +6051,7 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
          __m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), cr_biased);
          __m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), cb_biased);
 
-         // color transform
-         __m128i yws = _mm_srli_epi16(yw, 4);
-         __m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
-         __m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
-         __m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
-         __m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
-         __m128i rws = _mm_add_epi16(cr0, yws);
-         __m128i gwt = _mm_add_epi16(cb0, yws);
-         __m128i bws = _mm_add_epi16(yws, cb1);
-         __m128i gws = _mm_add_epi16(gwt, cr1);
-
-         // descale
-         __m128i rw = _mm_srai_epi16(rws, 4);
-         __m128i bw = _mm_srai_epi16(bws, 4);
-         __m128i gw = _mm_srai_epi16(gws, 4);
-
-         // back to byte, set up for transpose
-         __m128i brb = _mm_packus_epi16(rw, bw);
-         __m128i gxb = _mm_packus_epi16(gw, xw);
-
-         // transpose to interleave channels
-         __m128i t0 = _mm_unpacklo_epi8(brb, gxb);
-         __m128i t1 = _mm_unpackhi_epi8(brb, gxb);
-         __m128i o0 = _mm_unpacklo_epi16(t0, t1);
-         __m128i o1 = _mm_unpackhi_epi16(t0, t1);
-
-         // store
-         _mm_storeu_si128((__m128i *) (out + 0), o0);
-         _mm_storeu_si128((__m128i *) (out + 16), o1);
+         stbi__YCbCr_to_RGB_sse2(out, yw, crw, cbw);
          out += 32;
       }
    }
@@ -3259,30 +6126,335 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#if defined(STBI_SSE2) && !defined(STBI_JPEG_OLD)
+// chroma columns x..x+count-1 of a row upsampled hs x vs (4:2:0, 4:2:2 or
+// 4:4:0) from the w samples of in_near and in_far, which are the same row
+// when vs == 1. exactly what the stbi__resample_row_* functions make
+static void stbi__upsample_chroma(stbi_uc *out, stbi_uc const *in_near, stbi_uc const *in_far, int w, int x, int count, int hs, int vs)
+{
+   int k;
+   for (k=0; k < count; ++k, ++x) {
+      if (hs == 1) {
+         out[k] = stbi__div4(3*in_near[x] + in_far[x] + 2);
+      } else {
+         // 3/4 of the sample under it and 1/4 of the next one out
+         int i = x >> 1, j = x & 1 ? (i+1 < w ? i+1 : i) : (i ? i-1 : 0);
+         // stbi__resample_row_h_2 weights the second-last one the other way
+         if (vs == 1 && x == 2*w-2 && w > 1) j = i--;
+         out[k] = stbi__div16(3*(3*in_near[i] + in_far[i]) + 3*in_near[j] + in_far[j] + 8);
+      }
+   }
+}
+
+// upsample and color convert count pixels from column x of the upsampled
+// row; c holds the near and far rows of Cb, then of Cr
+static void stbi__YCbCr_upsample_row(stbi_uc *out, stbi_uc const *y, stbi_uc const **c, int w, int x, int count, int step, int hs, int vs)
+{
+   stbi_uc cb[64], cr[64];
+   int i, n;
+   for (i=0; i < count; i += n) {
+      n = count-i < 64 ? count-i : 64;
+      stbi__upsample_chroma(cb, c[0], c[1], w, x+i, n, hs, vs);
+      stbi__upsample_chroma(cr, c[2], c[3], w, x+i, n, hs, vs);
+      stbi__YCbCr_to_RGB_simd(out + i*step, y+i, cb, cr, n, step);
+   }
+}
+
+// stbi__YCbCr_upsample_row, 16 pixels at a time: the upsampled chroma stays
+// in registers on its way to the color transform
+static void stbi__YCbCr_upsample_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const **c, int w, int x, int count, int step, int hs, int vs)
+{
+   STBI_SIMD_ALIGN(stbi_uc, rgba[64]);
+   stbi_uc const *cb_near = c[0], *cb_far = c[1], *cr_near = c[2], *cr_far = c[3];
+   __m128i zero   = _mm_setzero_si128();
+   __m128i two    = _mm_set1_epi16(2);
+   __m128i eight  = _mm_set1_epi16(8);
+   __m128i y_bias = _mm_set1_epi8((char) (unsigned char) 128);
+   __m128i c_bias = _mm_set1_epi16(128);
+   // for 4:2:x the loop starts on an even column with a sample to its left
+   int i = hs == 1 ? 0 : x < 2 ? 2-x : x & 1, k;
+   if (i > count) i = count;
+   stbi__YCbCr_upsample_row(out, y, c, w, x, i, step, hs, vs);
+
+   // the 16 values stbi__resample_row_v_2 makes from in_near[0..15] and in_far[0..15]
+   #define stbi__upsample_v_2(lo, hi, in_near, in_far) \
+      { \
+         __m128i nearb = _mm_loadu_si128((__m128i *) (in_near)); \
+         __m128i farb  = _mm_loadu_si128((__m128i *) (in_far)); \
+         __m128i n0 = _mm_unpacklo_epi8(nearb, zero), n1 = _mm_unpackhi_epi8(nearb, zero); \
+         lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(n0, 1), n0), _mm_add_epi16(_mm_unpacklo_epi8(farb, zero), two)), 2); \
+         hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(n1, 1), n1), _mm_add_epi16(_mm_unpackhi_epi8(farb, zero), two)), 2); \
+      }
+
+   // the 16 values stbi__resample_row_hv_2_simd makes from in_near[0..7] and
+   // in_far[0..7], with the samples either side
+   #define stbi__upsample_hv_2(lo, hi, in_near, in_far) \
+      { \
+         /* 3*near + far = 4*near + (far - near), for the 16 samples from in_near[-1] */ \
+         __m128i nearb = _mm_loadu_si128((__m128i *) ((in_near)-1)); \
+         __m128i farb  = _mm_loadu_si128((__m128i *) ((in_far)-1)); \
+         __m128i n0 = _mm_unpacklo_epi8(nearb, zero), n1 = _mm_unpackhi_epi8(nearb, zero); \
+         __m128i t0 = _mm_add_epi16(_mm_slli_epi16(n0, 2), _mm_sub_epi16(_mm_unpacklo_epi8(farb, zero), n0)); \
+         __m128i t1 = _mm_add_epi16(_mm_slli_epi16(n1, 2), _mm_sub_epi16(_mm_unpackhi_epi8(farb, zero), n1)); \
+         /* t0 holds the samples to the left; shift one and two along for the others */ \
+         __m128i curr = _mm_or_si128(_mm_srli_si128(t0, 2), _mm_slli_si128(t1, 14)); \
+         __m128i next = _mm_or_si128(_mm_srli_si128(t0, 4), _mm_slli_si128(t1, 12)); \
+         __m128i curb = _mm_add_epi16(_mm_slli_epi16(curr, 2), eight); \
+         __m128i even = _mm_add_epi16(_mm_sub_epi16(t0, curr), curb); \
+         __m128i odd  = _mm_add_epi16(_mm_sub_epi16(next, curr), curb); \
+         lo = _mm_srli_epi16(_mm_unpacklo_epi16(even, odd), 4); \
+         hi = _mm_srli_epi16(_mm_unpackhi_epi16(even, odd), 4); \
+      }
+
+   for (; i+15 < count; i += 16) {
+      __m128i cb0, cb1, cr0, cr1, yb;
+      stbi_uc *dest = step == 4 ? out + i*4 : rgba;
+      if (hs == 1) {
+         if (x+i+16 > w) break;
+         stbi__upsample_v_2(cb0, cb1, cb_near+x+i, cb_far+x+i);
+         stbi__upsample_v_2(cr0, cr1, cr_near+x+i, cr_far+x+i);
+      } else {
+         int m = (x+i) >> 1;
+         if (m+15 > w) break; // the loads run 7 samples past the 8 used
+         stbi__upsample_hv_2(cb0, cb1, cb_near+m, cb_far+m);
+         stbi__upsample_hv_2(cr0, cr1, cr_near+m, cr_far+m);
+      }
+      yb = _mm_loadu_si128((__m128i *) (y+i));
+      stbi__YCbCr_to_RGB_sse2(dest,    _mm_unpacklo_epi8(y_bias, yb), _mm_slli_epi16(_mm_sub_epi16(cr0, c_bias), 8), _mm_slli_epi16(_mm_sub_epi16(cb0, c_bias), 8));
+      stbi__YCbCr_to_RGB_sse2(dest+32, _mm_unpackhi_epi8(y_bias, yb), _mm_slli_epi16(_mm_sub_epi16(cr1, c_bias), 8), _mm_slli_epi16(_mm_sub_epi16(cb1, c_bias), 8));
+      if (step == 3) {
+         // drop the alpha bytes, 4 at a time while the next pixel overwrites the extra one
+         for (k=0; k < 15; ++k)
+            memcpy(out + (i+k)*3, rgba + k*4, 4);
+         out[(i+15)*3+0] = rgba[60];
+         out[(i+15)*3+1] = rgba[61];
+         out[(i+15)*3+2] = rgba[62];
+      }
+   }
+
+   #undef stbi__upsample_v_2
+   #undef stbi__upsample_hv_2
+
+   stbi__YCbCr_upsample_row(out + i*step, y+i, c, w, x+i, count-i, step, hs, vs);
+}
+#endif
+
+#if defined(STBI_AVX2) && !defined(STBI_JPEG_OLD)
+// stbi__YCbCr_to_RGB_sse2 for 16 pixels into 64 bytes of RGBA, with pixels
+// 0..7 in the low lane of each input and 8..15 in the high lane
+STBI__AVX2_TARGET
+stbi_inline static void stbi__YCbCr_to_RGB16_avx2(stbi_uc *out, __m256i yw, __m256i crw, __m256i cbw)
+{
+   __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+   __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+   __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+   __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+   __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+   // color transform
+   __m256i yws = _mm256_srli_epi16(yw, 4);
+   __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+   __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+   __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+   __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+   __m256i rws = _mm256_add_epi16(cr0, yws);
+   __m256i gwt = _mm256_add_epi16(cb0, yws);
+   __m256i bws = _mm256_add_epi16(yws, cb1);
+   __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+   // descale
+   __m256i rw = _mm256_srai_epi16(rws, 4);
+   __m256i bw = _mm256_srai_epi16(bws, 4);
+   __m256i gw = _mm256_srai_epi16(gws, 4);
+
+   // back to byte, set up for transpose
+   __m256i brb = _mm256_packus_epi16(rw, bw);
+   __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+   // transpose to interleave channels
+   __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+   __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+   __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+   __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+   // store, putting each lane's two halves back together
+   _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+   _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+}
+
+STBI__AVX2_TARGET
+static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   // same math as the sse2 path, 16 pixels at a time: pixels 0..7 go
+   // through the low lane and 8..15 through the high lane
+   if (step == 4) {
+      // this is a fairly straightforward implementation and not super-optimized.
+      __m256i signflip  = _mm256_set1_epi8(-0x80);
+      __m256i y_bias = _mm256_set1_epi8((char) (unsigned char) 128);
+
+      for (; i+15 < count; i += 16) {
+         // load, putting 8 bytes at the bottom of each lane
+         __m256i y_bytes  = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (y+i))), 0x50);
+         __m256i cr_bytes = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (pcr+i))), 0x50);
+         __m256i cb_bytes = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (pcb+i))), 0x50);
+         __m256i cr_biased = _mm256_xor_si256(cr_bytes, signflip); // -128
+         __m256i cb_biased = _mm256_xor_si256(cb_bytes, signflip); // -128
+
+         // unpack to short (and left-shift cr, cb by 8)
+         __m256i yw  = _mm256_unpacklo_epi8(y_bias, y_bytes);
+         __m256i crw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cr_biased);
+         __m256i cbw = _mm256_unpacklo_epi8(_mm256_setzero_si256(), cb_biased);
+
+         stbi__YCbCr_to_RGB16_avx2(out, yw, crw, cbw);
+         out += 64;
+      }
+   }
+
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+// stbi__YCbCr_upsample_simd, 32 pixels at a time
+STBI__AVX2_TARGET
+static void stbi__YCbCr_upsample_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const **c, int w, int x, int count, int step, int hs, int vs)
+{
+   STBI_SIMD_ALIGN(stbi_uc, rgba[128]);
+   stbi_uc const *cb_near = c[0], *cb_far = c[1], *cr_near = c[2], *cr_far = c[3];
+   __m256i two    = _mm256_set1_epi16(2);
+   __m256i eight  = _mm256_set1_epi16(8);
+   __m256i y_bias = _mm256_set1_epi8((char) (unsigned char) 128);
+   __m256i c_bias = _mm256_set1_epi16(128);
+   // for 4:2:x the loop starts on an even column with a sample to its left
+   int i = hs == 1 ? 0 : x < 2 ? 2-x : x & 1, k;
+   if (i > count) i = count;
+   stbi__YCbCr_upsample_row(out, y, c, w, x, i, step, hs, vs);
+
+   // 3*near + far for the 16 samples from in_near, as words
+   #define stbi__upsample_v(in_near, in_far) \
+      _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near))), _mm256_set1_epi16(3)), \
+                       _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far))))
+
+   // the 32 values stbi__resample_row_v_2 makes from in_near[0..31] and
+   // in_far[0..31], 16 to a register
+   #define stbi__upsample_v_2(lo, hi, in_near, in_far) \
+      { \
+         lo = _mm256_srli_epi16(_mm256_add_epi16(stbi__upsample_v(in_near, in_far), two), 2); \
+         hi = _mm256_srli_epi16(_mm256_add_epi16(stbi__upsample_v((in_near)+16, (in_far)+16), two), 2); \
+      }
+
+   // the 32 values stbi__resample_row_hv_2_avx2 makes from in_near[0..15]
+   // and in_far[0..15], with the samples either side
+   #define stbi__upsample_hv_2(lo, hi, in_near, in_far) \
+      { \
+         __m256i prev = stbi__upsample_v((in_near)-1, (in_far)-1); \
+         __m256i curr = stbi__upsample_v(in_near, in_far); \
+         __m256i next = stbi__upsample_v((in_near)+1, (in_far)+1); \
+         __m256i curb = _mm256_add_epi16(_mm256_slli_epi16(curr, 2), eight); \
+         __m256i even = _mm256_add_epi16(_mm256_sub_epi16(prev, curr), curb); \
+         __m256i odd  = _mm256_add_epi16(_mm256_sub_epi16(next, curr), curb); \
+         /* interleaving within the lanes leaves pixels 0..7 and 16..23 in */ \
+         /* the first, and 8..15 and 24..31 in the second */ \
+         __m256i int0 = _mm256_srli_epi16(_mm256_unpacklo_epi16(even, odd), 4); \
+         __m256i int1 = _mm256_srli_epi16(_mm256_unpackhi_epi16(even, odd), 4); \
+         lo = _mm256_permute2x128_si256(int0, int1, 0x20); \
+         hi = _mm256_permute2x128_si256(int0, int1, 0x31); \
+      }
+
+   for (; i+31 < count; i += 32) {
+      __m256i cb0, cb1, cr0, cr1, y0, y1;
+      stbi_uc *dest = step == 4 ? out + i*4 : rgba;
+      if (hs == 1) {
+         if (x+i+32 > w) break;
+         stbi__upsample_v_2(cb0, cb1, cb_near+x+i, cb_far+x+i);
+         stbi__upsample_v_2(cr0, cr1, cr_near+x+i, cr_far+x+i);
+      } else {
+         int m = (x+i) >> 1;
+         if (m+17 > w) break; // needs a sample to the right too
+         stbi__upsample_hv_2(cb0, cb1, cb_near+m, cb_far+m);
+         stbi__upsample_hv_2(cr0, cr1, cr_near+m, cr_far+m);
+      }
+      y0 = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (y+i))), 0x50);
+      y1 = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (y+i+16))), 0x50);
+      stbi__YCbCr_to_RGB16_avx2(dest,    _mm256_unpacklo_epi8(y_bias, y0), _mm256_slli_epi16(_mm256_sub_epi16(cr0, c_bias), 8), _mm256_slli_epi16(_mm256_sub_epi16(cb0, c_bias), 8));
+      stbi__YCbCr_to_RGB16_avx2(dest+64, _mm256_unpacklo_epi8(y_bias, y1), _mm256_slli_epi16(_mm256_sub_epi16(cr1, c_bias), 8), _mm256_slli_epi16(_mm256_sub_epi16(cb1, c_bias), 8));
+      if (step == 3) {
+         // drop the alpha bytes, 4 at a time while the next pixel overwrites the extra one
+         for (k=0; k < 31; ++k)
+            memcpy(out + (i+k)*3, rgba + k*4, 4);
+         out[(i+31)*3+0] = rgba[124];
+         out[(i+31)*3+1] = rgba[125];
+         out[(i+31)*3+2] = rgba[126];
+      }
+   }
+
+   #undef stbi__upsample_v
+   #undef stbi__upsample_v_2
+   #undef stbi__upsample_hv_2
+
+   stbi__YCbCr_upsample_simd(out + i*step, y+i, c, w, x+i, count-i, step, hs, vs);
+}
+#endif
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+static void stbi__idct_simd_pair(stbi_uc *out, int out_stride, short data[128])
+{
+   stbi__idct_simd(out, out_stride, data);
+   stbi__idct_simd(out+8, out_stride, data+64);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
-   j->idct_block_kernel = stbi__idct_block;
+   j->idct_block_kernel[0] = stbi__idct_block;
+   j->idct_pair_kernel[0] = stbi__idct_block_pair;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
+   j->YCbCr_upsample_kernel = NULL;
 
 #ifdef STBI_SSE2
    if (stbi__sse2_available()) {
-      j->idct_block_kernel = stbi__idct_simd;
+      j->idct_block_kernel[0] = stbi__idct_simd;
+      j->idct_pair_kernel[0] = stbi__idct_simd_pair;
       #ifndef STBI_JPEG_OLD
       j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+      j->YCbCr_upsample_kernel = stbi__YCbCr_upsample_simd;
       #endif
       j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_pair_kernel[0] = stbi__idct_avx2_pair;
+      #ifndef STBI_JPEG_OLD
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->YCbCr_upsample_kernel = stbi__YCbCr_upsample_avx2;
+      #endif
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
-   j->idct_block_kernel = stbi__idct_simd;
+   j->idct_block_kernel[0] = stbi__idct_simd;
+   j->idct_pair_kernel[0] = stbi__idct_simd_pair;
    #ifndef STBI_JPEG_OLD
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
    #endif
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+   j->idct_block_kernel[1] = stbi__idct_4x4; j->idct_pair_kernel[1] = stbi__idct_4x4_pair;
+   j->idct_block_kernel[2] = stbi__idct_2x2; j->idct_pair_kernel[2] = stbi__idct_2x2_pair;
+   j->idct_block_kernel[3] = stbi__idct_1x1; j->idct_pair_kernel[3] = stbi__idct_1x1_pair;
+   j->scale = j->s->opt->jpeg_scale;
+}
+
+// size of one dimension of a jpeg decoded at 1/(1<<scale)
+static int stbi__jpeg_scaled_size(int x, int scale)
+{
+   return (x + (1 << scale) - 1) >> scale;
 }
 
 // clean up the temporary component buffers
@@ -3291,20 +6463,22 @@ static void stbi__cleanup_jpeg(stbi__jpeg *j)
    int i;
    for (i=0; i < j->s->img_n; ++i) {
       if (j->img_comp[i].raw_data) {
-         STBI_FREE(j->img_comp[i].raw_data);
+         stbi__free(j->img_comp[i].raw_data);
          j->img_comp[i].raw_data = NULL;
          j->img_comp[i].data = NULL;
       }
       if (j->img_comp[i].raw_coeff) {
-         STBI_FREE(j->img_comp[i].raw_coeff);
+         stbi__free(j->img_comp[i].raw_coeff);
          j->img_comp[i].raw_coeff = 0;
          j->img_comp[i].coeff = 0;
       }
       if (j->img_comp[i].linebuf) {
-         STBI_FREE(j->img_comp[i].linebuf);
+         stbi__free(j->img_comp[i].linebuf);
          j->img_comp[i].linebuf = NULL;
       }
    }
+   stbi__free(j->emit); // its buffers are in the same block
+   j->emit = NULL;
 }
 
 typedef struct
@@ -3313,113 +6487,496 @@ typedef struct
    stbi_uc *line0,*line1;
    int hs,vs;   // expansion factor in each axis
    int w_lores; // horizontal pixels pre-expansion
+   int x0;      // the first of them
+   int out_off; // where z->out_x0 lands in the expanded row
    int ystep;   // how far through vertical expansion we are
    int ypos;    // which pre-expansion row we're on
+   stbi_uc *ring_end; // if the plane is a ring, line1 wraps to its start here
 } stbi__resample;
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
-{
-   int n, decode_n;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
-
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
-
-   // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n;
-
-   if (z->s->img_n == 3 && n < 3)
-      decode_n = 1;
-   else
-      decode_n = z->s->img_n;
-
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4];
-
-      stbi__resample res_comp[4];
+// the pre-expansion columns needed to make output columns x..x+w-1; one
+// more either side, since the upsamplers blend in the neighbours
+static void stbi__jpeg_lores_span(int x, int w, int s, int full, int *x0, int *x1)
+{
+   *x0 = x / s - 1;
+   *x1 = (x + w + s-1) / s + 1;
+   if (*x0 < 0) *x0 = 0;
+   if (*x1 > full) *x1 = full;
+}
+
+// set up r to resample component k from its first row, making the columns
+// z->out_x0..z->out_x0+z->out_w-1
+static void stbi__jpeg_resample_init(stbi__jpeg *z, stbi__resample *r, int k)
+{
+   int x1;
+   r->hs      = z->img_h_max / z->img_comp[k].h;
+   r->vs      = z->img_v_max / z->img_comp[k].v;
+   r->ystep   = r->vs >> 1;
+   stbi__jpeg_lores_span(z->out_x0, z->out_w, r->hs, (z->s->img_x + r->hs-1) / r->hs, &r->x0, &x1);
+   r->w_lores = x1 - r->x0;
+   r->out_off = z->out_x0 - r->x0 * r->hs;
+   r->ypos    = 0;
+   r->line0   = r->line1 = z->img_comp[k].data;
+   r->ring_end = z->ring ? z->img_comp[k].data + z->img_comp[k].w2 * 2 * z->img_comp[k].v * 8 : NULL;
+
+   if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+   else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+   else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+   else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+   else                               r->resample = stbi__resample_row_generic;
+}
+
+// move r, resampling component k, on to the next output row
+static void stbi__resample_advance(stbi__jpeg *z, stbi__resample *r, int k)
+{
+   if (++r->ystep >= r->vs) {
+      r->ystep = 0;
+      r->line0 = r->line1;
+      if (++r->ypos < z->img_comp[k].y) {
+         r->line1 += z->img_comp[k].w2;
+         if (r->line1 == r->ring_end) r->line1 = z->img_comp[k].data;
+      }
+   }
+}
 
+// resample and color convert the next rows of a decoded jpeg into output,
+// stride bytes apart, with a line buffer per component. each row is the
+// z->out_w pixels from z->out_x0. note n == 3 writes one byte past each row
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, stbi__resample *res_comp, stbi_uc **linebuf, stbi_uc *output, int stride, int rows, int n, int decode_n)
+{
+   int j,k;
+   unsigned int i, w = z->out_w;
+   stbi_uc *coutput[4];
+   stbi_uc const *chroma[4];
+   int bgr = z->s->dest && z->s->dest->bgr;
+   stbi__resample *c = &res_comp[1];
+   // YCbCr with both chroma planes subsampled alike (4:2:0, 4:2:2, 4:4:0)
+   // can be upsampled and converted in one pass, without the line buffers
+   int fused = z->YCbCr_upsample_kernel && n >= 3 && z->s->img_n == 3 && z->rgb != 3 &&
+               res_comp[0].hs == 1 && res_comp[0].vs == 1 && c->hs == c[1].hs && c->vs == c[1].vs &&
+               c->hs <= 2 && c->vs <= 2 && c->hs * c->vs > 1;
+   for (j=0; j < rows; ++j) {
+      stbi_uc *out = output + (ptrdiff_t) stride * j;
+      STBI__STAT_ENTER(STBI_stat_jpeg_resample);
       for (k=0; k < decode_n; ++k) {
          stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
+         int y_bot = r->ystep >= (r->vs >> 1);
+         if (fused && k) {
+            chroma[k*2-2] = (y_bot ? r->line1 : r->line0) + r->x0;
+            chroma[k*2-1] = r->vs == 1 ? chroma[k*2-2] : (y_bot ? r->line0 : r->line1) + r->x0;
+         } else
+            coutput[k] = r->resample(linebuf[k],
+                                     (y_bot ? r->line1 : r->line0) + r->x0,
+                                     (y_bot ? r->line0 : r->line1) + r->x0,
+                                     r->w_lores, r->hs) + r->out_off;
+         stbi__resample_advance(z, r, k);
       }
-
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc(n * z->s->img_x * z->s->img_y + 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (z->rgb == 3) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
+      STBI__STAT_LEAVE(STBI_stat_jpeg_resample, fused ? w : decode_n * w);
+      STBI__STAT_ENTER(STBI_stat_jpeg_convert);
+      if (fused) {
+         z->YCbCr_upsample_kernel(out, coutput[0], chroma, c->w_lores, c->out_off, w, n, c->hs, c->vs);
+      } else if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (z->rgb == 3) {
+               for (i=0; i < w; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
                   out += n;
                }
-         } else {
-            stbi_uc *y = coutput[0];
-            if (n == 1)
-               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-            else
-               for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, n);
+            }
+         } else
+            for (i=0; i < w; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         stbi_uc *y = coutput[0];
+         if (n == 1)
+            for (i=0; i < w; ++i) out[i] = y[i];
+         else
+            for (i=0; i < w; ++i) *out++ = y[i], *out++ = 255;
+      }
+      if (bgr) stbi__swap_rb(output + (ptrdiff_t) stride * j, n, w);
+      STBI__STAT_LEAVE(STBI_stat_jpeg_convert, n * w);
+   }
+}
+
+// as stbi__jpeg_convert_rows, but each row goes through row_buf first, so
+// that n == 3 can't write past it
+static void stbi__jpeg_convert_rows_via(stbi__jpeg *z, stbi__resample *res_comp, stbi_uc **linebuf, stbi_uc *output, int stride, int rows, int n, int decode_n, stbi_uc *row_buf)
+{
+   int j;
+   for (j=0; j < rows; ++j) {
+      stbi__jpeg_convert_rows(z, res_comp, linebuf, row_buf, 0, 1, n, decode_n);
+      memcpy(output + (ptrdiff_t) stride * j, row_buf, n * z->out_w);
+   }
+}
+
+// rows converted into s->dest, or handed to s->rows, while the image is
+// still being decoded
+typedef struct stbi__jpeg_emit
+{
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4], *row_buf;
+   stbi_uc *out;     // row 0 in dest; NULL for s->rows
+   int stride, n, decode_n;
+   int rows;         // rows converted so far
+   int margin;       // decoded rows the upsampler needs below the last one it makes
+} stbi__jpeg_emit;
+
+static void stbi__jpeg_emit_reset(stbi__jpeg *z)
+{
+   int k;
+   for (k=0; k < z->emit->decode_n; ++k)
+      stbi__jpeg_resample_init(z, &z->emit->res_comp[k], k);
+   z->emit->rows = 0;
+}
+
+// only make output columns x..x+w-1 and rows y..y+h-1, and only put the
+// blocks they need through the IDCT
+static void stbi__jpeg_set_window(stbi__jpeg *z, int x, int y, int w, int h)
+{
+   int k;
+   z->out_x0 = x;
+   z->out_w = w;
+   for (k=0; k < z->s->img_n; ++k) {
+      int hs = z->img_h_max / z->img_comp[k].h, vs = z->img_v_max / z->img_comp[k].v;
+      int bs = 8 >> z->img_comp[k].scale;
+      int x0, x1, y0, y1;
+      stbi__jpeg_lores_span(x, w, hs, z->img_comp[k].x, &x0, &x1);
+      stbi__jpeg_lores_span(y, h, vs, z->img_comp[k].y, &y0, &y1);
+      z->img_comp[k].bx0 = x0 / bs;
+      z->img_comp[k].bx1 = (x1 + bs-1) / bs;
+      z->img_comp[k].by0 = y0 / bs;
+      z->img_comp[k].by1 = (y1 + bs-1) / bs;
+   }
+}
+
+static int stbi__jpeg_emit_begin(stbi__jpeg *z)
+{
+   stbi__dest *d = z->s->dest;
+   stbi__rows *r = z->s->rows;
+   stbi__jpeg_emit *e;
+   stbi_uc *buf;
+   int k, x = z->s->img_x, n;
+   int decode_n;
+   if (r) {
+      stbi__rows_begin(r, x, z->s->img_y, z->s->img_n);
+      stbi__jpeg_set_window(z, r->x0, r->y0, r->w, r->h);
+      n = r->comp;
+   } else {
+      z->out_x0 = 0;
+      z->out_w = x;
+      n = d->comp;
+   }
+   decode_n = z->s->img_n == 3 && n < 3 ? 1 : z->s->img_n;
+   // line buffers for each component, then a row buffer for n == 3
+   e = (stbi__jpeg_emit *) stbi__malloc(sizeof(*e) + decode_n * (x+3) + n * x + 1);
+   if (e == NULL) return stbi__err("outofmem", "Out of memory");
+   e->out = NULL;
+   e->stride = 0;
+   if (!z->s->rows && (e->out = stbi__dest_start(d, x, z->s->img_y, &e->stride)) == NULL) { stbi__free(e); return 0; }
+   buf = (stbi_uc *) (e+1);
+   for (k=0; k < decode_n; ++k)
+      e->linebuf[k] = buf + k * (x+3);
+   e->row_buf = buf + decode_n * (x+3);
+   e->n = n;
+   e->decode_n = decode_n;
+   e->margin = 0;
+   for (k=0; k < decode_n; ++k) {
+      int vs = z->img_v_max / z->img_comp[k].v;
+      if (vs > 1 && vs > e->margin) e->margin = vs;
+   }
+   z->emit = e;
+   stbi__jpeg_emit_reset(z);
+   return 1;
+}
+
+// convert rows e->rows..rows-1
+static int stbi__jpeg_emit_convert(stbi__jpeg *z, int rows)
+{
+   stbi__jpeg_emit *e = z->emit;
+   stbi_uc *out;
+   if (z->s->rows) {
+      int k;
+      for (; e->rows < rows; ++e->rows) {
+         if (stbi__rows_wanted(z->s->rows, e->rows))
+            stbi__jpeg_convert_rows(z, e->res_comp, e->linebuf, e->row_buf, 0, 1, e->n, e->decode_n);
+         else
+            for (k=0; k < e->decode_n; ++k)
+               stbi__resample_advance(z, &e->res_comp[k], k);
+         if (!stbi__rows_put_span(z->s->rows, e->row_buf, e->n)) return 0;
+      }
+      return 1;
+   }
+   out = e->out + (ptrdiff_t) e->stride * e->rows;
+   if (e->n == 3)
+      stbi__jpeg_convert_rows_via(z, e->res_comp, e->linebuf, out, e->stride, rows - e->rows, e->n, e->decode_n, e->row_buf);
+   else
+      stbi__jpeg_convert_rows(z, e->res_comp, e->linebuf, out, e->stride, rows - e->rows, e->n, e->decode_n);
+   e->rows = rows;
+   return 1;
+}
+
+// the component planes hold the first 'decoded' full-size rows; convert
+// and report the ones the upsampler can finish
+static int stbi__jpeg_emit_rows(stbi__jpeg *z, int decoded)
+{
+   int rows = decoded >= (int) z->s->img_y ? (int) z->s->img_y : decoded - z->emit->margin;
+   if (rows <= z->emit->rows) return 1;
+   if (!stbi__jpeg_emit_convert(z, rows)) return 0;
+   if (z->s->dest) z->s->dest->progress(z->s->dest->user, rows, 0);
+   return 1;
+}
+
+// show a progressive jpeg as far as the scans so far have got
+static void stbi__jpeg_emit_preview(stbi__jpeg *z)
+{
+   stbi__jpeg_idct_all(z);
+   stbi__jpeg_emit_reset(z);
+   stbi__jpeg_emit_convert(z, z->s->img_y);
+   z->s->dest->progress(z->s->dest->user, z->s->img_y, 1);
+}
+
+// a baseline scan that doesn't interleave every component fills the planes
+// one component at a time, so a ring has to become whole planes after all
+static int stbi__jpeg_unring(stbi__jpeg *z)
+{
+   stbi__context *s = z->s;
+   int i;
+   if (z->emit->rows) return stbi__err("bad scan", "Corrupt JPEG");
+   if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
+   for (i=0; i < s->img_n; ++i) {
+      stbi__free(z->img_comp[i].raw_data);
+      z->img_comp[i].raw_data = NULL;
+   }
+   z->ring = 0;
+   if (!stbi__jpeg_alloc_planes(z)) return 0;
+   stbi__jpeg_emit_reset(z);
+   return 1;
+}
+
+#ifdef STBI_THREADS
+// set up r, fresh from load_jpeg_image, as if output rows 0..row-1 had
+// been resampled already
+static void stbi__resample_seek(stbi__resample *r, int row, stbi_uc *data, int w2, int lores_h)
+{
+   int t = r->ystep + row, wraps = t / r->vs;
+   r->ystep = t % r->vs;
+   r->ypos  = wraps;
+   r->line0 = data + w2 * (wraps == 0 ? 0 : wraps-1 < lores_h ? wraps-1 : lores_h-1);
+   r->line1 = data + w2 * (wraps < lores_h ? wraps : lores_h-1);
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__resample *res_comp;
+   stbi_uc *output, *linebuf;
+   int stride, n, decode_n, nband, band_h;
+   int all_via; // every row goes through the row buffer, not just the last
+} stbi__jpeg_band_job;
+
+static void stbi__jpeg_band_task(void *arg, int t)
+{
+   stbi__jpeg_band_job *job = (stbi__jpeg_band_job *) arg;
+   stbi__jpeg *z = job->z;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4], *out, *last;
+   int k, x = z->s->img_x, row = job->n * x, direct;
+   int y0 = t * job->band_h, rows = t+1 < job->nband ? job->band_h : (int) z->s->img_y - y0;
+   // per band: a line buffer for each component, plus a row of output
+   stbi_uc *buf = job->linebuf + (size_t) t * (job->decode_n * (x+3) + row+1);
+   for (k=0; k < job->decode_n; ++k) {
+      res_comp[k] = job->res_comp[k];
+      stbi__resample_seek(&res_comp[k], y0, z->img_comp[k].data, z->img_comp[k].w2, z->img_comp[k].y);
+      linebuf[k] = buf + k * (x+3);
+   }
+   // the rows above the band are decoded already, so the hv_2 upsampler can
+   // read the one it needs straight from the component planes. the band's
+   // last row goes through a buffer so n == 3 doesn't spill into the next band
+   out = job->output + (ptrdiff_t) y0 * job->stride;
+   last = buf + job->decode_n * (x+3);
+   direct = job->all_via ? 0 : rows-1;
+   stbi__jpeg_convert_rows(z, res_comp, linebuf, out, job->stride, direct, job->n, job->decode_n);
+   stbi__jpeg_convert_rows_via(z, res_comp, linebuf, out + (ptrdiff_t) direct * job->stride, job->stride, rows-direct, job->n, job->decode_n, last);
+}
+
+// stbi__jpeg_convert_rows for the whole image, in bands over several threads
+static int stbi__jpeg_convert_bands(stbi__jpeg *z, stbi__resample *res_comp, stbi_uc *output, int stride, int all_via, int n, int decode_n)
+{
+   stbi__jpeg_band_job job;
+   int threads = z->s->opt->max_threads < STBI__MAX_THREADS ? z->s->opt->max_threads : STBI__MAX_THREADS;
+   job.nband = threads * 2;
+   job.band_h = (z->s->img_y + job.nband-1) / job.nband;
+   if (job.band_h < 16) job.band_h = 16;
+   job.nband = (z->s->img_y + job.band_h-1) / job.band_h;
+   job.linebuf = (stbi_uc *) stbi__malloc((size_t) job.nband * (decode_n * (z->s->img_x+3) + n * z->s->img_x + 1));
+   if (job.linebuf == NULL) return 0;
+   job.z = z;
+   job.res_comp = res_comp;
+   job.output = output;
+   job.stride = stride;
+   job.all_via = all_via;
+   job.n = n;
+   job.decode_n = decode_n;
+   stbi__parallel_for(job.nband, threads, stbi__jpeg_band_task, &job);
+   stbi__free(job.linebuf);
+   return 1;
+}
+#endif
+
+// box-average component n's plane down by 1<<lx across and 1<<ly down, in
+// place; its x and y are already the reduced size
+static void stbi__jpeg_shrink_plane(stbi__jpeg *z, int n, int lx, int ly)
+{
+   stbi_uc *p = z->img_comp[n].data;
+   int stride = z->img_comp[n].w2, fx = 1 << lx, fy = 1 << ly;
+   int x, y, u, v;
+   for (y=0; y < z->img_comp[n].y; ++y) {
+      for (x=0; x < z->img_comp[n].x; ++x) {
+         stbi_uc const *in = p + (ptrdiff_t) stride * y * fy + x * fx;
+         int sum = 0;
+         for (v=0; v < fy; ++v)
+            for (u=0; u < fx; ++u)
+               sum += in[v*stride + u];
+         // the output pixel comes before its inputs, so nothing is overwritten early
+         p[(ptrdiff_t) stride * y + x] = (stbi_uc) ((sum + (1 << (lx+ly) >> 1)) >> (lx+ly));
+      }
+   }
+}
+
+// a scaled decode leaves smaller component planes; from here on, treat
+// it as an image of the reduced size. a subsampled plane decoded with less
+// of the downscale (stbi__jpeg_comp_scale) needs less upsampling, so gets a
+// bigger h and v; along an axis it was subsampled less than that (4:2:2
+// chroma vertically), it comes out too big and is averaged down
+static void stbi__jpeg_apply_scale(stbi__jpeg *z)
+{
+   int n;
+   if (!z->scale) return;
+   z->s->img_x = stbi__jpeg_scaled_size(z->s->img_x, z->scale);
+   z->s->img_y = stbi__jpeg_scaled_size(z->s->img_y, z->scale);
+   for (n=0; n < z->s->img_n; ++n) {
+      int d = z->scale - z->img_comp[n].scale, lh, lv, lx = 0, ly = 0;
+      if (d) {
+         stbi__jpeg_comp_shift(z, n, &lh, &lv);
+         if (lh >= d) z->img_comp[n].h <<= d; else { z->img_comp[n].h <<= lh; lx = d - lh; }
+         if (lv >= d) z->img_comp[n].v <<= d; else { z->img_comp[n].v <<= lv; ly = d - lv; }
+      }
+      z->img_comp[n].x = (z->s->img_x * z->img_comp[n].h + z->img_h_max-1) / z->img_h_max;
+      z->img_comp[n].y = (z->s->img_y * z->img_comp[n].v + z->img_v_max-1) / z->img_v_max;
+      if (lx || ly) stbi__jpeg_shrink_plane(z, n, lx, ly);
+   }
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   int n, decode_n;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+   stbi__jpeg_apply_scale(z);
+
+   if (z->emit) {
+      int ok = 1;
+      if (z->ring && z->progressive) {
+         // the coefficients are complete, but the ring only has room for
+         // them an MCU row at a time
+         for (n=0; n < z->img_mcu_y && ok; ++n) {
+            stbi__jpeg_idct_coeffs(z, n, n+1);
+            ok = stbi__jpeg_emit_rows(z, (n+1) * z->img_mcu_h);
+         }
+      } else {
+         // the rows are in dest already; a progressive image has only a
+         // preview there until its final pass
+         if (z->progressive) stbi__jpeg_emit_reset(z);
+         ok = stbi__jpeg_emit_rows(z, z->s->img_y);
+      }
+      stbi__cleanup_jpeg(z);
+      if (!ok) return NULL;
+      *out_x = z->s->img_x;
+      *out_y = z->s->img_y;
+      if (comp) *comp = z->s->img_n;
+      return z->s->rows ? stbi__rows_sent : z->s->dest->data;
+   }
+
+   // determine actual number of components to generate
+   n = req_comp ? req_comp : z->s->img_n;
+
+   if (z->s->img_n == 3 && n < 3)
+      decode_n = 1;
+   else
+      decode_n = z->s->img_n;
+
+   // resample and color-convert
+   {
+      int k, stride, via;
+      stbi_uc *output, *out;
+      stbi_uc *linebuf[4];
+
+      stbi__resample res_comp[4];
+
+      z->out_x0 = 0;
+      z->out_w = z->s->img_x;
+      for (k=0; k < decode_n; ++k) {
+         // allocate line buffer big enough for upsampling off the edges
+         // with upsample factor of 4
+         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+         stbi__jpeg_resample_init(z, &res_comp[k], k);
+      }
+
+      if (z->s->dest) {
+         // write straight into the caller's buffer; output is then just a
+         // row buffer, since n == 3 rows have to go through one there
+         out = stbi__dest_start(z->s->dest, z->s->img_x, z->s->img_y, &stride);
+         if (!out) { stbi__cleanup_jpeg(z); return NULL; }
+         via = n == 3;
+         output = (stbi_uc *) stbi__malloc(n * z->s->img_x + 1);
+      } else {
+         // can't error after this so, this is safe
+         output = out = (stbi_uc *) stbi__malloc(n * z->s->img_x * z->s->img_y + 1);
+         stride = n * z->s->img_x;
+         via = 0;
+      }
+      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+
+#ifdef STBI_THREADS
+      if (z->s->opt->max_threads > 1 && (stbi__uint64) z->s->img_x * z->s->img_y >= STBI__JPEG_PARALLEL_MIN) {
+         if (!stbi__jpeg_convert_bands(z, res_comp, out, stride, via, n, decode_n)) {
+            stbi__free(output);
+            stbi__cleanup_jpeg(z);
+            return stbi__errpuc("outofmem", "Out of memory");
          }
+      } else
+#endif
+      {
+         for (k=0; k < decode_n; ++k)
+            linebuf[k] = z->img_comp[k].linebuf;
+         if (via)
+            stbi__jpeg_convert_rows_via(z, res_comp, linebuf, out, stride, z->s->img_y, n, decode_n, output);
+         else
+            stbi__jpeg_convert_rows(z, res_comp, linebuf, out, stride, z->s->img_y, n, decode_n);
       }
       stbi__cleanup_jpeg(z);
       *out_x = z->s->img_x;
       *out_y = z->s->img_y;
       if (comp) *comp  = z->s->img_n; // report original components, not output
+      if (z->s->dest) {
+         stbi__free(output);
+         return z->s->dest->data;
+      }
       return output;
    }
 }
@@ -3431,18 +6988,70 @@ static unsigned char *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *com
    j->s = s;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   stbi__free(j);
+   return result;
+}
+
+// copy the component planes out as they are, for stbi_load_ycbcr
+static stbi_uc *stbi__jpeg_copy_planes(stbi__jpeg *z, int *x, int *y, int *comp, stbi_ycbcr *planes)
+{
+   stbi__context *s = z->s;
+   stbi_uc *out, *p;
+   size_t size = 0;
+   int k, row;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   if (!stbi__decode_jpeg_image(z)) return NULL;
+   stbi__jpeg_apply_scale(z);
+   if (s->img_n != 1 && (s->img_n != 3 || z->rgb == 3))
+      return stbi__errpuc("not YCbCr", "JPEG is RGB or CMYK, not YCbCr");
+   for (k=0; k < s->img_n; ++k)
+      size += (size_t) z->img_comp[k].x * z->img_comp[k].y;
+   out = (stbi_uc *) stbi__malloc(size);
+   if (out == NULL) return stbi__errpuc("outofmem", "Out of memory");
+
+   p = out;
+   for (k=0; k < 3; ++k) {
+      planes->plane[k] = NULL;
+      planes->w[k] = planes->h[k] = 0;
+      if (k >= s->img_n) continue;
+      planes->plane[k] = p;
+      planes->w[k] = z->img_comp[k].x;
+      planes->h[k] = z->img_comp[k].y;
+      for (row=0; row < planes->h[k]; ++row) {
+         int from = s->opt->flip_vertically ? planes->h[k]-1 - row : row;
+         memcpy(p, z->img_comp[k].data + (ptrdiff_t) z->img_comp[k].w2 * from, planes->w[k]);
+         p += planes->w[k];
+      }
+   }
+   *x = s->img_x;
+   *y = s->img_y;
+   if (comp) *comp = s->img_n;
+   return out;
+}
+
+static stbi_uc *stbi__jpeg_load_ycbcr(stbi__context *s, int *x, int *y, int *comp, stbi_ycbcr *planes)
+{
+   stbi_uc *result;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (z == NULL) return stbi__errpuc("outofmem", "Out of memory");
+   z->s = s;
+   stbi__setup_jpeg(z);
+   result = stbi__jpeg_copy_planes(z, x, y, comp, planes);
+   stbi__cleanup_jpeg(z);
+   stbi__free(z);
    return result;
 }
 
 static int stbi__jpeg_test(stbi__context *s)
 {
    int r;
-   stbi__jpeg j;
-   j.s = s;
-   stbi__setup_jpeg(&j);
-   r = stbi__decode_jpeg_header(&j, STBI__SCAN_type);
+   stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg)); // too big for the stack
+   if (j == NULL) return 0;
+   j->s = s;
+   stbi__setup_jpeg(j);
+   r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
+   stbi__free(j);
    return r;
 }
 
@@ -3452,8 +7061,8 @@ static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
       stbi__rewind( j->s );
       return 0;
    }
-   if (x) *x = j->s->img_x;
-   if (y) *y = j->s->img_y;
+   if (x) *x = stbi__jpeg_scaled_size(j->s->img_x, j->s->opt->jpeg_scale);
+   if (y) *y = stbi__jpeg_scaled_size(j->s->img_y, j->s->opt->jpeg_scale);
    if (comp) *comp = j->s->img_n;
    return 1;
 }
@@ -3464,7 +7073,7 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(sizeof(stbi__jpeg)));
    j->s = s;
    result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__free(j);
    return result;
 }
 #endif
@@ -3482,6 +7091,12 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// literal/length codes get a second, wider table whose entries can
+// hold two literals at once
+#define STBI__ZPAIR_BITS  10
+#define STBI__ZPAIR_MASK  ((1 << STBI__ZPAIR_BITS) - 1)
+#define STBI__ZPAIR_TWO   (1 << 22)
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -3559,16 +7174,36 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, stbi_uc *sizelist, int num)
 }
 
 // zlib-from-memory implementation for PNG reading
-//    because PNG allows splitting the zlib stream arbitrarily,
-//    and it's annoying structurally to have PNG call ZLIB call PNG,
-//    we require PNG read all the IDATs and combine them into a single
-//    memory buffer
+//    because PNG allows splitting the zlib stream arbitrarily, the input
+//    can either be one upfront buffer or a sequence of spans handed out
+//    by a refill callback (PNG uses this to feed IDAT chunks in place)
+
+// points *start/*end at the next non-empty span of input, 0 at end of data
+typedef int (*stbi__zrefill_func)(void *user, stbi_uc **start, stbi_uc **end);
+
+// told how many bytes of output are final, roughly every STBI__ZPROGRESS_STEP
+typedef void (*stbi__zprogress_func)(void *user, int bytes);
+#define STBI__ZPROGRESS_STEP  32768
+
+// handed the output from start that it hasn't used yet, when decoding into a
+// window; returns how many bytes it used, or -1 to fail
+typedef int (*stbi__zflush_func)(void *user, stbi_uc *start, int len);
+#define STBI__ZWINDOW  32768 // how far back a match can reach
 
 typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   stbi__uint64 code_buffer;
+
+   stbi__zrefill_func zrefill;
+   stbi__zprogress_func zprogress;
+   stbi__zflush_func zflush;  // if set, the output buffer is a sliding window
+   void *zrefill_user;        // also passed to zprogress and zflush
+   char *zflushed;            // output before this has been used by zflush
+   char *zout_limit;          // real end of output when zout_end is a progress checkpoint
+   stbi_uc *zstop;            // if set, stop at the block boundary here (parallel segments)
+   int zout_max;              // if set, how far an expandable output may grow
 
    char *zout;
    char *zout_start;
@@ -3576,28 +7211,60 @@ typedef struct
    int   z_expandable;
 
    stbi__zhuffman z_length, z_distance;
+   stbi__uint32 z_litpair[1 << STBI__ZPAIR_BITS];
 } stbi__zbuf;
 
+static int stbi__zrefill(stbi__zbuf *z)
+{
+   if (!z->zrefill) return 0;
+   if (z->zrefill(z->zrefill_user, &z->zbuffer, &z->zbuffer_end)) return 1;
+   z->zrefill = NULL;
+   return 0;
+}
+
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
 {
-   if (z->zbuffer >= z->zbuffer_end) return 0;
+   if (z->zbuffer >= z->zbuffer_end && !stbi__zrefill(z)) return 0;
    return *z->zbuffer++;
 }
 
+stbi_inline static stbi__uint64 stbi__zload64(stbi_uc const *p)
+{
+#if defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   return (stbi__uint64) p[0]       | ((stbi__uint64) p[1] <<  8) |
+         ((stbi__uint64) p[2] << 16) | ((stbi__uint64) p[3] << 24) |
+         ((stbi__uint64) p[4] << 32) | ((stbi__uint64) p[5] << 40) |
+         ((stbi__uint64) p[6] << 48) | ((stbi__uint64) p[7] << 56);
+#endif
+}
+
+// tops the bit buffer up to at least 56 bits. away from the end of the
+// current span this is a single unaligned load; the bytes above num_bits
+// are left in place since the next load will OR in the same bytes again.
+// a span is only replaced once it's fully consumed, so that stays true.
 static void stbi__fill_bits(stbi__zbuf *z)
 {
-   do {
-      STBI_ASSERT(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
-      z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      z->code_buffer |= stbi__zload64(z->zbuffer) << z->num_bits;
+      z->zbuffer += (63 - z->num_bits) >> 3;
+      z->num_bits |= 56;
+   } else {
+      do {
+         z->code_buffer |= (stbi__uint64) stbi__zget8(z) << z->num_bits;
+         z->num_bits += 8;
+      } while (z->num_bits <= 56);
+   }
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -3608,7 +7275,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -3625,7 +7292,7 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
    int b,s;
    if (a->num_bits < 16) stbi__fill_bits(a);
-   b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
+   b = z->fast[(int) (a->code_buffer & STBI__ZFAST_MASK)];
    if (b) {
       s = b >> 9;
       a->code_buffer >>= s;
@@ -3635,17 +7302,83 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
    return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+// build the literal/length lookup used by stbi__parse_huffman_block. an
+// entry holds the first symbol in bits 0-8, the total code length in bits
+// 17-21, and, when the first symbol is a literal and the following code
+// also fits in the table bits, that second literal in bits 9-16 together
+// with STBI__ZPAIR_TWO. zero means the code is too long for the table.
+static void stbi__zbuild_litpair(stbi__zbuf *a)
+{
+   stbi__zhuffman *z = &a->z_length;
+   stbi__uint16 single[1 << STBI__ZPAIR_BITS];
+   int i,j,s;
+
+   memset(single, 0, sizeof(single));
+   for (s=1; s <= STBI__ZPAIR_BITS; ++s) {
+      int n = z->firstsymbol[s+1] - z->firstsymbol[s];
+      for (i=0; i < n; ++i) {
+         int c = z->firstsymbol[s] + i;
+         j = stbi__bit_reverse(z->firstcode[s] + i, s);
+         while (j < (1 << STBI__ZPAIR_BITS)) {
+            single[j] = (stbi__uint16) ((s << 9) | z->value[c]);
+            j += (1 << s);
+         }
+      }
+   }
+
+   for (j=0; j < (1 << STBI__ZPAIR_BITS); ++j) {
+      int e = single[j];
+      stbi__uint32 v = 0;
+      if (e) {
+         int s1 = e >> 9, sym = e & 511;
+         v = (stbi__uint32) sym | (s1 << 17);
+         if (sym < 256 && s1 < STBI__ZPAIR_BITS) {
+            int e2 = single[j >> s1];
+            int s2 = e2 >> 9;
+            if (e2 && (e2 & 511) < 256 && s1 + s2 <= STBI__ZPAIR_BITS)
+               v = (stbi__uint32) sym | ((e2 & 255) << 9) | ((s1+s2) << 17) | STBI__ZPAIR_TWO;
+         }
+      }
+      a->z_litpair[j] = v;
+   }
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
    char *q;
    int cur, limit, old_limit;
    z->zout = zout;
+   if (z->zflush) {
+      // hand over the new output, then slide down, keeping what zflush
+      // didn't use and whatever matches can still reach back to
+      ptrdiff_t keep;
+      int used = z->zflush(z->zrefill_user, (stbi_uc *) z->zflushed, (int) (zout - z->zflushed));
+      if (used < 0) return 0;
+      z->zflushed += used;
+      keep = zout - z->zflushed > STBI__ZWINDOW ? zout - z->zflushed : STBI__ZWINDOW;
+      if (keep > zout - z->zout_start) keep = zout - z->zout_start;
+      memmove(z->zout_start, zout - keep, keep);
+      z->zflushed -= (zout - keep) - z->zout_start;
+      z->zout = z->zout_start + keep;
+      if (z->zout + n > z->zout_end) return stbi__err("output buffer limit","Corrupt PNG");
+      return 1;
+   }
+   if (z->zprogress) {
+      // zout_end was just a checkpoint: report, then move it along
+      z->zprogress(z->zrefill_user, (int) (zout - z->zout_start));
+      while (zout + n > z->zout_end && z->zout_end < z->zout_limit)
+         z->zout_end = z->zout_limit - z->zout_end > STBI__ZPROGRESS_STEP ? z->zout_end + STBI__ZPROGRESS_STEP : z->zout_limit;
+      if (zout + n <= z->zout_end) return 1;
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = old_limit = (int) (z->zout_end - z->zout_start);
+   if (z->zout_max && cur + n > z->zout_max) return stbi__err("output buffer limit","Corrupt PNG");
    while (cur + n > limit)
       limit *= 2;
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   if (z->zout_max && limit > z->zout_max)
+      limit = z->zout_max;
+   q = (char *) stbi__realloc_sized(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -3671,8 +7404,31 @@ static int stbi__zdist_extra[32] =
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
+   stbi__zbuild_litpair(a);
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      stbi__uint32 e;
+      if (a->num_bits < 32) stbi__fill_bits(a);
+      e = a->z_litpair[(int) (a->code_buffer & STBI__ZPAIR_MASK)];
+      if (e & STBI__ZPAIR_TWO) {
+         if (zout + 2 > a->zout_end) {
+            if (!stbi__zexpand(a, zout, 2)) return 0;
+            zout = a->zout;
+         }
+         zout[0] = (char) (e & 255);
+         zout[1] = (char) ((e >> 9) & 255);
+         zout += 2;
+         a->code_buffer >>= (e >> 17) & 31;
+         a->num_bits -= (e >> 17) & 31;
+         continue;
+      }
+      if (e) {
+         z = e & 511;
+         a->code_buffer >>= e >> 17;
+         a->num_bits -= e >> 17;
+      } else {
+         z = stbi__zhuffman_decode_slowpath(a, &a->z_length);
+      }
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -3703,6 +7459,16 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          if (dist == 1) { // run of one byte; common in images.
             stbi_uc v = *p;
             if (len) { do *zout++ = v; while (--len); }
+         } else if (dist >= 8 && zout + len + 16 <= a->zout_end) {
+            // chunks may overshoot len, which is fine while there's room:
+            // anything past the match gets overwritten by later output
+            char *end = zout + len;
+            if (dist >= 16) {
+               do { memcpy(zout, p, 16); zout += 16; p += 16; } while (zout < end);
+            } else {
+               do { memcpy(zout, p, 8); zout += 8; p += 8; } while (zout < end);
+            }
+            zout = end;
          } else {
             if (len) { do *zout++ = *p++; while (--len); }
          }
@@ -3737,6 +7503,7 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
          lencodes[n++] = (stbi_uc) c;
       else if (c == 16) {
          c = stbi__zreceive(a,2)+3;
+         if (n == 0) return stbi__err("bad codelengths", "Corrupt PNG");
          memset(lencodes+n, lencodes[n-1], c);
          n += c;
       } else if (c == 17) {
@@ -3764,24 +7531,40 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
       stbi__zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
-   STBI_ASSERT(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
       header[k++] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   // the 64-bit buffer can still hold the start of the stored data
+   while (a->num_bits > 0 && len > 0) {
+      *a->zout++ = (char) (a->code_buffer & 255);
+      a->code_buffer >>= 8;
+      a->num_bits -= 8;
+      --len;
+   }
+   if (a->num_bits == 0)
+      a->code_buffer = 0; // drop stale lookahead, zbuffer moves under it
+   while (len > 0) {
+      int n = (int) (a->zbuffer_end - a->zbuffer);
+      if (n == 0) {
+         if (!stbi__zrefill(a)) return stbi__err("read past buffer","Corrupt PNG");
+         continue;
+      }
+      if (n > len) n = len;
+      memcpy(a->zout, a->zbuffer, n);
+      a->zbuffer += n;
+      a->zout += n;
+      len -= n;
+   }
    return 1;
 }
 
@@ -3798,18 +7581,24 @@ static int stbi__parse_zlib_header(stbi__zbuf *a)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static stbi_uc stbi__zdefault_length[288], stbi__zdefault_distance[32];
-static void stbi__init_zdefaults(void)
+// fixed huffman code lengths from the spec; initialized statically so that
+// nothing needs setting up before the first decode, on any thread
+static stbi_uc stbi__zdefault_length[288] =
 {
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     stbi__zdefault_length[i]   = 8;
-   for (   ; i <= 255; ++i)     stbi__zdefault_length[i]   = 9;
-   for (   ; i <= 279; ++i)     stbi__zdefault_length[i]   = 7;
-   for (   ; i <= 287; ++i)     stbi__zdefault_length[i]   = 8;
-
-   for (i=0; i <=  31; ++i)     stbi__zdefault_distance[i] = 5;
-}
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
+};
+static stbi_uc stbi__zdefault_distance[32] =
+{
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+};
 
 static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
 {
@@ -3824,11 +7613,10 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
       if (type == 0) {
          if (!stbi__parse_uncompressed_block(a)) return 0;
       } else if (type == 3) {
-         return 0;
+         return stbi__err("bad block type","Corrupt PNG");
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!stbi__zdefault_distance[31]) stbi__init_zdefaults();
             if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , 288)) return 0;
             if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
          } else {
@@ -3836,8 +7624,13 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
          }
          if (!stbi__parse_huffman_block(a)) return 0;
       }
+      if (a->zstop) {
+         // a segment only counts if some block ends exactly on zstop
+         ptrdiff_t past = (a->zbuffer - a->zstop) * 8 - a->num_bits;
+         if (past >= 0) return past == 0;
+      }
    } while (!final);
-   return 1;
+   return a->zstop == NULL;
 }
 
 static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
@@ -3846,10 +7639,180 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->zrefill = NULL;
+   a->zprogress = NULL;
+   a->zflush = NULL;
+   a->zstop = NULL;
+   a->zout_max = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
 
+#ifndef STBI_NO_PNG
+// decode into at most olen bytes at obuf, pulling input from refill and
+// optionally reporting progress; returns the number of bytes written or -1
+static int stbi__zlib_decode_stream(char *obuf, int olen, stbi__zrefill_func refill, stbi__zprogress_func progress, void *user, int parse_header)
+{
+   stbi__zbuf a;
+   a.zbuffer = a.zbuffer_end = NULL;
+   a.zout_start = obuf;
+   a.zout       = obuf;
+   a.zout_end   = obuf + olen;
+   a.zout_limit = obuf + olen;
+   if (progress && olen > STBI__ZPROGRESS_STEP)
+      a.zout_end = obuf + STBI__ZPROGRESS_STEP;
+   a.z_expandable = 0;
+   a.zrefill = refill;
+   a.zprogress = progress;
+   a.zflush = NULL;
+   a.zrefill_user = user;
+   a.zstop = NULL;
+   a.zout_max = 0;
+   if (!stbi__parse_zlib(&a, parse_header))
+      return -1;
+   return (int) (a.zout - a.zout_start);
+}
+
+// decode through a window of olen bytes at obuf, handing the output to
+// flush as the window fills up and once more at the end; returns 1 or 0
+static int stbi__zlib_decode_window(char *obuf, int olen, stbi__zrefill_func refill, stbi__zflush_func flush, void *user, int parse_header)
+{
+   stbi__zbuf a;
+   a.zbuffer = a.zbuffer_end = NULL;
+   a.zout_start = obuf;
+   a.zout       = obuf;
+   a.zout_end   = obuf + olen;
+   a.zflushed   = obuf;
+   a.z_expandable = 0;
+   a.zrefill = refill;
+   a.zprogress = NULL;
+   a.zflush = flush;
+   a.zrefill_user = user;
+   a.zstop = NULL;
+   a.zout_max = 0;
+   if (!stbi__parse_zlib(&a, parse_header))
+      return 0;
+   return flush(user, (stbi_uc *) a.zflushed, (int) (a.zout - a.zflushed)) >= 0;
+}
+
+#ifdef STBI_THREADS
+// parallel inflate across sync points. a full flush leaves an empty stored
+// block and drops the history, so the deflate data that follows can be
+// decoded on its own. the same bytes can also come from a sync flush (which
+// keeps the history) or turn up by chance inside compressed data, so each
+// segment is decoded speculatively: it only counts if it never reaches back
+// before its own start and ends on a block boundary exactly where the next
+// segment begins. the ones that don't are redone serially, with history.
+typedef struct
+{
+   int begin, end;         // compressed byte range
+   char *out;              // decoded output, owned by the segment
+   int out_len, ok;
+} stbi__zsegment;
+
+typedef struct
+{
+   stbi_uc *data;
+   int data_len, olen, parse_header;
+   stbi__zsegment *seg;
+   int nseg;
+} stbi__zsegment_job;
+
+static void stbi__zsegment_task(void *arg, int i)
+{
+   stbi__zsegment_job *job = (stbi__zsegment_job *) arg;
+   stbi__zsegment *g = &job->seg[i];
+   stbi__zbuf a;
+   // guess the output size from this segment's share of the input
+   int guess = (int) ((double) job->olen * (g->end - g->begin) / job->data_len) + 4096;
+   if (guess > job->olen) guess = job->olen;
+   g->ok = 0;
+   g->out = (char *) stbi__malloc(guess);
+   if (g->out == NULL) return;
+   a.zbuffer = job->data + g->begin;
+   a.zbuffer_end = job->data + job->data_len;
+   a.zout_start = a.zout = g->out;
+   a.zout_end = g->out + guess;
+   a.z_expandable = 1;
+   a.zout_max = job->olen;
+   a.zrefill = NULL;
+   a.zprogress = NULL;
+   a.zflush = NULL;
+   a.zstop = i+1 < job->nseg ? job->data + g->end : NULL;
+   g->ok = stbi__parse_zlib(&a, i == 0 && job->parse_header);
+   g->out = a.zout_start;
+   g->out_len = (int) (a.zout - a.zout_start);
+}
+
+// decode serially from data+begin into obuf+pos, with everything before
+// that as history, stopping at stop if it's set; returns the new output
+// position or -1
+static int stbi__zlib_decode_from(stbi_uc *data, int begin, int len, stbi_uc *stop, char *obuf, int pos, int olen, int parse_header)
+{
+   stbi__zbuf a;
+   a.zbuffer = data + begin;
+   a.zbuffer_end = data + len;
+   a.zout_start = obuf;
+   a.zout = obuf + pos;
+   a.zout_end = obuf + olen;
+   a.z_expandable = 0;
+   a.zout_max = 0;
+   a.zrefill = NULL;
+   a.zprogress = NULL;
+   a.zflush = NULL;
+   a.zstop = stop;
+   if (!stbi__parse_zlib(&a, parse_header))
+      return -1;
+   return (int) (a.zout - obuf);
+}
+
+// bounds[] are the compressed offsets where segments start (bounds[0] == 0);
+// returns the number of bytes written to obuf, or -1
+static int stbi__zlib_decode_parallel(stbi_uc *data, int len, int *bounds, int nseg, char *obuf, int olen, int parse_header, int max_threads)
+{
+   stbi__zsegment_job job;
+   int i, pos = 0;
+   job.seg = (stbi__zsegment *) stbi__malloc(nseg * sizeof(*job.seg));
+   if (job.seg == NULL) {
+      stbi__err("outofmem", "Out of memory");
+      return -1;
+   }
+   job.data = data;
+   job.data_len = len;
+   job.olen = olen;
+   job.parse_header = parse_header;
+   job.nseg = nseg;
+   for (i=0; i < nseg; ++i) {
+      job.seg[i].begin = bounds[i];
+      job.seg[i].end = i+1 < nseg ? bounds[i+1] : len;
+   }
+   stbi__parallel_for(nseg, max_threads, stbi__zsegment_task, &job);
+
+   for (i=0; i < nseg && pos >= 0; ++i) {
+      stbi__zsegment *g = &job.seg[i];
+      int header = i == 0 && parse_header, next;
+      if (g->ok && g->out_len <= olen - pos) {
+         memcpy(obuf + pos, g->out, g->out_len);
+         pos += g->out_len;
+         continue;
+      }
+      // redo this one with the history it needed; if it doesn't end where
+      // the next one starts after all, serially decode the rest
+      next = i+1 < nseg ? stbi__zlib_decode_from(data, g->begin, len, data + g->end, obuf, pos, olen, header) : -1;
+      if (next < 0) {
+         pos = stbi__zlib_decode_from(data, g->begin, len, NULL, obuf, pos, olen, header);
+         break;
+      }
+      pos = next;
+   }
+   for (i=0; i < nseg; ++i)
+      stbi__free(job.seg[i].out);
+   stbi__free(job.seg);
+   return pos;
+}
+#endif
+#endif
+
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
 {
    stbi__zbuf a;
@@ -3861,7 +7824,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -3882,7 +7845,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -3909,7 +7872,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -3960,11 +7923,58 @@ static int stbi__check_png_header(stbi__context *s)
    return 1;
 }
 
+typedef void (*stbi__png_unfilter_func)(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp);
+typedef void (*stbi__png_expand_func)(stbi_uc *out, stbi_uc const *in, stbi__uint32 x, int img_n, int out_n, int depth);
+
+#define STBI__PNG_IDAT_BUFSIZE  32768
+
+// the inflated data starts this far into z->expanded, see stbi__create_png_image_raw
+#define STBI__PNG_INPLACE_PAD   32
+
+// smallest filtered image (in bytes) worth a pipelined decode
+#define STBI__PNG_PIPELINE_MIN  (1 << 18)
+
+// smallest filtered image worth splitting the inflate at sync points, and
+// the smallest piece of zlib stream worth giving a thread of its own
+#define STBI__PNG_PARALLEL_MIN  (1 << 22)
+#define STBI__PNG_SEGMENT_MIN   (1 << 16)
+#define STBI__PNG_MAX_SEGMENTS  256
+
+// for s->rows, how much filtered data to unfilter at a time
+#define STBI__PNG_BAND_SIZE     65536
+
+// what's needed to finish the rows of a band, for s->rows
+typedef struct
+{
+   stbi__uint32 row_bytes;    // filtered row, including the filter byte
+   stbi__uint32 band, done;   // rows per band, and rows handed out so far
+   int color, pal_img_n, pal_len, has_trans, iphone;
+   stbi_uc *palette, tc[3];
+   stbi__uint16 tc16[3];
+   stbi_uc *last;             // the last row done, unfiltered, for the next band
+} stbi__png_rows;
+
 typedef struct
 {
    stbi__context *s;
-   stbi_uc *idata, *expanded, *out;
+   stbi_uc *expanded, *out;
    int depth;
+
+// IDAT streaming state
+   stbi__uint32 idat_left;    // bytes left in the current IDAT chunk
+   int idat_done;             // set once a non-IDAT chunk header was read
+   stbi__pngchunk idat_next;  // ...which is kept here
+   stbi_uc *idat_buf;         // staging buffer for callback input
+
+#ifdef STBI_THREADS
+   stbi__progress *inflated;  // bytes of z->expanded final so far, when pipelined
+#endif
+   int stream_rows;           // each row goes to s->dest as soon as it's unfiltered
+   stbi__png_rows *rows;      // set when the rows go to s->rows a band at a time
+
+// kernels
+   stbi__png_unfilter_func unfilter_kernel[5];
+   stbi__png_expand_func expand_row_kernel;
 } stbi__png;
 
 
@@ -3973,19 +7983,18 @@ enum {
    STBI__F_sub=1,
    STBI__F_up=2,
    STBI__F_avg=3,
-   STBI__F_paeth=4,
-   // synthetic filters used for first scanline to avoid needing a dummy row of 0s
-   STBI__F_avg_first,
-   STBI__F_paeth_first
+   STBI__F_paeth=4
 };
 
+// the first scanline is unfiltered against a row of 0s, so 'up' is the same
+// as 'none' and 'paeth' is the same as 'sub'; use the cheaper filter.
 static stbi_uc first_row_filter[5] =
 {
    STBI__F_none,
    STBI__F_sub,
    STBI__F_none,
-   STBI__F_avg_first,
-   STBI__F_paeth_first
+   STBI__F_avg,
+   STBI__F_sub
 };
 
 static int stbi__paeth(int a, int b, int c)
@@ -4001,128 +8010,481 @@ static int stbi__paeth(int a, int b, int c)
 
 static stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// the unfilter kernels undo one filter type over a scanline of 'n' bytes
+// with 'bpp' bytes per (compact, i.e. not alpha-expanded) pixel. 'prior' is
+// the already-unfiltered previous scanline in the same layout.
+static void stbi__png_unfilter_none(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
+{
+   STBI_NOTUSED(prior);
+   STBI_NOTUSED(bpp);
+   memmove(cur, raw, n); // may overlap when unfiltering in place
+}
+
+static void stbi__png_unfilter_sub(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
 {
-   int bytes = (depth == 16? 2 : 1);
-   stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
    int k;
-   int img_n = s->img_n; // copy it into a local for later
+   STBI_NOTUSED(prior);
+   for (k=0; k < bpp; ++k) cur[k] = raw[k];
+   for (   ; k < n  ; ++k) cur[k] = STBI__BYTECAST(raw[k] + cur[k-bpp]);
+}
 
-   int output_bytes = out_n*bytes;
-   int filter_bytes = img_n*bytes;
-   int width = x;
+static void stbi__png_unfilter_up(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
+{
+   int k;
+   STBI_NOTUSED(bpp);
+   for (k=0; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
 
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc(x * y * output_bytes); // extra bytes to write off the end into
-   if (!a->out) return stbi__err("outofmem", "Out of memory");
+static void stbi__png_unfilter_avg(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
+{
+   int k;
+   for (k=0; k < bpp; ++k) cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
+   for (   ; k < n  ; ++k) cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-bpp])>>1));
+}
 
-   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   img_len = (img_width_bytes + 1) * y;
-   if (s->img_x == x && s->img_y == y) {
-      if (raw_len != img_len) return stbi__err("not enough pixels","Corrupt PNG");
-   } else { // interlaced:
-      if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+static void stbi__png_unfilter_paeth(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
+{
+   int k;
+   for (k=0; k < bpp; ++k) cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0));
+   for (   ; k < n  ; ++k) cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-bpp],prior[k],prior[k-bpp]));
+}
+
+// widen a compact scanline into the output: insert an opaque alpha channel
+// if out_n == img_n+1, and convert 16-bit samples from big-endian to native
+static void stbi__png_expand_row(stbi_uc *out, stbi_uc const *in, stbi__uint32 x, int img_n, int out_n, int depth)
+{
+   stbi__uint32 i;
+   int k;
+   if (depth == 16) {
+      stbi__uint16 *out16 = (stbi__uint16 *) out;
+      for (i=0; i < x; ++i, in += img_n*2, out16 += out_n) {
+         for (k=0; k < img_n; ++k)
+            out16[k] = (stbi__uint16) ((in[k*2] << 8) | in[k*2+1]);
+         if (img_n != out_n) out16[img_n] = 0xffff;
+      }
+   } else {
+      STBI_ASSERT(img_n+1 == out_n);
+      for (i=0; i < x; ++i, in += img_n, out += out_n) {
+         for (k=0; k < img_n; ++k)
+            out[k] = in[k];
+         out[img_n] = 255;
+      }
    }
+}
 
-   for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior = cur - stride;
-      int filter = *raw++;
+#ifdef STBI_SSE2
+// the SSE2 kernels handle every bpp a PNG can have (1,2,3,4,6,8) and
+// produce bit-identical results to the generic C versions above.
 
-      if (filter > 4)
-         return stbi__err("invalid filter","Corrupt PNG");
+static __m128i stbi__png_load32(stbi_uc const *p)
+{
+   int v;
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
 
-      if (depth < 8) {
-         STBI_ASSERT(img_width_bytes <= x);
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
-      }
-
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // handle first byte explicitly
-      for (k=0; k < filter_bytes; ++k) {
-         switch (filter) {
-            case STBI__F_none       : cur[k] = raw[k]; break;
-            case STBI__F_sub        : cur[k] = raw[k]; break;
-            case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
-            case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
-            case STBI__F_avg_first  : cur[k] = raw[k]; break;
-            case STBI__F_paeth_first: cur[k] = raw[k]; break;
+static void stbi__png_store32(stbi_uc *p, __m128i v)
+{
+   int t = _mm_cvtsi128_si32(v);
+   memcpy(p, &t, 4);
+}
+
+static void stbi__png_unfilter_up_sse2(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
+{
+   int k;
+   for (k=0; k+16 <= n; k += 16) {
+      __m128i r = _mm_loadu_si128((__m128i const *) (raw + k));
+      __m128i p = _mm_loadu_si128((__m128i const *) (prior + k));
+      _mm_storeu_si128((__m128i *) (cur + k), _mm_add_epi8(r, p));
+   }
+   stbi__png_unfilter_up(cur+k, prior+k, raw+k, n-k, bpp);
+}
+
+static void stbi__png_unfilter_sub_sse2(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
+{
+   // 'sub' is a running sum with stride bpp, so do a log-step prefix sum
+   // of a whole register of pixels, then add the last pixel of the
+   // previous register (replicated into every pixel slot) on top.
+   __m128i last = _mm_setzero_si128();
+   int k = 0;
+   if (bpp == 3 || bpp == 6) {
+      // 4 or 2 pixels per 12 bytes; the top 4 bytes of every store are junk
+      // and get overwritten by the next iteration
+      __m128i mask = bpp == 3 ? _mm_setr_epi32(0xffffff,0,0,0) : _mm_setr_epi32(-1,0xffff,0,0);
+      for (; k+16 <= n; k += 12) {
+         __m128i x = _mm_loadu_si128((__m128i const *) (raw + k));
+         __m128i p;
+         if (bpp == 3) {
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+         } else {
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+         }
+         x = _mm_add_epi8(x, last);
+         _mm_storeu_si128((__m128i *) (cur + k), x);
+         if (bpp == 3) {
+            p = _mm_and_si128(_mm_srli_si128(x, 9), mask);
+            p = _mm_or_si128(p, _mm_slli_si128(p, 3));
+            last = _mm_or_si128(p, _mm_slli_si128(p, 6));
+         } else {
+            p = _mm_and_si128(_mm_srli_si128(x, 6), mask);
+            last = _mm_or_si128(p, _mm_slli_si128(p, 6));
          }
       }
-
-      if (depth == 8) {
-         if (img_n != out_n)
-            cur[img_n] = 255; // first pixel
-         raw += img_n;
-         cur += out_n;
-         prior += out_n;
-      } else if (depth == 16) {
-         if (img_n != out_n) {
-            cur[filter_bytes]   = 255; // first pixel top byte
-            cur[filter_bytes+1] = 255; // first pixel bottom byte
+   } else {
+      for (; k+16 <= n; k += 16) {
+         __m128i x = _mm_loadu_si128((__m128i const *) (raw + k));
+         if (bpp <= 1) x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+         if (bpp <= 2) x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+         if (bpp <= 4) x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+         x = _mm_add_epi8(x, last);
+         _mm_storeu_si128((__m128i *) (cur + k), x);
+         if (bpp == 1) {
+            last = _mm_unpackhi_epi8(x, x);
+            last = _mm_shufflehi_epi16(last, 0xff);
+            last = _mm_unpackhi_epi64(last, last);
+         } else if (bpp == 2) {
+            last = _mm_shufflehi_epi16(x, 0xff);
+            last = _mm_unpackhi_epi64(last, last);
+         } else if (bpp == 4) {
+            last = _mm_shuffle_epi32(x, 0xff);
+         } else {
+            last = _mm_shuffle_epi32(x, 0xee);
          }
-         raw += filter_bytes;
-         cur += output_bytes;
-         prior += output_bytes;
+      }
+   }
+   if (k == 0)
+      stbi__png_unfilter_sub(cur, prior, raw, n, bpp);
+   else
+      for (; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + cur[k-bpp]);
+}
+
+// 'avg' and 'paeth' depend on the pixel immediately to the left, so these
+// step one pixel at a time, but branch-free and with all bytes of the pixel
+// in flight at once. loads and stores are 4 (bpp <= 4) or 8 bytes wide;
+// bytes past the current pixel are junk and get rewritten by the next step.
+static void stbi__png_unfilter_avg_sse2(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
+{
+   __m128i one = _mm_set1_epi8(1);
+   __m128i a = _mm_setzero_si128();
+   int k = 0;
+   if (bpp <= 4) {
+      for (; k+4 <= n; k += bpp) {
+         __m128i b = stbi__png_load32(prior + k);
+         // _mm_avg_epu8 rounds up, png's average rounds down
+         __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+         a = _mm_add_epi8(stbi__png_load32(raw + k), avg);
+         stbi__png_store32(cur + k, a);
+      }
+   } else {
+      for (; k+8 <= n; k += bpp) {
+         __m128i b = _mm_loadl_epi64((__m128i const *) (prior + k));
+         __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+         a = _mm_add_epi8(_mm_loadl_epi64((__m128i const *) (raw + k)), avg);
+         _mm_storel_epi64((__m128i *) (cur + k), a);
+      }
+   }
+   if (k == 0)
+      stbi__png_unfilter_avg(cur, prior, raw, n, bpp);
+   else
+      for (; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-bpp])>>1));
+}
+
+static void stbi__png_unfilter_paeth_sse2(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
+{
+   // paeth in 16-bit lanes: with a=left, b=up, c=upleft and p=a+b-c,
+   // |p-a| = |b-c|, |p-b| = |a-c| and |p-c| = |(b-c)+(a-c)|
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, c = zero;
+   int k = 0, w = bpp <= 4 ? 4 : 8;
+   for (; k+w <= n; k += bpp) {
+      __m128i b, x, pa, pb, pc, not_a, use_c, pred;
+      if (w == 4) {
+         b = _mm_unpacklo_epi8(stbi__png_load32(prior + k), zero);
+         x = stbi__png_load32(raw + k);
       } else {
-         raw += 1;
-         cur += 1;
-         prior += 1;
-      }
-
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (depth < 8 || img_n == out_n) {
-         int nk = (width - 1)*filter_bytes;
-         #define CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            CASE(STBI__F_sub)          cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); break;
-            CASE(STBI__F_up)           cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            CASE(STBI__F_avg)          cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); break;
-            CASE(STBI__F_paeth)        cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); break;
-            CASE(STBI__F_avg_first)    cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); break;
-            CASE(STBI__F_paeth_first)  cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); break;
+         b = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (prior + k)), zero);
+         x = _mm_loadl_epi64((__m128i const *) (raw + k));
+      }
+      pa = _mm_sub_epi16(b, c);
+      pb = _mm_sub_epi16(a, c);
+      pc = _mm_add_epi16(pa, pb);
+      pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+      pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+      pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+      not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+      use_c = _mm_cmpgt_epi16(pb, pc);
+      pred  = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, b));
+      pred  = _mm_or_si128(_mm_and_si128(not_a, pred), _mm_andnot_si128(not_a, a));
+      x = _mm_add_epi8(x, _mm_packus_epi16(pred, pred));
+      if (w == 4)
+         stbi__png_store32(cur + k, x);
+      else
+         _mm_storel_epi64((__m128i *) (cur + k), x);
+      a = _mm_unpacklo_epi8(x, zero);
+      c = b;
+   }
+   if (k == 0)
+      stbi__png_unfilter_paeth(cur, prior, raw, n, bpp);
+   else
+      for (; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-bpp],prior[k],prior[k-bpp]));
+}
+
+static void stbi__png_expand_row_sse2(stbi_uc *out, stbi_uc const *in, stbi__uint32 x, int img_n, int out_n, int depth)
+{
+   stbi__uint32 i = 0;
+   if (depth == 16) {
+      // byte swap: (v << 8) | (v >> 8) in each 16-bit lane
+      if (img_n == out_n) {
+         // any 8 pixels are exactly img_n registers
+         for (; i+8 <= x; i += 8) {
+            int k;
+            for (k=0; k < img_n; ++k) {
+               __m128i v = _mm_loadu_si128((__m128i const *) (in + i*img_n*2 + k*16));
+               v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+               _mm_storeu_si128((__m128i *) (out + i*out_n*2 + k*16), v);
+            }
          }
-         #undef CASE
-         raw += nk;
-      } else {
-         STBI_ASSERT(img_n+1 == out_n);
-         #define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
-                   for (k=0; k < filter_bytes; ++k)
-         switch (filter) {
-            CASE(STBI__F_none)         cur[k] = raw[k]; break;
-            CASE(STBI__F_sub)          cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); break;
-            CASE(STBI__F_up)           cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            CASE(STBI__F_avg)          cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); break;
-            CASE(STBI__F_paeth)        cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); break;
-            CASE(STBI__F_avg_first)    cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); break;
-            CASE(STBI__F_paeth_first)  cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); break;
+      } else if (img_n == 1) {
+         __m128i alpha = _mm_set1_epi16(-1);
+         for (; i+8 <= x; i += 8) {
+            __m128i v = _mm_loadu_si128((__m128i const *) (in + i*2));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i *) (out + i*4     ), _mm_unpacklo_epi16(v, alpha));
+            _mm_storeu_si128((__m128i *) (out + i*4 + 16), _mm_unpackhi_epi16(v, alpha));
          }
-         #undef CASE
-
-         // the loop above sets the high byte of the pixels' alpha, but for
-         // 16 bit png files we also need the low byte set. we'll do that here.
-         if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
-            for (i=0; i < x; ++i,cur+=output_bytes) {
-               cur[filter_bytes+1] = 255;
-            }
+      } else {
+         // 2 pixels per 12 bytes, read 16
+         __m128i alpha = _mm_setr_epi16(0,0,0,-1,0,0,0,-1);
+         STBI_ASSERT(img_n == 3);
+         for (; i+3 <= x; i += 2) {
+            __m128i v = _mm_loadu_si128((__m128i const *) (in + i*6));
+            v = _mm_unpacklo_epi64(v, _mm_srli_si128(v, 6));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i *) (out + i*8), _mm_or_si128(v, alpha));
          }
       }
+   } else if (img_n == 1) {
+      __m128i alpha = _mm_set1_epi8(-1);
+      for (; i+16 <= x; i += 16) {
+         __m128i v = _mm_loadu_si128((__m128i const *) (in + i));
+         _mm_storeu_si128((__m128i *) (out + i*2     ), _mm_unpacklo_epi8(v, alpha));
+         _mm_storeu_si128((__m128i *) (out + i*2 + 16), _mm_unpackhi_epi8(v, alpha));
+      }
+   } else {
+      // 4 pixels per 12 bytes, read 16: gather the 4 pixels into 32-bit
+      // lanes, whose top byte (the next pixel's red) becomes alpha.
+      __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+      STBI_ASSERT(img_n == 3);
+      for (; i+6 <= x; i += 4) {
+         __m128i v  = _mm_loadu_si128((__m128i const *) (in + i*3));
+         __m128i lo = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+         __m128i hi = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+         _mm_storeu_si128((__m128i *) (out + i*4), _mm_or_si128(_mm_unpacklo_epi64(lo, hi), alpha));
+      }
+   }
+   if (i < x)
+      stbi__png_expand_row(out + i*out_n*(depth/8), in + i*img_n*(depth/8), x-i, img_n, out_n, depth);
+}
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+// AVX2 only pays off where the work is independent across a whole 32-byte
+// register: 'up', and widening rows. everything else stays on SSE2.
+STBI__AVX2_TARGET
+static void stbi__png_unfilter_up_avx2(stbi_uc *cur, stbi_uc const *prior, stbi_uc const *raw, int n, int bpp)
+{
+   int k;
+   for (k=0; k+32 <= n; k += 32) {
+      __m256i r = _mm256_loadu_si256((__m256i const *) (raw + k));
+      __m256i p = _mm256_loadu_si256((__m256i const *) (prior + k));
+      _mm256_storeu_si256((__m256i *) (cur + k), _mm256_add_epi8(r, p));
+   }
+   stbi__png_unfilter_up_sse2(cur+k, prior+k, raw+k, n-k, bpp);
+}
+
+STBI__AVX2_TARGET
+static void stbi__png_expand_row_avx2(stbi_uc *out, stbi_uc const *in, stbi__uint32 x, int img_n, int out_n, int depth)
+{
+   stbi__uint32 i = 0;
+   if (depth == 8 && img_n == 3) {
+      // 8 pixels per iteration, 4 in each 128-bit lane
+      __m256i shuf  = _mm256_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1,
+                                       0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+      __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+      for (; i+10 <= x; i += 8) {
+         __m128i lo = _mm_loadu_si128((__m128i const *) (in + i*3));
+         __m128i hi = _mm_loadu_si128((__m128i const *) (in + i*3 + 12));
+         __m256i v  = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+         v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), alpha);
+         _mm256_storeu_si256((__m256i *) (out + i*4), v);
+      }
+   } else if (depth == 8 && img_n == 1) {
+      __m256i alpha = _mm256_set1_epi16((short) 0xff00);
+      for (; i+16 <= x; i += 16) {
+         __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) (in + i)));
+         _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_or_si256(v, alpha));
+      }
+   } else if (depth == 16 && img_n == out_n) {
+      __m256i swap = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+                                      1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+      stbi__uint32 n = x*img_n*2;
+      for (; i+32 <= n; i += 32) {
+         __m256i v = _mm256_loadu_si256((__m256i const *) (in + i));
+         _mm256_storeu_si256((__m256i *) (out + i), _mm256_shuffle_epi8(v, swap));
+      }
+      // i counts bytes here; redo any partial pixel at the end on SSE2
+      if (i < n) {
+         stbi__uint32 p = i / (img_n*2);
+         stbi__png_expand_row_sse2(out + p*img_n*2, in + p*img_n*2, x-p, img_n, out_n, depth);
+      }
+      return;
+   }
+   if (i < x)
+      stbi__png_expand_row_sse2(out + i*out_n*(depth/8), in + i*img_n*(depth/8), x-i, img_n, out_n, depth);
+}
+#endif // STBI_AVX2
+
+// set up the kernels
+static void stbi__setup_png(stbi__png *p)
+{
+   p->unfilter_kernel[STBI__F_none ] = stbi__png_unfilter_none;
+   p->unfilter_kernel[STBI__F_sub  ] = stbi__png_unfilter_sub;
+   p->unfilter_kernel[STBI__F_up   ] = stbi__png_unfilter_up;
+   p->unfilter_kernel[STBI__F_avg  ] = stbi__png_unfilter_avg;
+   p->unfilter_kernel[STBI__F_paeth] = stbi__png_unfilter_paeth;
+   p->expand_row_kernel = stbi__png_expand_row;
+
+#ifdef STBI_SSE2
+   if (stbi__sse2_available()) {
+      p->unfilter_kernel[STBI__F_sub  ] = stbi__png_unfilter_sub_sse2;
+      p->unfilter_kernel[STBI__F_up   ] = stbi__png_unfilter_up_sse2;
+      p->unfilter_kernel[STBI__F_avg  ] = stbi__png_unfilter_avg_sse2;
+      p->unfilter_kernel[STBI__F_paeth] = stbi__png_unfilter_paeth_sse2;
+      p->expand_row_kernel = stbi__png_expand_row_sse2;
+   }
+#endif
+
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      p->unfilter_kernel[STBI__F_up   ] = stbi__png_unfilter_up_avx2;
+      p->expand_row_kernel = stbi__png_expand_row_avx2;
+   }
+#endif
+}
+
+// create the png data from post-deflated data
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   int bytes = (depth == 16? 2 : 1);
+   stbi__context *s = a->s;
+   stbi__uint32 j,stride = x*out_n*bytes;
+   stbi__uint32 img_len, img_width_bytes;
+   int k, compact, in_place;
+   int img_n = s->img_n; // copy it into a local for later
+
+   int output_bytes = out_n*bytes;
+   int filter_bytes = img_n*bytes;
+   stbi_uc *scratch, *zero_row, *row[2];
+   stbi_uc *dest_row = NULL;
+   int dest_stride = 0;
+   stbi__convert_row_kernel convert = NULL;
+
+   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
+   // non-interlaced and not widened: unfilter in place. output row j
+   // starts STBI__PNG_INPLACE_PAD+j+1 bytes before its filtered row, so
+   // no kernel ever stores over input it still has to read.
+   in_place = depth == 8 && out_n == img_n && s->img_x == x && s->img_y == y && raw == a->expanded + STBI__PNG_INPLACE_PAD && !a->rows;
+#ifdef STBI_THREADS
+   if (a->inflated) in_place = 0; // the inflater may still copy matches from behind us
+#endif
+   if (in_place) {
+      a->out = a->expanded;
+      a->expanded = NULL;
+   } else {
+      a->out = (stbi_uc *) stbi__malloc(x * y * output_bytes); // extra bytes to write off the end into
+      if (!a->out) return stbi__err("outofmem", "Out of memory");
+   }
+
+   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+   img_len = (img_width_bytes + 1) * y;
+   if (s->img_x == x && s->img_y == y) {
+      if (raw_len != img_len) return stbi__err("not enough pixels","Corrupt PNG");
+   } else { // interlaced:
+      if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+   }
+
+   if (depth < 8) {
+      STBI_ASSERT(img_width_bytes <= x);
+      filter_bytes = 1;
+   }
+
+   if (a->stream_rows) {
+      dest_row = stbi__dest_start(s->dest, x, y, &dest_stride);
+      if (!dest_row) return 0;
+      convert = stbi__get_convert_row();
+   }
+
+   // 16-bit rows and rows that gain an alpha channel are unfiltered into a
+   // ring of two compact scanlines and then widened into the output; all
+   // other rows are unfiltered in place in the output image. the first
+   // row is unfiltered against a row of 0s, or for a later band of s->rows,
+   // against the last row of the band before.
+   compact = (depth == 16 || (depth == 8 && img_n != out_n));
+   scratch = (stbi_uc *) stbi__malloc(img_width_bytes * (compact ? 3 : 1));
+   if (!scratch) return stbi__err("outofmem", "Out of memory");
+   zero_row = scratch;
+   row[0] = scratch + img_width_bytes;
+   row[1] = row[0] + img_width_bytes;
+   memset(zero_row, 0, img_width_bytes);
+
+   for (j=0; j < y; ++j) {
+      stbi_uc *cur, *prior;
+      int filter;
+
+#ifdef STBI_THREADS
+      if (a->inflated && !stbi__progress_wait(a->inflated, (int) ((j+1) * (img_width_bytes+1)))) {
+         stbi__free(scratch);
+         return 0; // the inflate thread set the error
+      }
+#endif
+      filter = *raw++;
+
+      if (filter > 4) {
+         stbi__free(scratch);
+         return stbi__err("invalid filter","Corrupt PNG");
+      }
+
+      if (compact) {
+         cur = row[j&1];
+         prior = j ? row[(j-1)&1] : zero_row;
+      } else {
+         // for depth < 8, store output to the rightmost img_width_bytes of
+         // the row, so we can expand the bits to pixels in place
+         cur = a->out + stride*j + x*out_n - img_width_bytes;
+         prior = j ? cur - stride : zero_row;
+      }
+
+      if (j == 0 && a->rows && a->rows->done)
+         prior = a->rows->last;
+      else if (j == 0)
+         filter = first_row_filter[filter];
+      a->unfilter_kernel[filter](cur, prior, raw, img_width_bytes, filter_bytes);
+      raw += img_width_bytes;
+
+      if (compact)
+         a->expand_row_kernel(a->out + stride*j, cur, x, img_n, out_n, depth);
+
+      if (a->stream_rows) {
+         stbi__dest_row(s->dest, convert, dest_row, a->out + stride*j, out_n, x);
+         dest_row += dest_stride;
+         s->dest->progress(s->dest->user, j+1, 0);
+      }
    }
+   if (a->rows)
+      memcpy(a->rows->last, compact ? row[(y-1)&1] : a->out + stride*(y-1) + x*out_n - img_width_bytes, img_width_bytes);
+   stbi__free(scratch);
 
    // we make a separate pass to expand bits to pixels; for performance,
    // this could run two scanlines behind the above code, so it won't
@@ -4196,17 +8558,6 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
             }
          }
       }
-   } else if (depth == 16) {
-      // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
-      stbi__uint16 *cur16 = (stbi__uint16*)cur;
-
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
-         *cur16 = (cur[0] << 8) | cur[1];
-      }
    }
 
    return 1;
@@ -4214,13 +8565,15 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
 
 static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
 {
+   int out_bytes = out_n * (depth == 16 ? 2 : 1);
    stbi_uc *final;
    int p;
    if (!interlaced)
       return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
 
    // de-interlacing
-   final = (stbi_uc *) stbi__malloc(a->s->img_x * a->s->img_y * out_n);
+   final = (stbi_uc *) stbi__malloc(a->s->img_x * a->s->img_y * out_bytes);
+   if (final == NULL) return stbi__err("outofmem", "Out of memory");
    for (p=0; p < 7; ++p) {
       int xorig[] = { 0,4,0,2,0,1,0 };
       int yorig[] = { 0,0,4,0,2,0,1 };
@@ -4233,18 +8586,18 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
          if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
+            stbi__free(final);
             return 0;
          }
          for (j=0; j < y; ++j) {
             for (i=0; i < x; ++i) {
                int out_y = j*yspc[p]+yorig[p];
                int out_x = i*xspc[p]+xorig[p];
-               memcpy(final + out_y*a->s->img_x*out_n + out_x*out_n,
-                      a->out + (j*x+i)*out_n, out_n);
+               memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
+                      a->out + (j*x+i)*out_bytes, out_bytes);
             }
          }
-         STBI_FREE(a->out);
+         stbi__free(a->out);
          image_data += img_len;
          image_data_len -= img_len;
       }
@@ -4254,15 +8607,15 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n, stbi__uint32 pixel_count)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
+   stbi__uint32 i;
    stbi_uc *p = z->out;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
    STBI_ASSERT(out_n == 2 || out_n == 4);
+   STBI__STAT_ENTER(STBI_stat_png_convert);
 
    if (out_n == 2) {
       for (i=0; i < pixel_count; ++i) {
@@ -4276,18 +8629,19 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
          p += 4;
       }
    }
+   STBI__STAT_LEAVE(STBI_stat_png_convert, pixel_count * out_n);
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n, stbi__uint32 pixel_count)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
+   stbi__uint32 i;
    stbi__uint16 *p = (stbi__uint16*) z->out;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
    STBI_ASSERT(out_n == 2 || out_n == 4);
+   STBI__STAT_ENTER(STBI_stat_png_convert);
 
    if (out_n == 2) {
       for (i = 0; i < pixel_count; ++i) {
@@ -4301,12 +8655,13 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
          p += 4;
       }
    }
+   STBI__STAT_LEAVE(STBI_stat_png_convert, pixel_count * out_n * 2);
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n, stbi__uint32 pixel_count)
 {
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
+   stbi__uint32 i;
    stbi_uc *p, *temp_out, *orig = a->out;
 
    p = (stbi_uc *) stbi__malloc(pixel_count * pal_img_n);
@@ -4314,6 +8669,7 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
 
    // between here and free(out) below, exitting would leak
    temp_out = p;
+   STBI__STAT_ENTER(STBI_stat_png_palette);
 
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
@@ -4333,18 +8689,19 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
-   STBI_FREE(a->out);
+   stbi__free(a->out);
    a->out = temp_out;
+   STBI__STAT_LEAVE(STBI_stat_png_palette, pixel_count * pal_img_n);
 
    STBI_NOTUSED(len);
 
    return 1;
 }
 
-static int stbi__reduce_png(stbi__png *p)
+static int stbi__reduce_png(stbi__png *p, stbi__uint32 pixel_count)
 {
    int i;
-   int img_len = p->s->img_x * p->s->img_y * p->s->img_out_n;
+   int img_len = pixel_count * p->s->img_out_n;
    stbi_uc *reduced;
    stbi__uint16 *orig = (stbi__uint16*)p->out;
 
@@ -4353,33 +8710,34 @@ static int stbi__reduce_png(stbi__png *p)
    reduced = (stbi_uc *)stbi__malloc(img_len);
    if (p == NULL) return stbi__err("outofmem", "Out of memory");
 
+   STBI__STAT_ENTER(STBI_stat_png_convert);
    for (i = 0; i < img_len; ++i) reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is a decent approx of 16->8 bit scaling
+   STBI__STAT_LEAVE(STBI_stat_png_convert, img_len);
 
    p->out = reduced;
-   STBI_FREE(orig);
+   stbi__free(orig);
 
    return 1;
 }
 
-static int stbi__unpremultiply_on_load = 0;
-static int stbi__de_iphone_flag = 0;
 
 STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
-   stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
+   stbi__default_options.unpremultiply = flag_true_if_should_unpremultiply;
 }
 
 STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
 {
-   stbi__de_iphone_flag = flag_true_if_should_convert;
+   stbi__default_options.de_iphone = flag_true_if_should_convert;
 }
 
-static void stbi__de_iphone(stbi__png *z)
+static void stbi__de_iphone(stbi__png *z, stbi__uint32 pixel_count)
 {
    stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
+   stbi__uint32 i;
    stbi_uc *p = z->out;
 
+   STBI__STAT_ENTER(STBI_stat_png_convert);
    if (s->img_out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          stbi_uc t = p[0];
@@ -4389,7 +8747,7 @@ static void stbi__de_iphone(stbi__png *z)
       }
    } else {
       STBI_ASSERT(s->img_out_n == 4);
-      if (stbi__unpremultiply_on_load) {
+      if (s->opt->unpremultiply) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
             stbi_uc a = p[3];
@@ -4414,29 +8772,392 @@ static void stbi__de_iphone(stbi__png *z)
          }
       }
    }
+   STBI__STAT_LEAVE(STBI_stat_png_convert, pixel_count * s->img_out_n);
 }
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((a) << 24) + ((b) << 16) + ((c) << 8) + (d))
 
+// ancillary chunks (lowercase first letter) can sit between IDATs; none of
+// the ones stb_image reads may come after the first IDAT, so they are skipped
+#define STBI__PNG_ANCILLARY(type)  (((type) >> 29) & 1)
+
+// stbi__zrefill_func handing out the payload of the IDAT chunks, skipping
+// any ancillary chunks between them. memory input is passed through in
+// place; callback input is staged through idat_buf. stops (and remembers
+// the header) at the first critical chunk that isn't an IDAT.
+static int stbi__png_idat_refill(void *user, stbi_uc **start, stbi_uc **end)
+{
+   stbi__png *z = (stbi__png *) user;
+   stbi__context *s = z->s;
+   int n;
+   while (z->idat_left == 0) {
+      if (z->idat_done) return 0;
+      stbi__get32be(s); // CRC of the chunk just finished
+      z->idat_next = stbi__get_chunk_header(s);
+      if (z->idat_next.type != STBI__PNG_TYPE('I','D','A','T')) {
+         if (STBI__PNG_ANCILLARY(z->idat_next.type)) {
+            stbi__skip(s, z->idat_next.length);
+            continue;
+         }
+         z->idat_done = 1;
+         return 0;
+      }
+      z->idat_left = z->idat_next.length;
+   }
+   if (s->io.read) {
+      n = z->idat_left < STBI__PNG_IDAT_BUFSIZE ? (int) z->idat_left : STBI__PNG_IDAT_BUFSIZE;
+      if (!stbi__getn(s, z->idat_buf, n)) n = 0;
+      *start = z->idat_buf;
+   } else {
+      n = (int) (s->img_buffer_end - s->img_buffer);
+      if ((stbi__uint32) n > z->idat_left) n = (int) z->idat_left;
+      *start = s->img_buffer;
+      s->img_buffer += n;
+   }
+   if (n <= 0) {
+      // ran out of file; leave a bogus chunk behind so the parser errors out
+      z->idat_left = 0;
+      z->idat_done = 1;
+      z->idat_next.type = 0;
+      return 0;
+   }
+   z->idat_left -= n;
+   *end = *start + n;
+   return 1;
+}
+
+// inflate the IDAT chunks starting with one of the given length straight
+// into an exactly-sized z->expanded (after STBI__PNG_INPLACE_PAD bytes).
+// afterwards the stream is positioned after the header of the first
+// non-IDAT chunk, which is in z->idat_next.
+static int stbi__png_alloc_expanded(stbi__png *z, stbi__uint32 raw_len)
+{
+   if (raw_len > 0x7fffffff - STBI__PNG_INPLACE_PAD) return stbi__err("too large", "Image too large to decode");
+   z->expanded = (stbi_uc *) stbi__malloc(raw_len + STBI__PNG_INPLACE_PAD);
+   if (z->expanded == NULL) return stbi__err("outofmem", "Out of memory");
+   return 1;
+}
+
+// unfilter y rows of filtered data at raw and finish them off the way the
+// IEND chunk does a whole image, then hand them to s->rows. only the part
+// of them in s->rows' window is finished, packed at the start of z->out
+static int stbi__png_rows_band(stbi__png *z, stbi_uc *raw, stbi__uint32 y)
+{
+   stbi__png_rows *r = z->rows;
+   stbi__context *s = z->s;
+   stbi__rows *w = s->rows;
+   stbi__uint32 j, count;
+   int out_n = s->img_out_n, ok, a, b;
+   STBI__STAT_ENTER(STBI_stat_png_unfilter);
+   ok = stbi__create_png_image_raw(z, raw, r->row_bytes * y, out_n, s->img_x, y, z->depth, r->color);
+   STBI__STAT_LEAVE(STBI_stat_png_unfilter, r->row_bytes * y);
+   // rows a..b-1 of the band are in the window
+   a = w->y0 > (int) r->done ? w->y0 - (int) r->done : 0;
+   b = w->y0 + w->h - (int) r->done < (int) y ? w->y0 + w->h - (int) r->done : (int) y;
+   if (ok && b > a) {
+      if (a || w->w != (int) s->img_x) {
+         size_t bpp = out_n * (z->depth == 16 ? 2 : 1);
+         for (j=a; j < (stbi__uint32) b; ++j)
+            memmove(z->out + (j-a) * w->w * bpp, z->out + ((size_t) j * s->img_x + w->x0) * bpp, w->w * bpp);
+      }
+      count = w->w * (b-a);
+      if (r->has_trans)
+         ok = z->depth == 16 ? stbi__compute_transparency16(z, r->tc16, out_n, count) : stbi__compute_transparency(z, r->tc, out_n, count);
+      if (ok && r->iphone && out_n > 2)
+         stbi__de_iphone(z, count);
+      if (ok && r->pal_img_n)
+         ok = stbi__expand_png_palette(z, r->palette, r->pal_len, r->pal_img_n, count);
+      if (ok)
+         ok = stbi__reduce_png(z, count);
+   }
+   if (r->pal_img_n) out_n = r->pal_img_n;
+   for (j=0; j < y && ok; ++j)
+      ok = stbi__rows_put_span(w, (int) j >= a && (int) j < b ? z->out + (size_t) (j-a) * w->w * out_n : NULL, out_n);
+   stbi__free(z->out);
+   z->out = NULL;
+   r->done += y;
+   return ok;
+}
+
+// stbi__zflush_func for s->rows: finish every band that's complete
+static int stbi__png_flush_rows(void *user, stbi_uc *start, int len)
+{
+   stbi__png *z = (stbi__png *) user;
+   stbi__png_rows *r = z->rows;
+   stbi__uint32 y, used = 0;
+   while (r->done < z->s->img_y) {
+      y = z->s->img_y - r->done < r->band ? z->s->img_y - r->done : r->band;
+      if ((stbi__uint32) len - used < y * r->row_bytes) break;
+      if (!stbi__png_rows_band(z, start + used, y)) return -1;
+      used += y * r->row_bytes;
+   }
+   if (r->done == z->s->img_y && used < (stbi__uint32) len) {
+      stbi__err("output buffer limit","Corrupt PNG");
+      return -1;
+   }
+   return (int) used;
+}
+
+#ifdef STBI_THREADS
+static void stbi__png_inflate_progress(void *user, int bytes)
+{
+   stbi__progress_set(((stbi__png *) user)->inflated, bytes);
+}
+#endif
+
+// raw_len is the size of z->expanded, which for z->rows is only a window
+static int stbi__png_inflate_idat(stbi__png *z, stbi__uint32 length, stbi__uint32 raw_len, int parse_header)
+{
+   stbi__context *s = z->s;
+   stbi__zprogress_func progress = NULL;
+   stbi_uc *p, *e;
+   int n;
+
+#ifdef STBI_THREADS
+   if (z->inflated) progress = stbi__png_inflate_progress;
+#endif
+   if (s->io.read) {
+      z->idat_buf = (stbi_uc *) stbi__malloc(STBI__PNG_IDAT_BUFSIZE);
+      if (z->idat_buf == NULL) return stbi__err("outofmem", "Out of memory");
+   }
+   z->idat_left = length;
+   z->idat_done = 0;
+   STBI__STAT_ENTER(STBI_stat_png_inflate);
+   if (z->rows)
+      n = stbi__zlib_decode_window((char *) z->expanded + STBI__PNG_INPLACE_PAD, (int) raw_len, stbi__png_idat_refill, stbi__png_flush_rows, z, parse_header) ? 0 : -1;
+   else
+      n = stbi__zlib_decode_stream((char *) z->expanded + STBI__PNG_INPLACE_PAD, (int) raw_len, stbi__png_idat_refill, progress, z, parse_header);
+   STBI__STAT_LEAVE(STBI_stat_png_inflate, z->rows ? (double) z->rows->done * z->rows->row_bytes : n < 0 ? 0 : n);
+   if (n < 0) {
+      // a truncated file is the likelier story than whatever zlib made of it
+      if (z->idat_done && z->idat_next.type == 0) return stbi__err("outofdata","Corrupt PNG");
+      // and a critical chunk cutting the image data in two than that
+      if (z->idat_done && z->idat_next.type != STBI__PNG_TYPE('I','E','N','D')) return stbi__err("IDAT not consecutive","Corrupt PNG");
+      return 0; // zlib should set error
+   }
+   // skip whatever is left of the zlib stream (adler32, padding)
+   while (!z->idat_done) {
+      if (s->io.read) {
+         stbi__skip(s, z->idat_left);
+         z->idat_left = 0;
+      }
+      stbi__png_idat_refill(z, &p, &e);
+   }
+   stbi__free(z->idat_buf); z->idat_buf = NULL;
+   if (z->idat_next.type == 0) return stbi__err("outofdata","Corrupt PNG");
+   if (z->rows ? z->rows->done < s->img_y : (stbi__uint32) n < raw_len) return stbi__err("not enough pixels","Corrupt PNG");
+   return 1;
+}
+
+#ifdef STBI_THREADS
+typedef struct
+{
+   stbi__png *z;
+   stbi__uint32 length, raw_len;
+   int parse_header;
+   stbi__progress inflated;
+   const char *failure_reason;
+} stbi__png_pipeline;
+
+static void stbi__png_inflate_thread(void *arg)
+{
+   stbi__png_pipeline *pl = (stbi__png_pipeline *) arg;
+   if (stbi__png_inflate_idat(pl->z, pl->length, pl->raw_len, pl->parse_header))
+      stbi__progress_set(&pl->inflated, (int) pl->raw_len);
+   else {
+      if (stbi__g_failure_reason) pl->failure_reason = stbi__g_failure_reason;
+      stbi__progress_fail(&pl->inflated);
+   }
+}
+
+// inflate the IDAT data on a second thread while this one unfilters each
+// row into z->out as soon as the inflater has got past it
+static int stbi__png_pipelined_decode(stbi__png *z, stbi__uint32 length, stbi__uint32 raw_len, int parse_header, int color)
+{
+   stbi__png_pipeline pl;
+   stbi__thread inflater;
+   int ok;
+
+   if (!stbi__png_alloc_expanded(z, raw_len)) return 0;
+   pl.z = z;
+   pl.length = length;
+   pl.raw_len = raw_len;
+   pl.parse_header = parse_header;
+   pl.failure_reason = "Corrupt PNG"; // in case the inflater's thread never set one
+   stbi__progress_init(&pl.inflated);
+   z->inflated = &pl.inflated;
+   if (!stbi__thread_create(&inflater, stbi__png_inflate_thread, &pl)) {
+      z->inflated = NULL;
+      stbi__progress_destroy(&pl.inflated);
+      return stbi__png_inflate_idat(z, length, raw_len, parse_header);
+   }
+   STBI__STAT_ENTER(STBI_stat_png_unfilter);
+   ok = stbi__create_png_image(z, z->expanded + STBI__PNG_INPLACE_PAD, raw_len, z->s->img_out_n, z->depth, color, 0);
+   STBI__STAT_LEAVE(STBI_stat_png_unfilter, raw_len);
+   STBI__STAT_ENTER(STBI__STAT_OTHER);
+   stbi__thread_join(&inflater);
+   STBI__STAT_LEAVE(STBI__STAT_OTHER, 0);
+   if (pl.inflated.failed) {
+      stbi__g_failure_reason = pl.failure_reason;
+      ok = 0;
+   }
+   z->inflated = NULL;
+   stbi__progress_destroy(&pl.inflated);
+   return ok;
+}
+
+static stbi__uint32 stbi__png_be32(stbi_uc const *p)
+{
+   return ((stbi__uint32) p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+}
+
+// step from the IDAT payload at *p (*len bytes) to the next one in memory,
+// over any ancillary chunks, the way stbi__png_idat_refill does
+static int stbi__png_next_idat(stbi_uc **p, stbi__uint32 *len, stbi_uc *end)
+{
+   stbi_uc *q = *p + *len;
+   for (;;) {
+      if (end - q < 12) return 0;
+      if (stbi__png_be32(q+8) == STBI__PNG_TYPE('I','D','A','T')) break;
+      if (!STBI__PNG_ANCILLARY(stbi__png_be32(q+8)) || stbi__png_be32(q+4) > (stbi__uint32) (end - q - 12)) return 0;
+      q += 12 + stbi__png_be32(q+4);
+   }
+   *len = stbi__png_be32(q+4);
+   *p = q + 12;
+   if (*len > (stbi__uint32) (end - *p)) *len = (stbi__uint32) (end - *p);
+   return 1;
+}
+
+// look ahead through the IDAT chunks of memory input (the current one has
+// length bytes left) for sync points, the "00 00 ff ff" of an empty stored
+// block, that cut the zlib stream into roughly even segments. fills bounds[]
+// with segment offsets into the stream and returns the segment count, or 0
+// if it won't split
+static int stbi__png_find_sync_points(stbi__png *z, stbi__uint32 length, int *bounds, int max_segments, int *size)
+{
+   stbi__context *s = z->s;
+   stbi_uc *p, *end = s->img_buffer_end;
+   stbi__uint32 i, len, total = 0, pos = 0, gap, window = 0xffffffff;
+   int n = 1;
+
+   len = length < (stbi__uint32) (end - s->img_buffer) ? length : (stbi__uint32) (end - s->img_buffer);
+   p = s->img_buffer;
+   do {
+      if (len > 0x7fffffff - total) return 0;
+      total += len;
+   } while (stbi__png_next_idat(&p, &len, end));
+
+   gap = total / max_segments;
+   if (gap < STBI__PNG_SEGMENT_MIN) gap = STBI__PNG_SEGMENT_MIN;
+   bounds[0] = 0;
+   len = length < (stbi__uint32) (end - s->img_buffer) ? length : (stbi__uint32) (end - s->img_buffer);
+   p = s->img_buffer;
+   do {
+      for (i=0; i < len; ++i) {
+         window = (window << 8) | p[i];
+         ++pos;
+         if (window == 0x0000ffff && pos - bounds[n-1] >= gap && total - pos >= gap) {
+            bounds[n++] = (int) pos;
+            if (n == max_segments) break;
+         }
+      }
+   } while (n < max_segments && stbi__png_next_idat(&p, &len, end));
+   *size = (int) total;
+   return n > 1 ? n : 0;
+}
+
+// inflate the IDAT data (the current chunk has length bytes left) on
+// several threads, split at the sync points found above
+static int stbi__png_parallel_inflate(stbi__png *z, stbi__uint32 length, stbi__uint32 raw_len, int parse_header, int *bounds, int nseg, int size)
+{
+   stbi__context *s = z->s;
+   stbi_uc *data, *p, *e;
+   int n, pos = 0;
+   // the segments need one contiguous stream; a single IDAT already is one
+   int copy = length < (stbi__uint32) size;
+
+   data = copy ? (stbi_uc *) stbi__malloc(size) : s->img_buffer;
+   if (data == NULL) return stbi__err("outofmem", "Out of memory");
+   z->idat_left = length;
+   z->idat_done = 0;
+   while (stbi__png_idat_refill(z, &p, &e)) {
+      n = (int) (e - p);
+      if (n > size - pos) n = size - pos;
+      if (copy) memcpy(data + pos, p, n);
+      pos += n;
+   }
+   if (z->idat_next.type == 0) {
+      if (copy) stbi__free(data);
+      return stbi__err("outofdata","Corrupt PNG");
+   }
+   if (!stbi__png_alloc_expanded(z, raw_len)) {
+      if (copy) stbi__free(data);
+      return 0;
+   }
+   STBI__STAT_ENTER(STBI_stat_png_inflate);
+   n = stbi__zlib_decode_parallel(data, pos, bounds, nseg, (char *) z->expanded + STBI__PNG_INPLACE_PAD, (int) raw_len, parse_header, z->s->opt->max_threads);
+   STBI__STAT_LEAVE(STBI_stat_png_inflate, n < 0 ? 0 : n);
+   if (copy) stbi__free(data);
+   if (n < 0) {
+      if (z->idat_next.type != STBI__PNG_TYPE('I','E','N','D')) return stbi__err("IDAT not consecutive","Corrupt PNG");
+      return 0;
+   }
+   if ((stbi__uint32) n < raw_len) return stbi__err("not enough pixels","Corrupt PNG");
+   return 1;
+}
+#endif
+
+// size of the filtered image data, including every pass when interlaced
+static stbi__uint32 stbi__png_raw_len(stbi__uint32 w, stbi__uint32 h, int img_n, int depth, int interlaced)
+{
+   stbi__uint32 len = 0;
+   int p;
+   if (!interlaced)
+      return ((((img_n * w * depth) + 7) >> 3) + 1) * h;
+   for (p=0; p < 7; ++p) {
+      int xorig[] = { 0,4,0,2,0,1,0 };
+      int yorig[] = { 0,0,4,0,2,0,1 };
+      int xspc[]  = { 8,8,4,4,2,2,1 };
+      int yspc[]  = { 8,8,8,4,4,2,2 };
+      if (w > (stbi__uint32) xorig[p] && h > (stbi__uint32) yorig[p]) {
+         stbi__uint32 x = (w - xorig[p] + xspc[p]-1) / xspc[p];
+         stbi__uint32 y = (h - yorig[p] + yspc[p]-1) / yspc[p];
+         len += ((((img_n * x * depth) + 7) >> 3) + 1) * y;
+      }
+   }
+   return len;
+}
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
    stbi_uc has_trans=0, tc[3];
    stbi__uint16 tc16[3];
-   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   stbi__uint32 i, pal_len=0, raw_len=0;
+   int first=1,k,ok,interlace=0, color=0, is_iphone=0, pending=0;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
-   z->idata = NULL;
+   z->idat_buf = NULL;
    z->out = NULL;
+#ifdef STBI_THREADS
+   z->inflated = NULL;
+#endif
+   z->stream_rows = 0;
+   z->rows = NULL;
 
    if (!stbi__check_png_header(s)) return 0;
 
    if (scan == STBI__SCAN_type) return 1;
 
    for (;;) {
-      stbi__pngchunk c = stbi__get_chunk_header(s);
+      stbi__pngchunk c;
+      if (pending) {
+         // header already read while streaming IDAT data
+         c = z->idat_next;
+         pending = 0;
+      } else
+         c = stbi__get_chunk_header(s);
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
             is_iphone = 1;
@@ -4459,13 +9180,13 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (!s->img_x || !s->img_y) return stbi__err("0-pixel image","Corrupt PNG");
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
-               if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
                if (scan == STBI__SCAN_header) return 1;
+               if ((!s->rows || interlace) && (1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
             } else {
                // if paletted, then pal_n is our final components, and
                // img_n is # components to decompress/filter.
                s->img_n = 1;
-               if ((1 << 30) / s->img_x / 4 < s->img_y) return stbi__err("too large","Corrupt PNG");
+               if (scan == STBI__SCAN_load && (!s->rows || interlace) && (1 << 30) / s->img_x / 4 < s->img_y) return stbi__err("too large","Corrupt PNG");
                // if SCAN_header, have to scan to see if we have a tRNS
             }
             break;
@@ -4487,7 +9208,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('t','R','N','S'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (z->idata) return stbi__err("tRNS after IDAT","Corrupt PNG");
+            if (z->expanded) return stbi__err("tRNS after IDAT","Corrupt PNG");
             if (pal_img_n) {
                if (scan == STBI__SCAN_header) { s->img_n = 4; return 1; }
                if (pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
@@ -4512,56 +9233,111 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
             if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
-            if ((int)(ioff + c.length) < (int)ioff) return 0;
-            if (ioff + c.length > idata_limit) {
-               stbi__uint32 idata_limit_old = idata_limit;
-               stbi_uc *p;
-               if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
-               while (ioff + c.length > idata_limit)
-                  idata_limit *= 2;
-               STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
-               z->idata = p;
+            if (z->expanded) {
+               // a critical chunk ended the image data, which must then
+               // have been complete; ignore anything after it
+               stbi__skip(s, c.length);
+               break;
             }
-            if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
-            ioff += c.length;
-            break;
+            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+               s->img_out_n = s->img_n+1;
+            else
+               s->img_out_n = s->img_n;
+            if (s->rows && !interlace) {
+               // only a window of the inflated data and a band of rows have
+               // to be in memory at once
+               stbi__png_rows *r;
+               stbi__uint32 row_bytes = (((s->img_n * s->img_x * z->depth) + 7) >> 3) + 1;
+               r = (stbi__png_rows *) stbi__malloc(sizeof(*r) + row_bytes);
+               if (r == NULL) return stbi__err("outofmem", "Out of memory");
+               z->rows = r;
+               r->row_bytes = row_bytes;
+               r->band = row_bytes < STBI__PNG_BAND_SIZE ? STBI__PNG_BAND_SIZE / row_bytes : 1;
+               r->done = 0;
+               r->color = color;
+               r->pal_img_n = pal_img_n;
+               r->pal_len = pal_len;
+               r->palette = palette;
+               r->has_trans = has_trans;
+               if (has_trans) {
+                  memcpy(r->tc, tc, sizeof(r->tc));
+                  memcpy(r->tc16, tc16, sizeof(r->tc16));
+               }
+               r->iphone = is_iphone && s->opt->de_iphone;
+               r->last = (stbi_uc *) (r+1);
+               // a colour key's alpha channel counts as a component here
+               stbi__rows_begin(s->rows, s->img_x, s->img_y, pal_img_n ? pal_img_n : s->img_n + has_trans);
+               raw_len = 4 * STBI__ZWINDOW + r->band * row_bytes + 65536;
+               if (!stbi__png_alloc_expanded(z, raw_len)) return 0;
+               if (!stbi__png_inflate_idat(z, c.length, raw_len, !is_iphone)) return 0;
+               pending = 1;
+               continue;
+            }
+            raw_len = stbi__png_raw_len(s->img_x, s->img_y, s->img_n, z->depth, interlace);
+#ifdef STBI_THREADS
+            if (s->opt->max_threads > 1 && !s->io.read && raw_len >= STBI__PNG_PARALLEL_MIN) {
+               // zlib streams with full flushes in them can be inflated in pieces
+               int bounds[STBI__PNG_MAX_SEGMENTS], size, nseg;
+               nseg = s->opt->max_threads * 4 < STBI__PNG_MAX_SEGMENTS ? s->opt->max_threads * 4 : STBI__PNG_MAX_SEGMENTS;
+               nseg = stbi__png_find_sync_points(z, c.length, bounds, nseg, &size);
+               if (nseg) {
+                  if (!stbi__png_parallel_inflate(z, c.length, raw_len, !is_iphone, bounds, nseg, size)) return 0;
+                  pending = 1;
+                  continue;
+               }
+            }
+            // rows can go out while the data is still arriving only if
+            // nothing is left to do to them after unfiltering
+            z->stream_rows = s->dest && s->dest->progress && !interlace && z->depth == 8 && !pal_img_n && !has_trans && !is_iphone;
+            if (!interlace && (z->stream_rows || (s->opt->max_threads > 1 && raw_len >= STBI__PNG_PIPELINE_MIN))) {
+               if (!stbi__png_pipelined_decode(z, c.length, raw_len, !is_iphone, color)) return 0;
+               pending = 1;
+               continue;
+            }
+#endif
+            if (!stbi__png_alloc_expanded(z, raw_len)) return 0;
+            if (!stbi__png_inflate_idat(z, c.length, raw_len, !is_iphone)) return 0;
+            pending = 1;
+            continue; // the last IDAT's CRC is consumed already
          }
 
          case STBI__PNG_TYPE('I','E','N','D'): {
-            stbi__uint32 raw_len, bpl;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
-            if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
-               s->img_out_n = s->img_n+1;
-            else
-               s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            if (z->expanded == NULL) return stbi__err("no IDAT","Corrupt PNG");
+            if (z->rows) {
+               // the rows have all gone to s->rows already
+               s->img_n = pal_img_n ? pal_img_n : s->img_n + has_trans;
+               stbi__free(z->expanded); z->expanded = NULL;
+               return 1;
+            }
+            // (a pipelined decode has produced z->out already)
+            if (!z->out) {
+               STBI__STAT_ENTER(STBI_stat_png_unfilter);
+               ok = stbi__create_png_image(z, z->expanded + STBI__PNG_INPLACE_PAD, raw_len, s->img_out_n, z->depth, color, interlace);
+               STBI__STAT_LEAVE(STBI_stat_png_unfilter, raw_len);
+               if (!ok) return 0;
+            }
             if (has_trans) {
                if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n, s->img_x * s->img_y)) return 0;
                } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency(z, tc, s->img_out_n, s->img_x * s->img_y)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
-               stbi__de_iphone(z);
+            if (is_iphone && s->opt->de_iphone && s->img_out_n > 2)
+               stbi__de_iphone(z, s->img_x * s->img_y);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n, s->img_x * s->img_y))
                   return 0;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            // rows handed out from here count a colour key's alpha too
+            if (s->rows && has_trans) ++s->img_n;
+            stbi__free(z->expanded); z->expanded = NULL;
             return 1;
          }
 
@@ -4592,15 +9368,28 @@ static unsigned char *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req
    unsigned char *result=NULL;
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
    if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
-      if (p->depth == 16) {
-         if (!stbi__reduce_png(p)) {
+      if (p->depth == 16 && !p->rows) {
+         if (!stbi__reduce_png(p, p->s->img_x * p->s->img_y)) {
             return result;
          }
       }
       result = p->out;
       p->out = NULL;
-      if (req_comp && req_comp != p->s->img_out_n) {
+      if (p->rows) {
+         result = stbi__rows_sent;
+      } else if (p->stream_rows) {
+         stbi__free(result);
+         result = p->s->dest->data;
+      } else if (p->s->dest) {
+         // converting straight into the caller's buffer saves a pass
+         STBI__STAT_ENTER(STBI_stat_png_convert);
+         result = stbi__into_dest(p->s, result, p->s->img_out_n, p->s->img_x, p->s->img_y);
+         STBI__STAT_LEAVE(STBI_stat_png_convert, result ? (double) p->s->img_x * p->s->img_y * p->s->dest->comp : 0);
+         if (result == NULL) return result;
+      } else if (req_comp && req_comp != p->s->img_out_n) {
+         STBI__STAT_ENTER(STBI_stat_png_convert);
          result = stbi__convert_format(result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+         STBI__STAT_LEAVE(STBI_stat_png_convert, result ? (double) p->s->img_x * p->s->img_y * req_comp : 0);
          p->s->img_out_n = req_comp;
          if (result == NULL) return result;
       }
@@ -4608,9 +9397,10 @@ static unsigned char *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__free(p->out);      p->out      = NULL;
+   stbi__free(p->expanded); p->expanded = NULL;
+   stbi__free(p->idat_buf); p->idat_buf = NULL;
+   stbi__free(p->rows);     p->rows     = NULL;
 
    return result;
 }
@@ -4619,6 +9409,7 @@ static unsigned char *stbi__png_load(stbi__context *s, int *x, int *y, int *comp
 {
    stbi__png p;
    p.s = s;
+   stbi__setup_png(&p);
    return stbi__do_png(&p, x,y,comp,req_comp);
 }
 
@@ -4847,7 +9638,7 @@ static stbi_uc *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (info.bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi__free(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -4858,7 +9649,7 @@ static stbi_uc *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int
       stbi__skip(s, info.offset - 14 - info.hsz - psize * (info.hsz == 12 ? 3 : 4));
       if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { stbi__free(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       for (j=0; j < (int) s->img_y; ++j) {
          for (i=0; i < (int) s->img_x; i += 2) {
@@ -4896,7 +9687,7 @@ static stbi_uc *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
@@ -5164,7 +9955,7 @@ static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int
          //   load the palette
          tga_palette = (unsigned char*)stbi__malloc( tga_palette_len * tga_comp );
          if (!tga_palette) {
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("outofmem", "Out of memory");
          }
          if (tga_rgb16) {
@@ -5175,8 +9966,8 @@ static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int
                pal_entry += tga_comp;
             }
          } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
+               stbi__free(tga_data);
+               stbi__free(tga_palette);
                return stbi__errpuc("bad palette", "Corrupt TGA");
          }
       }
@@ -5257,7 +10048,7 @@ static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int
       //   clear my palette, if I had one
       if ( tga_palette != NULL )
       {
-         STBI_FREE( tga_palette );
+         stbi__free( tga_palette );
       }
    }
 
@@ -5676,7 +10467,7 @@ static stbi_uc *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int re
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(result);
       result=0;
    }
    *px = x;
@@ -5783,13 +10574,13 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
 {
    stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(g);
    return 1;
 }
 
@@ -6054,8 +10845,8 @@ static stbi_uc *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int
          u = stbi__convert_format(u, 4, req_comp, g->w, g->h);
    }
    else if (g->out)
-      STBI_FREE(g->out);
-   STBI_FREE(g);
+      stbi__free(g->out);
+   stbi__free(g);
    return u;
 }
 
@@ -6213,12 +11004,12 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             stbi__hdr_convert(hdr_data, rgbe, req_comp);
             i = 1;
             j = 0;
-            STBI_FREE(scanline);
+            stbi__free(scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+         if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) scanline = (stbi_uc *) stbi__malloc(width * 4);
 
          for (k = 0; k < 4; ++k) {
@@ -6241,7 +11032,7 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
          for (i=0; i < width; ++i)
             stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
       }
-      STBI_FREE(scanline);
+      stbi__free(scanline);
    }
 
    return hdr_data;
@@ -6555,8 +11346,17 @@ static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_STDIO
 STBIDEF int stbi_info(char const *filename, int *x, int *y, int *comp)
 {
-    FILE *f = stbi__fopen(filename, "rb");
+    FILE *f;
     int result;
+#ifndef STBI_NO_MMAP
+    stbi__mapped_file m;
+    if (stbi__map_file(&m, filename)) {
+       result = stbi_info_from_memory(m.data, m.size, x, y, comp);
+       stbi__unmap_file(&m);
+       return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
     if (!f) return stbi__err("can't fopen", "Unable to open file");
     result = stbi_info_from_file(f, x, y, comp);
     fclose(f);
@@ -6589,6 +11389,879 @@ STBIDEF int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int
    return stbi__info_main(&s,x,y,comp);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+//  decoder objects
+//
+//  these run the same decoders as everything above, with s->opt pointing at
+//  the decoder's settings instead of the global ones, and (through
+//  stbi__g_decoder) the decoder's memory pool behind stbi__malloc
+
+static void *stbi__default_alloc(void *user, size_t size)
+{
+   STBI_NOTUSED(user);
+   return STBI_MALLOC(size);
+}
+
+static void *stbi__default_realloc(void *user, void *p, size_t old_size, size_t new_size)
+{
+   STBI_NOTUSED(user);
+   STBI_NOTUSED(old_size);
+   return STBI_REALLOC_SIZED(p, old_size, new_size);
+}
+
+static void stbi__default_free(void *user, void *p)
+{
+   STBI_NOTUSED(user);
+   STBI_FREE(p);
+}
+
+STBIDEF stbi_decoder *stbi_decoder_create_with_allocator(stbi_allocator const *a)
+{
+   stbi_decoder *d;
+   stbi_allocator def;
+   if (a == NULL) {
+      def.alloc   = stbi__default_alloc;
+      def.realloc = stbi__default_realloc;
+      def.free    = stbi__default_free;
+      def.user    = NULL;
+      a = &def;
+   }
+   d = (stbi_decoder *) a->alloc(a->user, sizeof(stbi_decoder));
+   if (d == NULL) return (stbi_decoder *) stbi__errpuc("outofmem", "Out of memory");
+   d->opt = stbi__initial_options;
+   d->failure_reason = NULL;
+   d->alloc = *a;
+   d->ncache = 0;
+#ifdef STBI_THREADS
+   stbi__mutex_init(&d->lock);
+#endif
+   return d;
+}
+
+STBIDEF stbi_decoder *stbi_decoder_create(void)
+{
+   return stbi_decoder_create_with_allocator(NULL);
+}
+
+STBIDEF void stbi_decoder_trim(stbi_decoder *d)
+{
+   int i;
+#ifdef STBI__THREAD_LOCAL
+   stbi__decoder_lock(d);
+#endif
+   for (i=0; i < d->ncache; ++i)
+      d->alloc.free(d->alloc.user, d->cache[i]);
+   d->ncache = 0;
+#ifdef STBI__THREAD_LOCAL
+   stbi__decoder_unlock(d);
+#endif
+}
+
+STBIDEF void stbi_decoder_free(stbi_decoder *d)
+{
+   if (d == NULL) return;
+   stbi_decoder_trim(d);
+#ifdef STBI_THREADS
+   stbi__mutex_destroy(&d->lock);
+#endif
+   d->alloc.free(d->alloc.user, d);
+}
+
+STBIDEF void stbi_decoder_image_free(stbi_decoder *d, void *retval_from_stbi_decoder_load)
+{
+#ifdef STBI__THREAD_LOCAL
+   stbi__decoder_release(d, retval_from_stbi_decoder_load);
+#else
+   STBI_NOTUSED(d);
+   STBI_FREE(retval_from_stbi_decoder_load);
+#endif
+}
+
+STBIDEF void stbi_decoder_set_flip_vertically_on_load(stbi_decoder *d, int flag_true_if_should_flip)
+{
+   d->opt.flip_vertically = flag_true_if_should_flip;
+}
+
+STBIDEF void stbi_decoder_set_unpremultiply_on_load(stbi_decoder *d, int flag_true_if_should_unpremultiply)
+{
+   d->opt.unpremultiply = flag_true_if_should_unpremultiply;
+}
+
+STBIDEF void stbi_decoder_convert_iphone_png_to_rgb(stbi_decoder *d, int flag_true_if_should_convert)
+{
+   d->opt.de_iphone = flag_true_if_should_convert;
+}
+
+STBIDEF void stbi_decoder_set_max_threads(stbi_decoder *d, int max_threads)
+{
+   d->opt.max_threads = max_threads < 1 ? 1 : max_threads;
+}
+
+STBIDEF void stbi_decoder_set_jpeg_scale_on_load(stbi_decoder *d, int denominator)
+{
+   d->opt.jpeg_scale = stbi__jpeg_scale_log2(denominator);
+}
+
+STBIDEF void stbi_decoder_set_jpeg_low_memory(stbi_decoder *d, int flag_true_if_should_save_memory)
+{
+   d->opt.jpeg_low_memory = flag_true_if_should_save_memory;
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF void stbi_decoder_set_cache_dir(stbi_decoder *d, char const *dir)
+{
+   d->opt.cache_dir = dir;
+}
+#endif
+
+#ifndef STBI_NO_HDR
+STBIDEF void stbi_decoder_hdr_to_ldr_gamma(stbi_decoder *d, float gamma) { d->opt.h2l_gamma_i = 1/gamma; }
+STBIDEF void stbi_decoder_hdr_to_ldr_scale(stbi_decoder *d, float scale) { d->opt.h2l_scale_i = 1/scale; }
+#endif
+
+STBIDEF const char *stbi_decoder_failure_reason(stbi_decoder *d)
+{
+   return d->failure_reason;
+}
+
+// route this thread's allocations to d until stbi__decoder_end; returns the
+// decoder that was current before, since calls can nest
+static stbi_decoder *stbi__decoder_begin(stbi_decoder *d)
+{
+#ifdef STBI__THREAD_LOCAL
+   stbi_decoder *prev = stbi__g_decoder;
+   stbi__g_decoder = d;
+   return prev;
+#else
+   STBI_NOTUSED(d);
+   return NULL;
+#endif
+}
+
+// the decoders leave their failure reason in this thread's
+// stbi__g_failure_reason; keep it with the decoder
+static int stbi__decoder_end(stbi_decoder *d, stbi_decoder *prev, int ok)
+{
+#ifdef STBI__THREAD_LOCAL
+   stbi__g_decoder = prev;
+#else
+   STBI_NOTUSED(prev);
+#endif
+   if (!ok) d->failure_reason = stbi__g_failure_reason;
+   return ok;
+}
+
+STBIDEF stbi_uc *stbi_decoder_load_from_memory(stbi_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_decoder *prev = stbi__decoder_begin(d);
+   stbi__context s;
+   stbi_uc *result;
+   stbi__start_mem(&s,buffer,len);
+   s.opt = &d->opt;
+   result = stbi__load_flip(&s,x,y,comp,req_comp);
+   stbi__decoder_end(d, prev, result != NULL);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_decoder_load_from_callbacks(stbi_decoder *d, stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_decoder *prev = stbi__decoder_begin(d);
+   stbi__context s;
+   stbi_uc *result;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   s.opt = &d->opt;
+   result = stbi__load_flip(&s,x,y,comp,req_comp);
+   stbi__decoder_end(d, prev, result != NULL);
+   return result;
+}
+
+STBIDEF int stbi_decoder_load_into_from_memory(stbi_decoder *d, stbi_uc const *buffer, int len, stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout)
+{
+   stbi_decoder *prev = stbi__decoder_begin(d);
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   s.opt = &d->opt;
+   return stbi__decoder_end(d, prev, stbi__load_into(&s,dest,dest_pitch,dest_size,x,y,comp,layout));
+}
+
+STBIDEF int stbi_decoder_info_from_memory(stbi_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi_decoder *prev = stbi__decoder_begin(d);
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   s.opt = &d->opt;
+   return stbi__decoder_end(d, prev, stbi__info_main(&s,x,y,comp));
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_decoder_load(stbi_decoder *d, char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_decoder *prev;
+   stbi__context s;
+   stbi_uc *result;
+   FILE *f;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_decoder_load_from_memory(d, m.data, m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   prev = stbi__decoder_begin(d);
+   f = stbi__fopen(filename, "rb");
+   if (!f) {
+      stbi__decoder_end(d, prev, stbi__err("can't fopen", "Unable to open file"));
+      return NULL;
+   }
+   stbi__start_file(&s,f);
+   s.opt = &d->opt;
+   result = stbi__load_flip(&s,x,y,comp,req_comp);
+   fclose(f);
+   stbi__decoder_end(d, prev, result != NULL);
+   return result;
+}
+
+STBIDEF int stbi_decoder_load_into(stbi_decoder *d, char const *filename, stbi_uc *dest, int dest_pitch, int dest_size, int *x, int *y, int *comp, int layout)
+{
+   stbi_decoder *prev;
+   stbi__context s;
+   int result;
+   FILE *f;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_decoder_load_into_from_memory(d, m.data, m.size, dest, dest_pitch, dest_size, x, y, comp, layout);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   prev = stbi__decoder_begin(d);
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__decoder_end(d, prev, stbi__err("can't fopen", "Unable to open file"));
+   stbi__start_file(&s,f);
+   s.opt = &d->opt;
+   result = stbi__load_into(&s,dest,dest_pitch,dest_size,x,y,comp,layout);
+   fclose(f);
+   return stbi__decoder_end(d, prev, result);
+}
+
+STBIDEF int stbi_decoder_info(stbi_decoder *d, char const *filename, int *x, int *y, int *comp)
+{
+   stbi_decoder *prev;
+   stbi__context s;
+   int result;
+   FILE *f;
+#ifndef STBI_NO_MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_decoder_info_from_memory(d, m.data, m.size, x, y, comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   prev = stbi__decoder_begin(d);
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__decoder_end(d, prev, stbi__err("can't fopen", "Unable to open file"));
+   stbi__start_file(&s,f);
+   s.opt = &d->opt;
+   result = stbi__info_main(&s,x,y,comp);
+   fclose(f);
+   return stbi__decoder_end(d, prev, result);
+}
+#endif // !STBI_NO_STDIO
+
+// batch loading
+
+typedef struct stbi__batch_job
+{
+   struct stbi__batch_job *next;  // in the queue
+   struct stbi__batch_job *next_waitable;
+   int id, done;
+   char *filename;                // a copy; NULL for a memory load
+   stbi_uc const *buffer;
+   int len;
+   stbi_uc *dest;                 // NULL to allocate the image
+   int dest_pitch, dest_size;
+   int comp;                      // req_comp, or the layout for dest
+   stbi_batch_callback callback;
+   void *user;
+   stbi_batch_result result;
+} stbi__batch_job;
+
+struct stbi_batch
+{
+   stbi__options opt;
+   stbi__batch_job *head, *tail;  // queued, not started
+   stbi__batch_job *waitable;     // loads without a callback, until waited for
+   int next_id, in_flight, max_in_flight;
+#ifdef STBI_THREADS
+   stbi__mutex lock;
+   stbi__cond  changed;
+   stbi__thread threads[STBI__MAX_THREADS];
+   int nthreads, quit;
+#endif
+};
+
+static void stbi__batch_lock(stbi_batch *b)
+{
+#ifdef STBI_THREADS
+   stbi__mutex_lock(&b->lock);
+#else
+   STBI_NOTUSED(b);
+#endif
+}
+
+static void stbi__batch_unlock(stbi_batch *b)
+{
+#ifdef STBI_THREADS
+   stbi__mutex_unlock(&b->lock);
+#else
+   STBI_NOTUSED(b);
+#endif
+}
+
+// without workers every load has finished before its add returns, so
+// nothing ever waits
+static void stbi__batch_sleep(stbi_batch *b)
+{
+#ifdef STBI_THREADS
+   stbi__cond_wait(&b->changed, &b->lock);
+#else
+   STBI_NOTUSED(b);
+#endif
+}
+
+static void stbi__batch_wake(stbi_batch *b)
+{
+#ifdef STBI_THREADS
+   stbi__cond_broadcast(&b->changed);
+#else
+   STBI_NOTUSED(b);
+#endif
+}
+
+static int stbi__batch_decode_from(stbi_batch *b, stbi__batch_job *j, stbi__context *s)
+{
+   stbi_batch_result *r = &j->result;
+   s->opt = &b->opt;
+   if (j->dest)
+      return stbi__load_into(s, j->dest, j->dest_pitch, j->dest_size, &r->x, &r->y, &r->comp, j->comp);
+   return (r->data = stbi__load_flip(s, &r->x, &r->y, &r->comp, j->comp)) != NULL;
+}
+
+static void stbi__batch_decode(stbi_batch *b, stbi__batch_job *j)
+{
+   stbi__context s;
+   int ok;
+#ifndef STBI_NO_STDIO
+   if (j->filename) {
+      FILE *f;
+#ifndef STBI_NO_MMAP
+      stbi__mapped_file m;
+      if (stbi__map_file(&m, j->filename)) {
+         stbi__start_mem(&s, m.data, m.size);
+         ok = stbi__batch_decode_from(b, j, &s);
+         stbi__unmap_file(&m);
+      } else
+#endif
+      if ((f = stbi__fopen(j->filename, "rb")) != NULL) {
+         stbi__start_file(&s, f);
+         ok = stbi__batch_decode_from(b, j, &s);
+         fclose(f);
+      } else
+         ok = stbi__err("can't fopen", "Unable to open file");
+   } else
+#endif
+   {
+      stbi__start_mem(&s, j->buffer, j->len);
+      ok = stbi__batch_decode_from(b, j, &s);
+   }
+   if (ok && j->dest) j->result.data = j->dest;
+   // the reason is per-thread, so pick it up on the thread that failed
+   j->result.failure_reason = ok ? NULL : stbi__g_failure_reason;
+}
+
+static void stbi__batch_run(stbi_batch *b, stbi__batch_job *j)
+{
+   stbi__batch_decode(b, j);
+   stbi__batch_lock(b);
+   if (j->callback) {
+      stbi__batch_unlock(b);
+      j->callback(j->user, j->id, &j->result);
+      stbi__free(j->filename);
+      stbi__free(j);
+      stbi__batch_lock(b);
+   } else
+      j->done = 1;
+   --b->in_flight;
+   stbi__batch_unlock(b);
+   stbi__batch_wake(b);
+}
+
+#ifdef STBI_THREADS
+static void stbi__batch_worker(void *arg)
+{
+   stbi_batch *b = (stbi_batch *) arg;
+   for (;;) {
+      stbi__batch_job *j;
+      stbi__mutex_lock(&b->lock);
+      while (b->head == NULL && !b->quit)
+         stbi__cond_wait(&b->changed, &b->lock);
+      j = b->head;
+      if (j) b->head = j->next;
+      stbi__mutex_unlock(&b->lock);
+      if (j == NULL) break;
+      stbi__batch_run(b, j);
+   }
+}
+#endif
+
+STBIDEF stbi_batch *stbi_batch_create(int threads, int max_in_flight)
+{
+   stbi_batch *b = (stbi_batch *) stbi__malloc(sizeof(*b));
+   if (b == NULL) return (stbi_batch *) stbi__errpuc("outofmem", "Out of memory");
+   b->opt = stbi__default_options;
+   b->head = b->tail = b->waitable = NULL;
+   b->next_id = 0;
+   b->in_flight = 0;
+   b->max_in_flight = max_in_flight > 0 ? max_in_flight : 0x7fffffff;
+#ifdef STBI_THREADS
+   stbi__mutex_init(&b->lock);
+   stbi__cond_init(&b->changed);
+   b->quit = 0;
+   if (threads > STBI__MAX_THREADS) threads = STBI__MAX_THREADS;
+   for (b->nthreads=0; b->nthreads < threads; ++b->nthreads)
+      if (!stbi__thread_create(&b->threads[b->nthreads], stbi__batch_worker, b))
+         break;
+#else
+   STBI_NOTUSED(threads);
+#endif
+   return b;
+}
+
+static int stbi__batch_add(stbi_batch *b, char const *filename, stbi_uc const *buffer, int len, stbi_uc *dest, int dest_pitch, int dest_size, int comp, stbi_batch_callback callback, void *user)
+{
+   stbi__batch_job *j = (stbi__batch_job *) stbi__malloc(sizeof(*j));
+   int id;
+   if (j == NULL) return stbi__err("outofmem", "Out of memory") - 1;
+   j->filename = NULL;
+   if (filename) {
+      size_t n = strlen(filename) + 1;
+      j->filename = (char *) stbi__malloc(n);
+      if (j->filename == NULL) { stbi__free(j); return stbi__err("outofmem", "Out of memory") - 1; }
+      memcpy(j->filename, filename, n);
+   }
+   j->next = j->next_waitable = NULL;
+   j->done = 0;
+   j->buffer = buffer;
+   j->len = len;
+   j->dest = dest;
+   j->dest_pitch = dest_pitch;
+   j->dest_size = dest_size;
+   j->comp = comp;
+   j->callback = callback;
+   j->user = user;
+   memset(&j->result, 0, sizeof(j->result));
+
+   stbi__batch_lock(b);
+   while (b->in_flight >= b->max_in_flight)
+      stbi__batch_sleep(b);
+   ++b->in_flight;
+   id = j->id = b->next_id++;
+   if (!callback) {
+      j->next_waitable = b->waitable;
+      b->waitable = j;
+   }
+#ifdef STBI_THREADS
+   if (b->nthreads) {
+      // from here on j belongs to the workers
+      if (b->head) b->tail->next = j; else b->head = j;
+      b->tail = j;
+      stbi__batch_unlock(b);
+      stbi__batch_wake(b);
+      return id;
+   }
+#endif
+   stbi__batch_unlock(b);
+   stbi__batch_run(b, j);
+   return id;
+}
+
+STBIDEF int stbi_batch_load_from_memory(stbi_batch *b, stbi_uc const *buffer, int len, int req_comp, stbi_batch_callback callback, void *user)
+{
+   return stbi__batch_add(b, NULL, buffer, len, NULL, 0, 0, req_comp, callback, user);
+}
+
+STBIDEF int stbi_batch_load_into_from_memory(stbi_batch *b, stbi_uc const *buffer, int len, stbi_uc *dest, int dest_pitch, int dest_size, int layout, stbi_batch_callback callback, void *user)
+{
+   if (dest == NULL) return stbi__err("bad layout", "Internal error") - 1;
+   return stbi__batch_add(b, NULL, buffer, len, dest, dest_pitch, dest_size, layout, callback, user);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_batch_load(stbi_batch *b, char const *filename, int req_comp, stbi_batch_callback callback, void *user)
+{
+   return stbi__batch_add(b, filename, NULL, 0, NULL, 0, 0, req_comp, callback, user);
+}
+
+STBIDEF int stbi_batch_load_into(stbi_batch *b, char const *filename, stbi_uc *dest, int dest_pitch, int dest_size, int layout, stbi_batch_callback callback, void *user)
+{
+   if (dest == NULL) return stbi__err("bad layout", "Internal error") - 1;
+   return stbi__batch_add(b, filename, NULL, 0, dest, dest_pitch, dest_size, layout, callback, user);
+}
+#endif
+
+STBIDEF int stbi_batch_wait(stbi_batch *b, int id, stbi_batch_result *result)
+{
+   stbi__batch_job **p, *j;
+   stbi__batch_lock(b);
+   for (p = &b->waitable; *p && (*p)->id != id; p = &(*p)->next_waitable)
+      ;
+   j = *p;
+   if (j == NULL) {
+      stbi__batch_unlock(b);
+      memset(result, 0, sizeof(*result));
+      result->failure_reason = "unknown batch id";
+      return 0;
+   }
+   while (!j->done)
+      stbi__batch_sleep(b);
+   // the list may have changed while we slept
+   for (p = &b->waitable; *p != j; p = &(*p)->next_waitable)
+      ;
+   *p = j->next_waitable;
+   stbi__batch_unlock(b);
+   *result = j->result;
+   stbi__free(j->filename);
+   stbi__free(j);
+   return result->data != NULL;
+}
+
+STBIDEF void stbi_batch_wait_all(stbi_batch *b)
+{
+   stbi__batch_lock(b);
+   while (b->in_flight)
+      stbi__batch_sleep(b);
+   stbi__batch_unlock(b);
+}
+
+STBIDEF void stbi_batch_free(stbi_batch *b)
+{
+   if (b == NULL) return;
+   stbi_batch_wait_all(b);
+#ifdef STBI_THREADS
+   {
+      int i;
+      stbi__batch_lock(b);
+      b->quit = 1;
+      stbi__batch_unlock(b);
+      stbi__batch_wake(b);
+      for (i=0; i < b->nthreads; ++i)
+         stbi__thread_join(&b->threads[i]);
+      stbi__cond_destroy(&b->changed);
+      stbi__mutex_destroy(&b->lock);
+   }
+#endif
+   while (b->waitable) {
+      stbi__batch_job *j = b->waitable;
+      b->waitable = j->next_waitable;
+      if (!j->dest) stbi_image_free(j->result.data);
+      stbi__free(j->filename);
+      stbi__free(j);
+   }
+   stbi__free(b);
+}
+
+// streaming
+//
+// the stream keeps everything fed to it, and the decoder reads that through
+// callbacks which block until the bytes they want have arrived. it decodes
+// twice over the same bytes: stbi__info_main for the size, so the image can
+// be handed out before any of it is decoded, then stbi__load_into_dest.
+
+struct stbi_stream
+{
+   stbi__options opt;
+   stbi_uc *buf;                  // all the data fed so far
+   int len, cap;
+   int layout, ended, cancel, done, ok;
+   stbi_uc *pixels;               // NULL until the size is known
+   int x, y, comp, rows, previews;
+   const char *failure_reason;
+#ifdef STBI_THREADS
+   stbi__mutex lock;
+   stbi__cond  changed;
+   stbi__thread thread;
+   int started;
+#endif
+};
+
+static void stbi__stream_lock(stbi_stream *st)
+{
+#ifdef STBI_THREADS
+   stbi__mutex_lock(&st->lock);
+#else
+   STBI_NOTUSED(st);
+#endif
+}
+
+static void stbi__stream_unlock(stbi_stream *st)
+{
+#ifdef STBI_THREADS
+   stbi__mutex_unlock(&st->lock);
+#else
+   STBI_NOTUSED(st);
+#endif
+}
+
+static void stbi__stream_wake(stbi_stream *st)
+{
+#ifdef STBI_THREADS
+   stbi__cond_broadcast(&st->changed);
+#else
+   STBI_NOTUSED(st);
+#endif
+}
+
+#ifdef STBI_THREADS
+typedef struct
+{
+   stbi_stream *st;
+   int pos;
+} stbi__stream_reader;
+
+// wait for n bytes after the reader's position, the end of the data, or
+// stbi_stream_free; returns how many there are, up to n
+static int stbi__stream_wait(stbi__stream_reader *r, int n)
+{
+   stbi_stream *st = r->st;
+   STBI__STAT_ENTER(STBI__STAT_OTHER);
+   while (st->len - r->pos < n && !st->ended && !st->cancel)
+      stbi__cond_wait(&st->changed, &st->lock);
+   STBI__STAT_LEAVE(STBI__STAT_OTHER, 0);
+   if (st->cancel || st->len <= r->pos) return 0;
+   return st->len - r->pos < n ? st->len - r->pos : n;
+}
+
+static int stbi__stream_read(void *user, char *data, int size)
+{
+   stbi__stream_reader *r = (stbi__stream_reader *) user;
+   int n;
+   stbi__mutex_lock(&r->st->lock);
+   n = stbi__stream_wait(r, size);
+   memcpy(data, r->st->buf + r->pos, n);
+   r->pos += n;
+   stbi__mutex_unlock(&r->st->lock);
+   return n;
+}
+
+static void stbi__stream_skip(void *user, int n)
+{
+   ((stbi__stream_reader *) user)->pos += n;
+}
+
+static int stbi__stream_eof(void *user)
+{
+   stbi__stream_reader *r = (stbi__stream_reader *) user;
+   int n;
+   stbi__mutex_lock(&r->st->lock);
+   n = stbi__stream_wait(r, 1);
+   stbi__mutex_unlock(&r->st->lock);
+   return n == 0;
+}
+
+static stbi_io_callbacks stbi__stream_callbacks =
+{
+   stbi__stream_read,
+   stbi__stream_skip,
+   stbi__stream_eof,
+};
+#endif
+
+// a context reading the stream from the start
+static void stbi__stream_start(stbi_stream *st, stbi__context *s, void *reader)
+{
+#ifdef STBI_THREADS
+   if (reader) {
+      ((stbi__stream_reader *) reader)->st = st;
+      ((stbi__stream_reader *) reader)->pos = 0;
+      stbi__start_callbacks(s, &stbi__stream_callbacks, reader);
+   } else
+#else
+   STBI_NOTUSED(reader);
+#endif
+   stbi__start_mem(s, st->buf, st->len);
+   s->opt = &st->opt;
+}
+
+static void stbi__stream_progress(void *user, int rows, int preview)
+{
+   stbi_stream *st = (stbi_stream *) user;
+   stbi__stream_lock(st);
+   if (preview)
+      ++st->previews;
+   else
+      st->rows = rows;
+   stbi__stream_unlock(st);
+}
+
+// reader is NULL to decode what has been fed, all of it there already
+static void stbi__stream_decode(stbi_stream *st, void *reader)
+{
+   stbi__context s;
+   stbi__dest d;
+   stbi_uc *pixels = NULL;
+   int x, y, comp, ok;
+
+   stbi__stream_start(st, &s, reader);
+   ok = stbi__info_main(&s, &x, &y, &comp);
+   if (ok) {
+      int n = st->layout > STBI_rgb_alpha ? st->layout-2 : st->layout;
+      if ((stbi__uint64) x * y * n > 0x7fffffff)
+         ok = stbi__err("too large", "Image too large to decode");
+      else if ((pixels = (stbi_uc *) stbi__malloc((size_t) x * y * n)) == NULL)
+         ok = stbi__err("outofmem", "Out of memory");
+      else {
+         stbi__stream_lock(st);
+         st->pixels = pixels;
+         st->x = x;
+         st->y = y;
+         st->comp = comp;
+         stbi__stream_unlock(st);
+
+         stbi__stream_start(st, &s, reader);
+         stbi__dest_init(&d, &s, pixels, x * n, x * y * n, st->layout);
+         d.progress = stbi__stream_progress;
+         d.user = st;
+         ok = stbi__load_into_dest(&s, &d, &x, &y, &comp);
+      }
+   }
+   stbi__stream_lock(st);
+   if (ok) st->rows = y;
+   st->ok = ok;
+   st->done = 1;
+   // the reason is per-thread, so pick it up on the thread that failed
+   st->failure_reason = ok ? NULL : stbi__g_failure_reason;
+   stbi__stream_unlock(st);
+   stbi__stream_wake(st);
+}
+
+#ifdef STBI_THREADS
+static void stbi__stream_thread(void *arg)
+{
+   stbi__stream_reader r;
+   stbi__stream_decode((stbi_stream *) arg, &r);
+}
+#endif
+
+STBIDEF stbi_stream *stbi_stream_create(int layout)
+{
+   stbi_stream *st;
+   if (layout < STBI_grey || layout > STBI_bgr_alpha) return (stbi_stream *) stbi__errpuc("bad layout", "Internal error");
+   st = (stbi_stream *) stbi__malloc(sizeof(*st));
+   if (st == NULL) return (stbi_stream *) stbi__errpuc("outofmem", "Out of memory");
+   memset(st, 0, sizeof(*st));
+   st->opt = stbi__default_options;
+   st->opt.flip_vertically = 0;
+   st->layout = layout;
+#ifdef STBI_THREADS
+   stbi__mutex_init(&st->lock);
+   stbi__cond_init(&st->changed);
+   // if there's no thread, decode everything at the end
+   st->started = stbi__thread_create(&st->thread, stbi__stream_thread, st);
+#endif
+   return st;
+}
+
+STBIDEF int stbi_stream_feed(stbi_stream *st, void const *data, int len)
+{
+   int ok = 1;
+   stbi__stream_lock(st);
+   if (st->ended || (st->done && !st->ok) || len < 0 || len > 0x7fffffff - st->len)
+      ok = 0;
+   else if (st->len + len > st->cap) {
+      int cap = st->cap ? st->cap : 4096;
+      stbi_uc *p;
+      while (cap < st->len + len)
+         cap = cap > 0x3fffffff ? 0x7fffffff : cap*2;
+      p = (stbi_uc *) stbi__realloc_sized(st->buf, st->cap, cap);
+      if (p == NULL)
+         ok = stbi__err("outofmem", "Out of memory");
+      else {
+         st->buf = p;
+         st->cap = cap;
+      }
+   }
+   if (ok) {
+      memcpy(st->buf + st->len, data, len);
+      st->len += len;
+   }
+   stbi__stream_unlock(st);
+   stbi__stream_wake(st);
+   return ok;
+}
+
+STBIDEF int stbi_stream_end(stbi_stream *st)
+{
+   int ok;
+   stbi__stream_lock(st);
+   st->ended = 1;
+#ifdef STBI_THREADS
+   if (st->started) {
+      stbi__cond_broadcast(&st->changed);
+      while (!st->done)
+         stbi__cond_wait(&st->changed, &st->lock);
+   }
+#endif
+   ok = st->done;
+   stbi__stream_unlock(st);
+   if (!ok) stbi__stream_decode(st, NULL);
+   return st->ok;
+}
+
+STBIDEF stbi_uc const *stbi_stream_image(stbi_stream *st, int *x, int *y, int *comp, int *rows_ready, int *previews)
+{
+   stbi_uc *pixels;
+   stbi__stream_lock(st);
+   pixels = st->pixels;
+   if (x) *x = st->x;
+   if (y) *y = st->y;
+   if (comp) *comp = st->comp;
+   if (rows_ready) *rows_ready = st->rows;
+   if (previews) *previews = st->previews;
+   stbi__stream_unlock(st);
+   return pixels;
+}
+
+STBIDEF const char *stbi_stream_failure_reason(stbi_stream *st)
+{
+   const char *reason;
+   stbi__stream_lock(st);
+   reason = st->failure_reason;
+   stbi__stream_unlock(st);
+   return reason;
+}
+
+STBIDEF void stbi_stream_free(stbi_stream *st)
+{
+   if (st == NULL) return;
+#ifdef STBI_THREADS
+   // a decode still waiting for data fails as if the data had run out
+   stbi__mutex_lock(&st->lock);
+   st->cancel = 1;
+   stbi__mutex_unlock(&st->lock);
+   stbi__cond_broadcast(&st->changed);
+   if (st->started) stbi__thread_join(&st->thread);
+   stbi__cond_destroy(&st->changed);
+   stbi__mutex_destroy(&st->lock);
+#endif
+   stbi__free(st->pixels);
+   stbi__free(st->buf);
+   stbi__free(st);
+}
+
 #endif // STB_IMAGE_IMPLEMENTATION
 
 /*
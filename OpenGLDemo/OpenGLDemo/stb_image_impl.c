@@ -0,0 +1,4 @@
+// the stb_image implementation, built once for the whole program
+#define STBI_THREADS // decode on worker threads; Main.cpp's texture batch relies on it
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"